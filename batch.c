@@ -0,0 +1,632 @@
+/** @file batch.c
+ *  @brief This module checks the images of a manifest in a pool of
+ *   worker processes
+ *
+ *   The manifest lists an image per line, followed by the partition to
+ *   check or by nothing for every Linux partition. Empty lines and
+ *   lines starting with '#' are skipped. A planner process reads the
+ *   partition table and superblocks of every image once, to find the
+ *   partitions and estimate the memory of the largest one. A damaged
+ *   image can make it exit, another planner then goes on with the next
+ *   image.
+ *
+ *   The workers are forked once the plans are known and check image
+ *   after image, so the program starts and sets up once for the whole
+ *   manifest. Jobs are handed out in manifest order while their
+ *   estimate fits in the memory budget next to the running ones. A job
+ *   that does not fit waits and later, smaller ones pass it; a job
+ *   larger than the whole budget runs once nothing else does. A worker
+ *   dying in a check is replaced and its job reported as crashed.
+ *
+ *   The output of each check goes to a log of its own, or nowhere, and
+ *   one report sums up the manifest at the end.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "fsck.h"
+#include "readwrite.h"
+#include "problem.h"
+#include "batch.h"
+
+/*** global variables ***/
+/** file descriptor of the disk image */
+extern int disk;
+
+/** workers running at once, 0 for one per processor */
+static int num_workers = 0;
+/** bytes the running checks may take together, 0 for a share of the
+ *  physical memory */
+static long budget = 0;
+/** directory of the check outputs, NULL to drop them */
+static const char* log_dir = NULL;
+/** open the images with O_DIRECT */
+static int use_direct = 0;
+
+static batch_job_t* jobs = NULL;
+static int num_jobs = 0;
+static batch_worker_t* workers = NULL;
+
+/** jobs before this one are not pending */
+static int first_pending = 0;
+static int num_running = 0;
+/** estimated bytes of the running jobs */
+static long mem_in_use = 0;
+static long mem_peak = 0;
+
+
+/** @brief read the monotonic clock in seconds
+ *
+ *  @return double
+ */
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** @brief set how many images are checked at once
+ *
+ *  @param n number of workers, 0 for one per processor
+ *  @return void
+ */
+void batch_set_workers(int n)
+{
+	num_workers = n;
+}
+
+
+/** @brief set the memory the running checks may take together
+ *
+ *  @param mb megabytes, 0 for a share of the physical memory
+ *  @return void
+ */
+void batch_set_budget(long mb)
+{
+	budget = mb << 20;
+}
+
+
+/** @brief keep the output of every check in a directory
+ *
+ *  @param dir directory, the log of job n is n.log
+ *  @return void
+ */
+void batch_set_logs(const char* dir)
+{
+	log_dir = dir;
+}
+
+
+/** @brief read or write a whole buffer through a pipe
+ *
+ *  @param fd pipe end
+ *  @param buf buffer
+ *  @param len bytes
+ *  @param writing 1 to write, 0 to read
+ *  @return 0 success or -1 if the other end is gone
+ */
+static int pipe_transfer(int fd, void* buf, long len, int writing)
+{
+	unsigned char* p = (unsigned char*)buf;
+	long done = 0;
+
+	while (done < len)
+	{
+		ssize_t n = writing ? write(fd, p + done, len - done)
+		                    : read(fd, p + done, len - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+
+/** @brief read the jobs of a manifest
+ *
+ *  @param path manifest file
+ *  @return 0 success or -1 fail
+ */
+static int read_manifest(const char* path)
+{
+	char line[BATCH_LINE_MAX];
+	char image[BATCH_LINE_MAX];
+	int max_jobs = 0;
+	FILE* fp = fopen(path, "r");
+
+	if (fp == NULL)
+	{
+		perror("Could not open manifest");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		int partition = 0;
+		if (sscanf(line, "%s %d", image, &partition) < 1 || image[0] == '#')
+			continue;
+
+		if (num_jobs == max_jobs)
+		{
+			max_jobs = max_jobs == 0 ? 16 : max_jobs * 2;
+			batch_job_t* grown =
+			   (batch_job_t*)realloc(jobs, max_jobs * sizeof(batch_job_t));
+			if (grown == NULL)
+			{
+				fclose(fp);
+				return -1;
+			}
+			jobs = grown;
+		}
+		batch_job_t* job = &jobs[num_jobs];
+		memset(job, 0, sizeof(batch_job_t));
+		if ((job->image = strdup(image)) == NULL)
+		{
+			fclose(fp);
+			return -1;
+		}
+		job->partition = partition;
+		job->state = BATCH_SKIPPED;
+		num_jobs++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+
+/** @brief find the partitions of a job and estimate the memory of its
+ *   largest one, then send them to the parent. Runs in the planner.
+ *
+ *  @param n job number
+ *  @param fd pipe to the parent
+ *  @return 0 success or -1 if the parent is gone
+ */
+static int plan_job(int n, int fd)
+{
+	batch_job_t* job = &jobs[n];
+	batch_plan_t plan = {n, 0, 0};
+	partition_t pt;
+	int* parts = NULL;
+	int max_parts = 0;
+	int i = 0;
+
+	if (job->partition >= 0 && (disk = open(job->image, O_RDONLY)) != -1)
+	{
+		hole_map_build();
+		for (i = job->partition > 0 ? job->partition : 1; ; i++)
+		{
+			if (job->partition == 0)
+			{
+				if (read_partition_info(i, &pt) == -1)
+					break;
+				if (pt.type != 0x83)
+					continue;
+			}
+			if (plan.num_parts == max_parts)
+			{
+				max_parts = max_parts == 0 ? 8 : max_parts * 2;
+				int* grown = (int*)realloc(parts, max_parts * sizeof(int));
+				if (grown == NULL)
+					break;
+				parts = grown;
+			}
+			parts[plan.num_parts++] = i;
+			long mem = fsck_estimate_memory(i);
+			if (mem > plan.mem)
+				plan.mem = mem;
+			if (job->partition > 0)
+				break;
+		}
+		close(disk);
+	}
+
+	int ret = 0;
+	if (pipe_transfer(fd, &plan, sizeof(plan), 1) == -1 ||
+	    pipe_transfer(fd, parts, plan.num_parts * sizeof(int), 1) == -1)
+		ret = -1;
+	free(parts);
+	return ret;
+}
+
+
+/** @brief plan every job. Each planner starts after the last job
+ *   planned, the job a planner died on is skipped.
+ *
+ *  @return void
+ */
+static void plan_jobs()
+{
+	int next = 0;
+
+	while (next < num_jobs)
+	{
+		int fds[2];
+		if (pipe(fds) == -1)
+			return;
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == -1)
+		{
+			close(fds[0]);
+			close(fds[1]);
+			return;
+		}
+		if (pid == 0)
+		{
+			/* messages about damaged images are left to the checks */
+			int null_fd = open("/dev/null", O_WRONLY);
+			if (null_fd != -1)
+				dup2(null_fd, STDOUT_FILENO);
+			close(fds[0]);
+			for (; next < num_jobs; next++)
+				if (plan_job(next, fds[1]) == -1)
+					break;
+			_exit(0);
+		}
+		close(fds[1]);
+
+		batch_plan_t plan;
+		while (pipe_transfer(fds[0], &plan, sizeof(plan), 0) == 0)
+		{
+			batch_job_t* job = &jobs[plan.job];
+			job->parts = (int*)malloc((plan.num_parts + 1) * sizeof(int));
+			if (job->parts == NULL ||
+			    pipe_transfer(fds[0], job->parts,
+			                  plan.num_parts * sizeof(int), 0) == -1)
+				break;
+			job->num_parts = plan.num_parts;
+			job->mem = plan.mem;
+			if (job->num_parts > 0)
+				job->state = BATCH_PENDING;
+			next = plan.job + 1;
+		}
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		if (next < num_jobs && jobs[next].num_parts == 0)
+			/* the planner died on this image */
+			next++;
+	}
+}
+
+
+/** @brief send the output of the next check to its log
+ *
+ *  @param n job number
+ *  @return void
+ */
+static void open_log(int n)
+{
+	char path[BATCH_LINE_MAX];
+	int fd = -1;
+
+	fflush(stdout);
+	if (log_dir != NULL)
+	{
+		snprintf(path, sizeof(path), "%s/%d.log", log_dir, n + 1);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			perror("Could not open check log");
+	}
+	if (fd == -1 && (fd = open("/dev/null", O_WRONLY)) == -1)
+		return;
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+
+/** @brief check the partitions of a job. Runs in a worker.
+ *
+ *  @param n job number
+ *  @param result outcome of the job
+ *  @return void
+ */
+static void run_job(int n, batch_result_t* result)
+{
+	batch_job_t* job = &jobs[n];
+	double start = now_seconds();
+	int i = 0;
+
+	memset(result, 0, sizeof(batch_result_t));
+	result->job = n;
+	open_log(n);
+	printf("checking %s\n\n", job->image);
+	if (disk_open(job->image, use_direct) == -1)
+		result->failed_parts = job->num_parts;
+	else
+	{
+		for (i = 0; i < job->num_parts; i++)
+			if (fix_fs(job->parts[i]) == -1)
+				result->failed_parts++;
+		close(disk);
+	}
+	problem_totals(result->problems);
+	result->seconds = now_seconds() - start;
+	fflush(stdout);
+}
+
+
+/** @brief start a worker in a slot. The worker checks the jobs whose
+ *   numbers come through its pipe until the pipe is closed.
+ *
+ *  @param w worker slot
+ *  @return 0 success or -1 fail
+ */
+static int spawn_worker(int w)
+{
+	int job_fds[2], result_fds[2];
+	int i = 0;
+
+	if (pipe(job_fds) == -1)
+		return -1;
+	if (pipe(result_fds) == -1)
+	{
+		close(job_fds[0]);
+		close(job_fds[1]);
+		return -1;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		close(job_fds[0]);
+		close(job_fds[1]);
+		close(result_fds[0]);
+		close(result_fds[1]);
+		return -1;
+	}
+	if (pid == 0)
+	{
+		/* the other workers must see their pipes closed by the parent */
+		for (i = 0; i < num_workers; i++)
+			if (workers[i].pid != -1)
+			{
+				close(workers[i].job_fd);
+				close(workers[i].result_fd);
+			}
+		close(job_fds[1]);
+		close(result_fds[0]);
+
+		int n = 0;
+		batch_result_t result;
+		while (pipe_transfer(job_fds[0], &n, sizeof(n), 0) == 0)
+		{
+			run_job(n, &result);
+			if (pipe_transfer(result_fds[1], &result, sizeof(result), 1) == -1)
+				break;
+		}
+		_exit(0);
+	}
+	close(job_fds[0]);
+	close(result_fds[1]);
+	workers[w].pid = pid;
+	workers[w].job_fd = job_fds[1];
+	workers[w].result_fd = result_fds[0];
+	workers[w].job = -1;
+	return 0;
+}
+
+
+/** @brief find the next job that fits in the memory left, or any
+ *   pending job when nothing runs
+ *
+ *  @return job number or -1
+ */
+static int next_job()
+{
+	int i = 0;
+
+	while (first_pending < num_jobs && jobs[first_pending].state != BATCH_PENDING)
+		first_pending++;
+	for (i = first_pending; i < num_jobs; i++)
+		if (jobs[i].state == BATCH_PENDING &&
+		    (num_running == 0 || mem_in_use + jobs[i].mem <= budget))
+			return i;
+	return -1;
+}
+
+
+/** @brief hand jobs to idle workers while they fit
+ *
+ *  @return void
+ */
+static void dispatch_jobs()
+{
+	int w = 0, n = 0;
+
+	for (w = 0; w < num_workers; w++)
+	{
+		if (workers[w].pid == -1 && spawn_worker(w) == -1)
+			continue;
+		if (workers[w].job != -1)
+			continue;
+		if ((n = next_job()) == -1)
+			return;
+		/* a worker gone by now shows up as a crash when polled */
+		pipe_transfer(workers[w].job_fd, &n, sizeof(n), 1);
+		workers[w].job = n;
+		jobs[n].state = BATCH_RUNNING;
+		num_running++;
+		mem_in_use += jobs[n].mem;
+		if (mem_in_use > mem_peak)
+			mem_peak = mem_in_use;
+	}
+}
+
+
+/** @brief take the result of the job of a worker, or replace the worker
+ *   when it died
+ *
+ *  @param w worker slot
+ *  @return void
+ */
+static void collect_result(int w)
+{
+	batch_result_t result;
+	batch_job_t* job = &jobs[workers[w].job];
+
+	if (pipe_transfer(workers[w].result_fd, &result, sizeof(result), 0) == 0)
+	{
+		job->state = result.failed_parts > 0 ? BATCH_FAILED : BATCH_DONE;
+		job->failed_parts = result.failed_parts;
+		job->seconds = result.seconds;
+		memcpy(job->problems, result.problems, sizeof(job->problems));
+	}
+	else
+	{
+		job->state = BATCH_CRASHED;
+		close(workers[w].job_fd);
+		close(workers[w].result_fd);
+		waitpid(workers[w].pid, NULL, 0);
+		workers[w].pid = -1;
+	}
+	workers[w].job = -1;
+	num_running--;
+	mem_in_use -= job->mem;
+}
+
+
+/** @brief print the outcome of every job and the problems of all
+ *
+ *  @param seconds time of the whole batch
+ *  @return number of jobs not checked in full
+ */
+static int print_report(double seconds)
+{
+	static const char* results[] =
+		{"pending", "running", "clean", "failed", "crashed", "skipped"};
+	long totals[PR_NUM];
+	int i = 0, k = 0, failed = 0;
+
+	memset(totals, 0, sizeof(totals));
+	printf("batch of %d images, %d workers, memory budget %ld MB\n",
+	       num_jobs, num_workers, budget >> 20);
+	printf("%5s  %-8s %5s %9s %9s %9s  %s\n", "job", "result", "parts",
+	       "memory MB", "seconds", "problems", "image");
+	for (i = 0; i < num_jobs; i++)
+	{
+		batch_job_t* job = &jobs[i];
+		long problems = 0;
+		for (k = 0; k < PR_NUM; k++)
+		{
+			problems += job->problems[k];
+			totals[k] += job->problems[k];
+		}
+		const char* result = results[job->state];
+		if (job->state == BATCH_DONE && problems > 0)
+			result = "fixed";
+		if (job->state != BATCH_DONE)
+			failed++;
+		printf("%5d  %-8s %5d %9.1f %9.2f %9ld  %s\n", i + 1, result,
+		       job->num_parts, job->mem / 1048576.0, job->seconds,
+		       problems, job->image);
+	}
+
+	printf("problems found in all images:\n");
+	for (k = 0; k < PR_NUM; k++)
+		if (totals[k] > 0)
+			printf("  %-26s %ld\n", problem_desc(k), totals[k]);
+	printf("%d images checked in %.2f s, %d not in full, "
+	       "peak memory %.1f MB\n", num_jobs - failed, seconds, failed,
+	       mem_peak / 1048576.0);
+	fflush(stdout);
+	return failed;
+}
+
+
+/** @brief check every image of a manifest
+ *
+ *  @param manifest manifest file
+ *  @param direct open the images with O_DIRECT
+ *  @return number of jobs not checked in full, or -1 fail
+ */
+int batch_run(const char* manifest, int direct)
+{
+	double start = now_seconds();
+	int i = 0;
+
+	use_direct = direct;
+	if (read_manifest(manifest) == -1)
+		return -1;
+	/* a worker gone is noticed on its result pipe */
+	signal(SIGPIPE, SIG_IGN);
+	plan_jobs();
+
+	if (budget <= 0)
+		budget = (long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE)
+		         / BATCH_BUDGET_SHARE;
+	if (num_workers <= 0)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_workers > num_jobs)
+		num_workers = num_jobs;
+	if (num_workers < 1)
+		num_workers = 1;
+	workers = (batch_worker_t*)malloc(num_workers * sizeof(batch_worker_t));
+	if (workers == NULL)
+		return -1;
+	for (i = 0; i < num_workers; i++)
+	{
+		workers[i].pid = -1;
+		workers[i].job = -1;
+	}
+
+	struct pollfd* fds =
+	   (struct pollfd*)malloc(num_workers * sizeof(struct pollfd));
+	int* slots = (int*)malloc(num_workers * sizeof(int));
+	if (fds == NULL || slots == NULL)
+		return -1;
+	while (1)
+	{
+		dispatch_jobs();
+		int nfds = 0;
+		for (i = 0; i < num_workers; i++)
+			if (workers[i].job != -1)
+			{
+				fds[nfds].fd = workers[i].result_fd;
+				fds[nfds].events = POLLIN;
+				slots[nfds++] = i;
+			}
+		if (nfds == 0)
+			break;
+		if (poll(fds, nfds, -1) == -1)
+			continue;
+		for (i = 0; i < nfds; i++)
+			if (fds[i].revents != 0)
+				collect_result(slots[i]);
+	}
+	free(fds);
+	free(slots);
+
+	/* idle workers exit on the closed pipe */
+	for (i = 0; i < num_workers; i++)
+		if (workers[i].pid != -1)
+		{
+			close(workers[i].job_fd);
+			close(workers[i].result_fd);
+			waitpid(workers[i].pid, NULL, 0);
+		}
+	free(workers);
+
+	int failed = print_report(now_seconds() - start);
+	for (i = 0; i < num_jobs; i++)
+	{
+		free(jobs[i].image);
+		free(jobs[i].parts);
+	}
+	free(jobs);
+	return failed;
+}
@@ -0,0 +1,127 @@
+#!/bin/sh
+# bench.sh - time myfsck over a matrix of generated images
+#
+#   Every case image is built once with mkimage and kept in BENCH_DIR.
+#   Each run repairs a fresh sparse copy of it with "myfsck -f 0 -B",
+#   which appends one JSON record per partition holding wall and CPU
+#   time, peak RSS and read/write counts and bytes, in total and per
+#   fix_fs phase. The records are tagged with the case, run and build
+#   and collected in BENCH_OUT.
+#
+#   With BENCH_BASELINE set to the BENCH_OUT of an earlier build, every
+#   case whose mean wall time grew by more than BENCH_TOLERANCE percent
+#   is reported and the script exits non-zero.
+#
+#   Environment:
+#     BENCH_DIR        image directory (bench)
+#     BENCH_OUT        record file (BENCH_DIR/results.jsonl)
+#     BENCH_SIZES      filesystem sizes (64M 512M)
+#     BENCH_SHAPES     directory tree shapes, see shape_args (wide deep)
+#     BENCH_CORRUPT    mkimage corruption list
+#     BENCH_RUNS       runs per case (3)
+#     BENCH_BASELINE   record file to compare against
+#     BENCH_TOLERANCE  allowed slowdown in percent (10)
+
+BENCH_DIR=${BENCH_DIR:-bench}
+BENCH_OUT=${BENCH_OUT:-$BENCH_DIR/results.jsonl}
+BENCH_SIZES=${BENCH_SIZES:-"64M 512M"}
+BENCH_SHAPES=${BENCH_SHAPES:-"wide deep"}
+BENCH_CORRUPT=${BENCH_CORRUPT:-dot=2,dotdot=2,orphan=3,links=3,bitmap=8}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_TOLERANCE=${BENCH_TOLERANCE:-10}
+
+build=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if [ -n "$(git status --porcelain --untracked-files=no 2>/dev/null)" ]
+then
+	build="$build-dirty"
+fi
+
+# mkimage arguments of a tree shape
+shape_args()
+{
+	case $1 in
+		wide) echo "-d 2 -w 16 -f 32" ;;
+		deep) echo "-d 8 -w 2 -f 4" ;;
+		flat) echo "-d 1 -w 1 -f 256" ;;
+		*)    echo "unknown shape $1" >&2; exit 1 ;;
+	esac
+}
+
+mkdir -p "$BENCH_DIR" || exit 1
+: > "$BENCH_OUT" || exit 1
+work="$BENCH_DIR/work.img"
+record="$BENCH_DIR/record.tmp"
+
+for size in $BENCH_SIZES
+do
+	for shape in $BENCH_SHAPES
+	do
+		name="$size-$shape"
+		img="$BENCH_DIR/$name.img"
+		args=$(shape_args "$shape") || exit 1
+		if [ ! -f "$img" ]
+		then
+			./mkimage -o "$img" -s "$size" -L 0 $args \
+			          -c "$BENCH_CORRUPT" > /dev/null || exit 1
+		fi
+
+		run=1
+		while [ "$run" -le "$BENCH_RUNS" ]
+		do
+			cp --sparse=always "$img" "$work" || exit 1
+			rm -f "$record"
+			./myfsck -i "$work" -f 0 -B "$record" > /dev/null || exit 1
+			sed "s/^{/{\"case\":\"$name\",\"run\":$run,\"build\":\"$build\",/" \
+			    "$record" >> "$BENCH_OUT"
+			run=$((run + 1))
+		done
+	done
+done
+rm -f "$work" "$record"
+
+# mean wall time per case of a record file, as "case seconds" lines
+summarize()
+{
+	awk '
+	function field(name,    m)
+	{
+		if (match($0, "\"" name "\":[^,}]*") == 0)
+			return ""
+		m = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+		gsub(/"/, "", m)
+		return m
+	}
+	{
+		c = field("case")
+		wall[c] += field("wall_s")
+		runs[c "," field("run")] = 1
+	}
+	END {
+		for (k in runs)
+		{
+			split(k, p, ",")
+			n[p[1]]++
+		}
+		for (c in wall)
+			printf "%s %.6f\n", c, wall[c] / n[c]
+	}' "$1" | sort
+}
+
+echo "build $build, $BENCH_RUNS runs per case, records in $BENCH_OUT"
+summarize "$BENCH_OUT" | awk '{ printf "  %-16s %10.3f s\n", $1, $2 }'
+
+[ -n "$BENCH_BASELINE" ] || exit 0
+summarize "$BENCH_BASELINE" > "$BENCH_DIR/baseline.tmp"
+summarize "$BENCH_OUT" | join "$BENCH_DIR/baseline.tmp" - | \
+awk -v tol="$BENCH_TOLERANCE" '
+{
+	change = $2 > 0 ? ($3 - $2) * 100 / $2 : 0
+	flag = change > tol ? "  REGRESSION" : ""
+	if (flag != "")
+		bad++
+	printf "  %-16s %10.3f -> %10.3f s %+7.1f%%%s\n", $1, $2, $3, change, flag
+}
+END { exit bad > 0 }'
+status=$?
+rm -f "$BENCH_DIR/baseline.tmp"
+exit $status
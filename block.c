@@ -19,8 +19,14 @@
 #include "ext2_fs.h"
 #include "utility.h"
 #include "readwrite.h"
+#include "isummary.h"
 #include "fsck.h"
 #include "block.h"
+#include "blockiter.h"
+#include "blockmap.h"
+#include "inodemap.h"
+#include "trace.h"
+#include "incremental.h"
 
 /*** global variables ***/
 /** partition information */
@@ -29,13 +35,57 @@ extern partition_t pt_info;
 extern superblock_t sb;
 /** block group discriptor table */
 extern struct ext2_group_desc* bg_desc_table;
-/** local inode map */
-extern int* my_inode_map;
+/** local inode map, a saturating count per inode */
+extern unsigned char* my_inode_map;
 /** local local map */
-extern int* my_block_map;
+extern block_map_group_t* my_block_map;
 /** disk bitmap */
 extern unsigned char* bitmap;
 
+/** inode whose blocks are being marked */
+static int mark_owner = 0;
+/** set while collecting the owners of multiply-claimed blocks */
+static int resolving_dups = 0;
+/** inodes whose blocks the inode scan marked, one bit per inode */
+static unsigned char* scan_marked = NULL;
+
+
+/** @brief claim a block for the inode being marked
+ *
+ *  @param block block number
+ *  @param kind BLOCK_DATA or the indirection depth
+ *  @return void
+ */
+static void claim_block(unsigned int block, int kind)
+{
+	if (resolving_dups)
+	{
+		dup_block_add_owner(block, mark_owner);
+		return;
+	}
+	if (block_map_test_and_set(block) > 0)
+		dup_block_record(block);
+	incr_rec_extent(mark_owner, block, kind);
+}
+
+
+/** @brief block visitor claiming every block of an inode, data and
+ *   indirect blocks alike
+ *
+ *  @param block physical block number
+ *  @param logical logical block number
+ *  @param kind block kind
+ *  @param buf block content
+ *  @param priv unused
+ *  @return ITER_CONTINUE
+ */
+static int mark_visitor(unsigned int block, long logical, int kind,
+                        unsigned char* buf, void* priv)
+{
+	claim_block(block, kind);
+	return ITER_CONTINUE;
+}
+
 
 /** @brief mark all allocated blocks of an inode
  *  
@@ -45,130 +95,125 @@ extern unsigned char* bitmap;
 void mark_block(int inode_num)
 {
 	struct ext2_inode inode;
-	int inode_addr = 0;
 	
-	/* get inode addr (in byte) from inode number */
-	inode_addr = get_inode_addr(inode_num);
-	
-	/* read inode information from inode table entry */
-	read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
+	trace_set_inode(inode_num);
+	/* block pointers of the inode, from the summary if it has them */
+	isum_get_inode(inode_num, &inode);
+	mark_owner = inode_num;
 
-	/* skip symbolic link file shorter than 60 bytes */
-	if (EXT2_S_ISLNK(inode.i_mode) && inode.i_size < 60)
-		return;
-
-	unsigned char buf[sb.block_size]; /* 1024 bytes */
-	
-	/* search in direct blocks */
-	
-	int i = 0;
-	for(i = 0; i < EXT2_NDIR_BLOCKS; i++)
-	{
-		if (inode.i_block[i] <= 0)
-			continue;
-		
-		my_block_map[inode.i_block[i]] = 1;
-	}
-	
-	/* traverse singly indirect block */
-	if (inode.i_block[EXT2_IND_BLOCK] > 0)
-	{
-		
-		my_block_map[inode.i_block[EXT2_IND_BLOCK]] = 1;
-		read_bytes(pt_info.base + inode.i_block[EXT2_IND_BLOCK] * sb.block_size, 
-			    	buf, sb.block_size);
-		mark_block_singly((unsigned int*)buf);
-	}
-	/* traverse doubly indirect block */
-	if (inode.i_block[EXT2_DIND_BLOCK] > 0)
-	{
-		my_block_map[inode.i_block[EXT2_DIND_BLOCK]] = 1;
-		read_bytes(pt_info.base + inode.i_block[EXT2_DIND_BLOCK] * sb.block_size, 
-				    buf, sb.block_size);
-		mark_block_doubly((unsigned int*)buf);
-	}
-	/* traverse triply indirect block */
-	if (inode.i_block[EXT2_TIND_BLOCK] > 0)
-	{
-		my_block_map[inode.i_block[EXT2_TIND_BLOCK]] = 1;
-		read_bytes(pt_info.base + inode.i_block[EXT2_TIND_BLOCK] * sb.block_size, 
-					buf, sb.block_size);
-		mark_block_triply((unsigned int*)buf);
-	}
+	iterate_blocks(&inode, 0, mark_visitor, NULL);
 	return;
 }
 
 
-/** @brief traverse in singly indirect block of a directory and 
- *   marks allocated blocks
- *  
+/** @brief block visitor withdrawing the claim of an inode on every
+ *   block of its tree
+ *
+ *  @param block physical block number
+ *  @param logical logical block number
+ *  @param kind block kind
  *  @param buf block content
- *  @return unsigned int
+ *  @param priv unused
+ *  @return ITER_CONTINUE
  */
-unsigned int mark_block_singly(unsigned int* singly_buf)
+static int unmark_visitor(unsigned int block, long logical, int kind,
+                          unsigned char* buf, void* priv)
 {
-	int i = 0;
-	int ret = -1;
-	
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (singly_buf[i] == 0)
-			break;
-		
-		my_block_map[singly_buf[i]] = 1;
-	}
-	
-	return ret;
+	/* a block claimed again by someone else stays used */
+	if (dup_block_release(block) == 0)
+		block_map_clear(block);
+	return ITER_CONTINUE;
 }
 
 
-/** @brief traverse in doubly indirect block of a directory and 
- *   marks allocated blocks
- *  
- *  @param buf block content
- *  @param parent_dir inode nmber of parent dir
+/** @brief let the inode scan mark the blocks of the inodes in use, so
+ *   that the block trees are walked while the inode tables are read
+ *
+ *  @return 0 success or -1 fail, blocks are then marked afterwards
  */
-unsigned int mark_block_doubly(unsigned int* doubly_buf)
+int mark_blocks_begin_scan()
 {
-	int i = 0;
-	int ret = -1;
-	unsigned int singly_buf[sb.block_size];
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (doubly_buf[i] == 0)
-			break;
+	free(scan_marked);
+	scan_marked = (unsigned char*)calloc(sb.num_inodes / 8 + 1, 1);
+	return scan_marked == NULL ? -1 : 0;
+}
 
-		my_block_map[doubly_buf[i]] = 1;
-		read_bytes(pt_info.base + doubly_buf[i] * sb.block_size,
-		            singly_buf, sb.block_size);
-		mark_block_singly(singly_buf);
-	}
-	return ret;
+
+/** @brief mark all allocated blocks of an inode read by the inode scan
+ *
+ *  @param inode_num inode number
+ *  @param inode inode struct
+ *  @return void
+ */
+void mark_scanned_inode(int inode_num, struct ext2_inode* inode)
+{
+	if (scan_marked == NULL)
+		return;
+
+	scan_marked[inode_num >> 3] |= 1 << (inode_num & 7);
+	mark_owner = inode_num;
+	iterate_blocks(inode, 0, mark_visitor, NULL);
 }
 
 
-/** @brief traverse in triply indirect block of a directory and 
- *   marks allocated blocks
- *  
- *  @param buf block content
- *  @param parent_dir inode nmber of parent dir
+/** @brief make the block map hold the blocks of the referenced inodes
+ *   only. The inode scan marked the inodes in use before anything was
+ *   known about references: the trees of the ones nothing refers to
+ *   are withdrawn, and referenced ones the scan left out are marked.
+ *
+ *  @return void
  */
-unsigned int mark_block_triply(unsigned int* triply_buf)
+void reconcile_block_marks()
 {
+	struct ext2_inode inode;
 	int i = 0;
-	int ret = -1;
-	unsigned int doubly_buf[sb.block_size];
-	for(i = 0; i < (sb.block_size / 4); i++)
+
+	for (i = 1; i <= sb.num_inodes; i++)
 	{
-		if (triply_buf[i] == 0)
-			break;
+		/* unchanged groups are marked from the database */
+		if (incr_group_trusted((i - 1) / sb.inodes_per_group))
+			continue;
+		int marked = scan_marked != NULL
+		             && (scan_marked[i >> 3] >> (i & 7)) & 1;
+		int referenced = inode_map_get(i) > 0;
+		if (marked == referenced)
+			continue;
 
-		my_block_map[triply_buf[i]] = 1;
-		read_bytes(pt_info.base + triply_buf[i] * sb.block_size,
-		            doubly_buf, sb.block_size);
-		mark_block_doubly(doubly_buf);
+		if (referenced)
+		{
+			mark_block(i);
+			continue;
+		}
+		trace_set_inode(i);
+		isum_get_inode(i, &inode);
+		iterate_blocks(&inode, 0, unmark_visitor, NULL);
 	}
-	return ret;
+	trace_set_inode(0);
+
+	free(scan_marked);
+	scan_marked = NULL;
 }
 
 
+/** @brief collect the owners of multiply-claimed blocks by walking
+ *   the block trees of all referenced inodes again. Only runs when
+ *   marking found duplicates.
+ *
+ *  @return void
+ */
+void resolve_dup_blocks()
+{
+	int i = 0;
+
+	if (dup_block_count() == 0)
+		return;
+
+	resolving_dups = 1;
+	for (i = 1; i <= sb.num_inodes; i++)
+	{
+		if (inode_map_get(i) == 0)
+			continue;
+		mark_block(i);
+	}
+	resolving_dups = 0;
+}
@@ -0,0 +1,231 @@
+/** @file blockiter.c
+ *  @brief This module contains the iterator over the block tree
+ *   of an inode
+ *
+ *   Every pass walking the direct, singly, doubly and triply indirect
+ *   blocks of an inode goes through iterate_blocks. Absent subtrees
+ *   are skipped without reading anything, and runs of physically
+ *   contiguous blocks on the same level are read with one request.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "utility.h"
+#include "readwrite.h"
+#include "fsck.h"
+#include "bufpool.h"
+#include "blockiter.h"
+#include "latency.h"
+
+/*** global variables ***/
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+
+
+/** @brief state of one iteration */
+typedef struct block_iter
+{
+	int flags;
+	block_visitor_t visit;
+	void* priv;
+	int ptrs_per_block;
+} block_iter_t;
+
+
+/** @brief check if a block pointer refers to a block of the filesystem
+ *
+ *  @param block block number
+ *  @return 1 valid or 0 absent/out of range
+ */
+static int valid_block(unsigned int block)
+{
+	return block != 0 && block < (unsigned int)sb.num_blocks;
+}
+
+
+/** @brief check if an inode maps blocks through i_block. Device files
+ *   keep their device number there and short symbolic links their
+ *   target.
+ *
+ *  @param inode inode struct
+ *  @return 1 has a block tree or 0 not
+ */
+int inode_has_blocks(struct ext2_inode* inode)
+{
+	if (EXT2_S_ISREG(inode->i_mode) || EXT2_S_ISDIR(inode->i_mode))
+		return 1;
+	/* skip symbolic link file shorter than 60 bytes */
+	if (EXT2_S_ISLNK(inode->i_mode) && inode->i_size >= 60)
+		return 1;
+	return 0;
+}
+
+
+/** @brief visit an array of block pointers of the same depth
+ *
+ *  @param it iteration state
+ *  @param ptrs block pointers
+ *  @param count number of pointers
+ *  @param depth 0 for data blocks, indirection depth otherwise
+ *  @param logical logical number of the first block mapped by ptrs[0]
+ *  @param span number of logical blocks mapped by each pointer
+ *  @return ITER_CONTINUE or ITER_STOP
+ */
+static int walk_level(block_iter_t* it, unsigned int* ptrs, int count,
+                      int depth, long logical, long span)
+{
+	int need_data = depth > 0 || (it->flags & ITER_READ_DATA);
+	unsigned char* batch = need_data ? acquire_batch_buf() : NULL;
+	int ret = ITER_CONTINUE;
+	int i = 0, j = 0;
+
+	while (i < count && ret == ITER_CONTINUE)
+	{
+		if (!valid_block(ptrs[i]))
+		{
+			i++;
+			continue;
+		}
+
+		/* gather a run of contiguous blocks and read it at once */
+		int run = 1;
+		if (need_data)
+		{
+			while (i + run < count && run < BUF_POOL_BATCH_BLOCKS
+			       && ptrs[i + run] == ptrs[i] + run
+			       && valid_block(ptrs[i + run]))
+				run++;
+			int outer = latency_set_class(depth > 0 ? LAT_INDIRECT : LAT_DIR);
+			read_bytes(pt_info.base + (long)ptrs[i] * sb.block_size,
+			           batch, run * sb.block_size);
+			latency_set_class(outer);
+		}
+
+		for (j = 0; j < run && ret == ITER_CONTINUE; j++)
+		{
+			unsigned char* buf = need_data ? batch + j * sb.block_size
+			                               : NULL;
+			long lblk = logical + (i + j) * span;
+
+			ret = it->visit(ptrs[i + j], lblk, depth, buf, it->priv);
+			if (ret == ITER_CONTINUE && depth > 0)
+				ret = walk_level(it, (unsigned int*)buf, it->ptrs_per_block,
+				                 depth - 1, lblk, span / it->ptrs_per_block);
+		}
+		i += run;
+	}
+
+	if (batch != NULL)
+		release_batch_buf(batch);
+	return ret;
+}
+
+
+/** @brief visit all blocks of an inode in logical order. Indirect
+ *   blocks are visited before the blocks they map.
+ *
+ *  @param inode inode struct
+ *  @param flags ITER_* flags
+ *  @param visit visitor function
+ *  @param priv context passed to the visitor
+ *  @return ITER_STOP if the visitor stopped the walk, else ITER_CONTINUE
+ */
+int iterate_blocks(struct ext2_inode* inode, int flags,
+                   block_visitor_t visit, void* priv)
+{
+	block_iter_t it;
+	long ppb = sb.block_size / 4;
+	int ret = ITER_CONTINUE;
+
+	if (!inode_has_blocks(inode))
+		return ITER_CONTINUE;
+
+	it.flags = flags;
+	it.visit = visit;
+	it.priv = priv;
+	it.ptrs_per_block = ppb;
+
+	/* direct blocks */
+	ret = walk_level(&it, inode->i_block, EXT2_NDIR_BLOCKS,
+	                 BLOCK_DATA, 0, 1);
+	/* singly indirect block */
+	if (ret == ITER_CONTINUE)
+		ret = walk_level(&it, &inode->i_block[EXT2_IND_BLOCK], 1,
+		                 BLOCK_IND, EXT2_NDIR_BLOCKS, ppb);
+	/* doubly indirect block */
+	if (ret == ITER_CONTINUE)
+		ret = walk_level(&it, &inode->i_block[EXT2_DIND_BLOCK], 1,
+		                 BLOCK_DIND, EXT2_NDIR_BLOCKS + ppb, ppb * ppb);
+	/* triply indirect block */
+	if (ret == ITER_CONTINUE)
+		ret = walk_level(&it, &inode->i_block[EXT2_TIND_BLOCK], 1,
+		                 BLOCK_TIND, EXT2_NDIR_BLOCKS + ppb + ppb * ppb,
+		                 ppb * ppb * ppb);
+
+	return ret;
+}
+
+
+/** @brief map a logical block of an inode to its physical block,
+ *   reading only the indirect blocks on the path to it
+ *
+ *  @param inode inode struct
+ *  @param logical logical block number
+ *  @return physical block number or 0 if absent
+ */
+unsigned int map_logical_block(struct ext2_inode* inode, long logical)
+{
+	long ppb = sb.block_size / 4;
+	long span = 1;
+	unsigned int block = 0;
+	int depth = 0;
+
+	if (!inode_has_blocks(inode) || logical < 0)
+		return 0;
+
+	/* find the level of the block tree mapping the block */
+	if (logical < EXT2_NDIR_BLOCKS)
+		return valid_block(inode->i_block[logical]) ?
+		       inode->i_block[logical] : 0;
+	logical -= EXT2_NDIR_BLOCKS;
+	for (depth = 1; depth <= 3; depth++)
+	{
+		span *= ppb;
+		if (logical < span)
+			break;
+		logical -= span;
+	}
+	if (depth > 3)
+		return 0;
+	block = inode->i_block[EXT2_IND_BLOCK + depth - 1];
+
+	/* follow one pointer per level down to the data block */
+	unsigned char* buf = acquire_block_buf();
+	int outer = latency_set_class(LAT_INDIRECT);
+	for (; depth > 0 && valid_block(block); depth--)
+	{
+		span /= ppb;
+		read_bytes(pt_info.base + (long)block * sb.block_size,
+		           buf, sb.block_size);
+		block = ((unsigned int*)buf)[logical / span];
+		logical %= span;
+	}
+	latency_set_class(outer);
+	release_block_buf(buf);
+
+	return valid_block(block) ? block : 0;
+}
+
@@ -0,0 +1,619 @@
+/** @file blockmap.c
+ *  @brief This module contains the local block map and the table of
+ *   multiply-claimed blocks
+ *
+ *   The block map is a directory with an entry per group. A group gets
+ *   a segment, a packed bitmap with one bit per block, only when it is
+ *   first marked out of order. Until then it is compact: the first
+ *   used_prefix blocks are used and the rest are free. All free and
+ *   all used are the two ends of that, and a group holding only its
+ *   metadata, or filled from its start, stays compact too. Memory and
+ *   zeroing then follow the groups in use rather than the size of the
+ *   filesystem.
+ *
+ *   Segments are plain memory. Under --mem-limit they are cut from
+ *   one arena of the map store instead, a segment slot per group, so a
+ *   map that does not fit is kept in a file like the inode maps. Only
+ *   the pages of the groups with a segment are ever touched, and
+ *   fix_block_map evicts each group once its bitmap is compared.
+ *
+ *   Blocks are claimed with a test-and-set, so the first claim costs a
+ *   single bit operation. Only when a claim hits a block that is
+ *   already set the block is recorded in a small hash table, which
+ *   later collects the inodes owning it.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "fsck.h"
+#include "blockmap.h"
+#include "mapstore.h"
+#include "problem.h"
+
+/*** global variables ***/
+/** local block map, an entry per group */
+extern block_map_group_t* my_block_map;
+
+/** blocks covered by the local block map, from map_first_block on */
+static unsigned int map_num_blocks = 0;
+static unsigned int map_first_block = 0;
+static unsigned int map_per_group = 0;
+static unsigned int map_num_groups = 0;
+/** bytes of a segment */
+static unsigned int seg_bytes = 0;
+/** segments of all groups under a memory limit, or NULL */
+static unsigned char* seg_arena = NULL;
+
+/** hash table of multiply-claimed blocks, block 0 marks a free slot */
+static dup_block_t* dup_table = NULL;
+static int dup_table_size = 0;
+static int dup_table_used = 0;
+/** blocks of the table still claimed more than once */
+static int dup_table_live = 0;
+
+
+/** @brief allocate an all-free local block map
+ *
+ *  @param num_blocks number of blocks of the filesystem
+ *  @param first_block first block of group 0
+ *  @param per_group blocks per group
+ *  @return 0 success or -1 fail
+ */
+int block_map_init(unsigned int num_blocks, unsigned int first_block,
+                   unsigned int per_group)
+{
+	block_map_free();
+
+	if (per_group == 0 || first_block > num_blocks)
+		return -1;
+	map_num_groups = (num_blocks - first_block + per_group - 1) / per_group;
+	my_block_map = (block_map_group_t*)calloc(map_num_groups + 1,
+	                                          sizeof(block_map_group_t));
+	if (my_block_map == NULL)
+		return -1;
+	map_num_blocks = num_blocks;
+	map_first_block = first_block;
+	map_per_group = per_group;
+	seg_bytes = (per_group + 7) / 8;
+
+	return 0;
+}
+
+
+/** @brief release the local block map and the duplicate table
+ *
+ *  @return void
+ */
+void block_map_free()
+{
+	unsigned int g = 0;
+	int i = 0;
+
+	if (seg_arena != NULL)
+	{
+		mstore_free(seg_arena);
+		seg_arena = NULL;
+	}
+	else if (my_block_map != NULL)
+		for (g = 0; g < map_num_groups; g++)
+			free(my_block_map[g].seg);
+	free(my_block_map);
+	my_block_map = NULL;
+	map_num_blocks = 0;
+	map_num_groups = 0;
+
+	for (i = 0; i < dup_table_size; i++)
+		free(dup_table[i].owners);
+	free(dup_table);
+	dup_table = NULL;
+	dup_table_size = 0;
+	dup_table_used = 0;
+	dup_table_live = 0;
+}
+
+
+/** @brief number of groups of the local block map
+ *
+ *  @return number of groups
+ */
+unsigned int block_map_groups()
+{
+	return map_num_groups;
+}
+
+
+/** @brief find the group of a block
+ *
+ *  @param block block number
+ *  @param bit returns the bit of the block in the group
+ *  @return the group or NULL if the block is not covered
+ */
+static block_map_group_t* locate(unsigned int block, unsigned int* bit)
+{
+	if (block < map_first_block || block >= map_num_blocks)
+		return NULL;
+	block -= map_first_block;
+	*bit = block % map_per_group;
+	return &my_block_map[block / map_per_group];
+}
+
+
+/** @brief set the first bits of a bitmap
+ *
+ *  @param bits bitmap
+ *  @param count number of bits
+ *  @return void
+ */
+static void set_prefix_bits(unsigned char* bits, unsigned int count)
+{
+	memset(bits, 0xff, count >> 3);
+	if (count & 7)
+		bits[count >> 3] |= (1 << (count & 7)) - 1;
+}
+
+
+/** @brief give a compact group a segment holding its used prefix
+ *
+ *  @param group group to expand
+ *  @return void
+ */
+static void expand(block_map_group_t* group)
+{
+	if (mstore_limit() > 0 && seg_arena == NULL)
+		seg_arena = (unsigned char*)mstore_alloc((long)map_num_groups
+		                                         * seg_bytes);
+	if (seg_arena != NULL)
+	{
+		/* the slot is zero, a group is expanded once */
+		group->seg = seg_arena + (long)(group - my_block_map) * seg_bytes;
+	}
+	else
+		group->seg = (unsigned char*)calloc(seg_bytes, 1);
+	if (group->seg == NULL)
+	{
+		printf("Allocating block map segment failed\n");
+		exit(-1);
+	}
+	set_prefix_bits(group->seg, group->used_prefix);
+}
+
+
+/** @brief mark a block as used in its group
+ *
+ *  @param group group of the block
+ *  @param bit bit of the block in the group
+ *  @return void
+ */
+static void group_set(block_map_group_t* group, unsigned int bit)
+{
+	if (group->seg == NULL)
+	{
+		if (bit < group->used_prefix)
+			return;
+		if (bit == group->used_prefix)
+		{
+			group->used_prefix++;
+			return;
+		}
+		expand(group);
+	}
+	group->seg[bit >> 3] |= (1 << (bit & 7));
+}
+
+
+/** @brief mark a block as used without duplicate detection,
+ *   used for filesystem metadata
+ *
+ *  @param block block number
+ *  @return void
+ */
+void block_map_set(unsigned int block)
+{
+	unsigned int bit = 0;
+	block_map_group_t* group = locate(block, &bit);
+
+	if (group != NULL)
+		group_set(group, bit);
+}
+
+
+/** @brief mark a run of blocks as used without duplicate detection.
+ *   A run reaching the used prefix of a compact group extends it,
+ *   whole bytes of a segment are filled at once.
+ *
+ *  @param start first block
+ *  @param count number of blocks
+ *  @return void
+ */
+void block_map_set_range(unsigned int start, unsigned int count)
+{
+	unsigned int bit = 0;
+
+	if (start >= map_num_blocks)
+		return;
+	if (count > map_num_blocks - start)
+		count = map_num_blocks - start;
+
+	while (count > 0)
+	{
+		block_map_group_t* group = locate(start, &bit);
+		unsigned int n = map_per_group - bit;
+		if (n > count)
+			n = count;
+		if (group == NULL)
+			n = 1;
+		else if (group->seg == NULL && bit <= group->used_prefix)
+		{
+			if (bit + n > group->used_prefix)
+				group->used_prefix = bit + n;
+		}
+		else
+		{
+			unsigned int end = bit + n;
+			if (group->seg == NULL)
+				expand(group);
+			/* leading bits up to a byte boundary */
+			while (bit < end && (bit & 7))
+				group_set(group, bit++);
+			/* whole bytes */
+			if (end - bit >= 8)
+			{
+				memset(group->seg + (bit >> 3), 0xff, (end - bit) >> 3);
+				bit += (end - bit) & ~7U;
+			}
+			/* trailing bits */
+			while (bit < end)
+				group_set(group, bit++);
+		}
+		start += n;
+		count -= n;
+	}
+}
+
+
+/** @brief mark a block as free
+ *
+ *  @param block block number
+ *  @return void
+ */
+void block_map_clear(unsigned int block)
+{
+	unsigned int bit = 0;
+	block_map_group_t* group = locate(block, &bit);
+
+	if (group == NULL)
+		return;
+	if (group->seg == NULL)
+	{
+		if (bit >= group->used_prefix)
+			return;
+		if (bit == group->used_prefix - 1)
+		{
+			group->used_prefix--;
+			return;
+		}
+		expand(group);
+	}
+	group->seg[bit >> 3] &= ~(1 << (bit & 7));
+}
+
+
+/** @brief check if a block is marked as used
+ *
+ *  @param block block number
+ *  @return 1 used or 0 free
+ */
+int block_map_test(unsigned int block)
+{
+	unsigned int bit = 0;
+	block_map_group_t* group = locate(block, &bit);
+
+	if (group == NULL)
+		return 0;
+	if (group->seg == NULL)
+		return bit < group->used_prefix;
+	return (group->seg[bit >> 3] >> (bit & 7)) & 1;
+}
+
+
+/** @brief mark a block as used and report its previous state
+ *
+ *  @param block block number
+ *  @return 1 already used, 0 newly marked, -1 out of range
+ */
+int block_map_test_and_set(unsigned int block)
+{
+	unsigned int bit = 0;
+	block_map_group_t* group = locate(block, &bit);
+
+	if (group == NULL)
+		return -1;
+	if (group->seg == NULL)
+	{
+		if (bit < group->used_prefix)
+			return 1;
+	}
+	else if ((group->seg[bit >> 3] >> (bit & 7)) & 1)
+		return 1;
+	group_set(group, bit);
+	return 0;
+}
+
+
+/** @brief get the bits of a group as its on-disk bitmap lays them out
+ *
+ *  @param g group number
+ *  @param bits returns a bit per block of the group
+ *  @return 1 if the group is compact, 0 if it has a segment
+ */
+int block_map_group_bits(unsigned int g, unsigned char* bits)
+{
+	block_map_group_t* group = &my_block_map[g];
+
+	if (group->seg != NULL)
+	{
+		memcpy(bits, group->seg, seg_bytes);
+		return 0;
+	}
+	memset(bits, 0, seg_bytes);
+	set_prefix_bits(bits, group->used_prefix);
+	return 1;
+}
+
+
+/** @brief drop the pages of the segments of the groups up to one a
+ *   pass going forward is done with, when the arena is kept in a file
+ *
+ *  @param g last group done
+ *  @return void
+ */
+void block_map_evict(unsigned int g)
+{
+	if (seg_arena != NULL)
+		mstore_evict(seg_arena, 0, ((long)g + 1) * seg_bytes);
+}
+
+
+/** @brief write the local block map to a state file: per group the
+ *   used prefix, or BLOCKMAP_SEGMENT followed by the segment
+ *
+ *  @param fp state file
+ *  @return 0 success or -1 fail
+ */
+int block_map_save(FILE* fp)
+{
+	unsigned int g = 0;
+
+	for (g = 0; g < map_num_groups; g++)
+	{
+		block_map_group_t* group = &my_block_map[g];
+		uint32_t prefix = group->seg != NULL ? BLOCKMAP_SEGMENT
+		                                     : group->used_prefix;
+		if (fwrite(&prefix, sizeof(prefix), 1, fp) != 1)
+			return -1;
+		if (group->seg != NULL && fwrite(group->seg, seg_bytes, 1, fp) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+
+/** @brief read the local block map written by block_map_save into an
+ *   initialized map
+ *
+ *  @param fp state file
+ *  @return 0 success or -1 fail
+ */
+int block_map_load(FILE* fp)
+{
+	unsigned int g = 0;
+	uint32_t prefix = 0;
+
+	for (g = 0; g < map_num_groups; g++)
+	{
+		block_map_group_t* group = &my_block_map[g];
+		if (fread(&prefix, sizeof(prefix), 1, fp) != 1)
+			return -1;
+		if (prefix != BLOCKMAP_SEGMENT)
+		{
+			if (prefix > map_per_group)
+				return -1;
+			group->used_prefix = prefix;
+			continue;
+		}
+		group->used_prefix = 0;
+		expand(group);
+		if (fread(group->seg, seg_bytes, 1, fp) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+
+/** @brief find the slot of a block in the duplicate table
+ *
+ *  @param block block number
+ *  @return slot holding the block or the free slot it belongs to
+ */
+static dup_block_t* dup_block_slot(unsigned int block)
+{
+	unsigned int i = (block * 2654435761u) & (dup_table_size - 1);
+
+	while (dup_table[i].block != 0 && dup_table[i].block != block)
+		i = (i + 1) & (dup_table_size - 1);
+
+	return &dup_table[i];
+}
+
+
+/** @brief double the size of the duplicate table
+ *
+ *  @return 0 success or -1 fail
+ */
+static int dup_table_grow()
+{
+	dup_block_t* old_table = dup_table;
+	int old_size = dup_table_size;
+	int new_size = old_size ? old_size * 2 : DUP_TABLE_INIT_SIZE;
+
+	dup_table = (dup_block_t*)calloc(new_size, sizeof(dup_block_t));
+	if (dup_table == NULL)
+	{
+		dup_table = old_table;
+		return -1;
+	}
+	dup_table_size = new_size;
+
+	int i = 0;
+	for (i = 0; i < old_size; i++)
+	{
+		if (old_table[i].block != 0)
+			*dup_block_slot(old_table[i].block) = old_table[i];
+	}
+	free(old_table);
+
+	return 0;
+}
+
+
+/** @brief record a claim on a block that is already marked used
+ *
+ *  @param block block number
+ *  @return void
+ */
+void dup_block_record(unsigned int block)
+{
+	/* keep the load factor under one half */
+	if (2 * (dup_table_used + 1) > dup_table_size)
+	{
+		if (dup_table_grow() == -1)
+		{
+			printf("out of memory recording duplicate block %u\n", block);
+			return;
+		}
+	}
+
+	dup_block_t* dup = dup_block_slot(block);
+	if (dup->block == 0)
+	{
+		dup->block = block;
+		dup_table_used++;
+	}
+	if (dup->collisions++ == 0)
+		dup_table_live++;
+}
+
+
+/** @brief withdraw a claim on a block
+ *
+ *  @param block block number
+ *  @return 1 the block is still claimed or 0 the claim was the last
+ *   one and the block can be cleared
+ */
+int dup_block_release(unsigned int block)
+{
+	if (dup_table_live == 0)
+		return 0;
+
+	dup_block_t* dup = dup_block_slot(block);
+	if (dup->block == 0 || dup->collisions == 0)
+		return 0;
+	if (--dup->collisions == 0)
+		dup_table_live--;
+	return 1;
+}
+
+
+/** @brief add an owner to a multiply-claimed block, blocks claimed
+ *   only once are ignored
+ *
+ *  @param block block number
+ *  @param inode_num inode number claiming the block
+ *  @return void
+ */
+void dup_block_add_owner(unsigned int block, int inode_num)
+{
+	if (dup_table_used == 0)
+		return;
+
+	dup_block_t* dup = dup_block_slot(block);
+	if (dup->block == 0)
+		return;
+
+	dup->inode_claims++;
+
+	int i = 0;
+	for (i = 0; i < dup->num_owners; i++)
+	{
+		if (dup->owners[i] == inode_num)
+			return;
+	}
+
+	if (dup->num_owners == dup->max_owners)
+	{
+		int max_owners = dup->max_owners ? dup->max_owners * 2
+		                                 : DUP_OWNERS_INIT_SIZE;
+		int* owners = (int*)realloc(dup->owners, max_owners * sizeof(int));
+		if (owners == NULL)
+			return;
+		dup->owners = owners;
+		dup->max_owners = max_owners;
+	}
+	dup->owners[dup->num_owners++] = inode_num;
+}
+
+
+/** @brief number of multiply-claimed blocks found so far
+ *
+ *  @return int
+ */
+int dup_block_count()
+{
+	return dup_table_live;
+}
+
+
+/** @brief print every multiply-claimed block with its owners
+ *
+ *  @return void
+ */
+void report_dup_blocks()
+{
+	char line[200];
+	int i = 0, j = 0;
+
+	if (dup_table_live == 0)
+		return;
+
+	printf("%d multiply-claimed blocks found\n", dup_table_live);
+	for (i = 0; i < dup_table_size; i++)
+	{
+		dup_block_t* dup = &dup_table[i];
+		/* blocks whose other claims were withdrawn are not reported */
+		if (dup->block == 0 || dup->collisions == 0)
+			continue;
+
+		int len = snprintf(line, sizeof(line), "block %u claimed by",
+		                   dup->block);
+		/* every claim beyond the inode claims came from metadata */
+		if (dup->collisions + 1 > dup->inode_claims)
+			len += snprintf(line + len, sizeof(line) - len,
+			                " filesystem metadata");
+		for (j = 0; j < dup->num_owners && len < (int)sizeof(line); j++)
+			len += snprintf(line + len, sizeof(line) - len, " inode %d",
+			                dup->owners[j]);
+		problem_report(PR_DUP_BLOCK, "%s", line);
+	}
+}
+
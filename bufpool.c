@@ -0,0 +1,187 @@
+/** @file bufpool.c
+ *  @brief This module contains the pools of block-sized scratch buffers
+ *
+ *   Helpers walking block trees borrow their block buffers from these
+ *   pools instead of the stack. Buffers are aligned for direct I/O and
+ *   are reused for the whole check of a partition, so deep directory
+ *   trees keep a flat stack and do not touch fresh pages on each call.
+ *   Batch buffers hold BUF_POOL_BATCH_BLOCKS consecutive blocks and
+ *   are used to read runs of contiguous blocks in one request.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "bufpool.h"
+
+/** pools used by the current check */
+static buf_pool_t block_pool = {0, 0, 0, 0, NULL};
+static buf_pool_t batch_pool = {0, 0, 0, 0, NULL};
+
+
+/** @brief set up an empty pool
+ *
+ *  @param pool pool to set up
+ *  @param buf_size size of each buffer
+ *  @return 0 success or -1 fail
+ */
+static int pool_setup(buf_pool_t* pool, int buf_size)
+{
+	pool->free_list = (void**)malloc(BUF_POOL_INIT_SIZE * sizeof(void*));
+	if (pool->free_list == NULL)
+		return -1;
+	pool->max_free = BUF_POOL_INIT_SIZE;
+	pool->buf_size = buf_size;
+
+	return 0;
+}
+
+
+/** @brief free all buffers of a pool
+ *
+ *  @param pool pool to tear down
+ *  @return void
+ */
+static void pool_teardown(buf_pool_t* pool)
+{
+	int i = 0;
+
+	if (pool->num_free != pool->num_allocated)
+		fprintf(stderr, "buffer pool: %d buffers not released\n",
+		        pool->num_allocated - pool->num_free);
+
+	for (i = 0; i < pool->num_free; i++)
+		free(pool->free_list[i]);
+	free(pool->free_list);
+
+	pool->free_list = NULL;
+	pool->num_free = 0;
+	pool->max_free = 0;
+	pool->num_allocated = 0;
+}
+
+
+/** @brief take a buffer from a pool, allocating one if it is empty
+ *
+ *  @param pool pool to take from
+ *  @return aligned buffer of pool buffer size
+ */
+static void* pool_get(buf_pool_t* pool)
+{
+	void* buf = NULL;
+
+	if (pool->num_free > 0)
+		return pool->free_list[--pool->num_free];
+
+	if (posix_memalign(&buf, BUF_POOL_ALIGN, pool->buf_size) != 0)
+	{
+		printf("Allocating block buffer failed\n");
+		exit(-1);
+	}
+	pool->num_allocated++;
+
+	return buf;
+}
+
+
+/** @brief give a buffer back to a pool
+ *
+ *  @param pool pool the buffer was taken from
+ *  @param buf buffer to give back
+ *  @return void
+ */
+static void pool_put(buf_pool_t* pool, void* buf)
+{
+	if (pool->num_free == pool->max_free)
+	{
+		void** free_list = (void**)realloc(pool->free_list,
+		                                   2 * pool->max_free * sizeof(void*));
+		if (free_list == NULL)
+		{
+			free(buf);
+			pool->num_allocated--;
+			return;
+		}
+		pool->free_list = free_list;
+		pool->max_free *= 2;
+	}
+	pool->free_list[pool->num_free++] = buf;
+}
+
+
+/** @brief set up empty pools for a given block size
+ *
+ *  @param buf_size size of a block buffer, normally the block size
+ *  @return 0 success or -1 fail
+ */
+int buf_pool_init(int buf_size)
+{
+	buf_pool_destroy();
+
+	if (pool_setup(&block_pool, buf_size) == -1)
+		return -1;
+	if (pool_setup(&batch_pool, buf_size * BUF_POOL_BATCH_BLOCKS) == -1)
+		return -1;
+
+	return 0;
+}
+
+
+/** @brief free all buffers of the pools
+ *
+ *  @return void
+ */
+void buf_pool_destroy()
+{
+	pool_teardown(&block_pool);
+	pool_teardown(&batch_pool);
+}
+
+
+/** @brief take a block buffer from the pool
+ *
+ *  @return aligned buffer of one block
+ */
+void* acquire_block_buf()
+{
+	return pool_get(&block_pool);
+}
+
+
+/** @brief give a block buffer back to the pool
+ *
+ *  @param buf buffer returned by acquire_block_buf
+ *  @return void
+ */
+void release_block_buf(void* buf)
+{
+	pool_put(&block_pool, buf);
+}
+
+
+/** @brief take a batch buffer from the pool
+ *
+ *  @return aligned buffer of BUF_POOL_BATCH_BLOCKS blocks
+ */
+void* acquire_batch_buf()
+{
+	return pool_get(&batch_pool);
+}
+
+
+/** @brief give a batch buffer back to the pool
+ *
+ *  @param buf buffer returned by acquire_batch_buf
+ *  @return void
+ */
+void release_batch_buf(void* buf)
+{
+	pool_put(&batch_pool, buf);
+}
@@ -0,0 +1,328 @@
+/** @file checkpoint.c
+ *  @brief This module saves the state of a check to a file and
+ *   resumes from it
+ *
+ *   A check is saved when the inode map is final, when the block map
+ *   is built, every few seconds between the groups of the link count
+ *   and block bitmap passes, and when a partition is done. Repairs are
+ *   written to disk as they are found, so the maps and the next group
+ *   are all there is to save. The traversals before the inode map is
+ *   final are not saved and run again after a restart.
+ *
+ *   The file is written to a temporary name and renamed, so a kill
+ *   leaves either the old or the new state. A resumed check trusts it
+ *   only if the superblock write time and mount count still match.
+ *   The partitions before the saved one are skipped only when both
+ *   the saved and the resumed check cover every partition. The state
+ *   of a partition that is not checked is kept, and the file is only
+ *   removed once the partition it names is done.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "fsck.h"
+#include "readwrite.h"
+#include "blockmap.h"
+#include "inodemap.h"
+#include "checkpoint.h"
+
+/*** global variables ***/
+/** disk file descriptor */
+extern int disk;
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+/** local inode map, a saturating count per inode */
+extern unsigned char* my_inode_map;
+/** local block map, an entry per group */
+extern block_map_group_t* my_block_map;
+
+/** state file or NULL when not saving */
+static char* state_path = NULL;
+/** temporary file the state is written to */
+static char* tmp_path = NULL;
+/** seconds between checkpoints inside a phase */
+static int interval = CKPT_DEFAULT_INTERVAL;
+/** resume from the state file at the next check */
+static int resume = 0;
+/** every partition of the disk is checked */
+static int whole_disk = 0;
+/** the state file belongs to another partition, it is not written */
+static int keep_state = 0;
+/** the partition the state file names is done */
+static int state_done = 0;
+/** partition being checked */
+static int cur_partition = 0;
+/** time of the last save */
+static time_t last_save = 0;
+
+
+/** @brief save the state of checks to a file
+ *
+ *  @param path state file
+ *  @return void
+ */
+void ckpt_set_file(const char* path)
+{
+	free(state_path);
+	free(tmp_path);
+	state_path = strdup(path);
+	tmp_path = (char*)malloc(strlen(path) + 5);
+	if (state_path == NULL || tmp_path == NULL)
+	{
+		free(state_path);
+		free(tmp_path);
+		state_path = tmp_path = NULL;
+		return;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+}
+
+
+/** @brief set the time between checkpoints inside a phase
+ *
+ *  @param seconds interval, 0 to save at every group
+ *  @return void
+ */
+void ckpt_set_interval(int seconds)
+{
+	interval = seconds < 0 ? 0 : seconds;
+}
+
+
+/** @brief resume from the state file instead of checking from the start
+ *
+ *  @return void
+ */
+void ckpt_set_resume()
+{
+	resume = 1;
+}
+
+
+/** @brief note that every partition of the disk is checked, so a
+ *   resumed check may skip the ones before the saved partition
+ *
+ *  @return void
+ */
+void ckpt_set_whole_disk()
+{
+	whole_disk = 1;
+}
+
+
+/** @brief get the size of the disk image or device
+ *
+ *  @return bytes
+ */
+static uint64_t disk_size()
+{
+	long end = lseek64(disk, 0, SEEK_END);
+	return end < 0 ? 0 : end;
+}
+
+
+/** @brief read the state file for the check of a partition. The maps
+ *   must be allocated, the block map is built here if saved.
+ *
+ *  @param partition_num partition number
+ *  @param group first group to check at the returned point
+ *  @return CKPT_* point to resume from
+ */
+int ckpt_begin_check(int partition_num, int* group)
+{
+	ckpt_header_t hdr;
+	FILE* fp = NULL;
+	int point = CKPT_NONE;
+
+	cur_partition = partition_num;
+	last_save = time(NULL);
+	keep_state = 0;
+	*group = 0;
+	if (!resume || state_path == NULL)
+		return CKPT_NONE;
+
+	if ((fp = fopen(state_path, "rb")) == NULL)
+	{
+		printf("no checkpoint found, checking from the start\n");
+		resume = 0;
+		return CKPT_NONE;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CKPT_MAGIC
+	    || hdr.version != CKPT_VERSION)
+	{
+		printf("checkpoint %s is not valid, checking from the start\n",
+		       state_path);
+		resume = 0;
+		fclose(fp);
+		return CKPT_NONE;
+	}
+
+	/* a state file of another image must not skip or seed anything */
+	if (hdr.disk_size != disk_size()
+	    || (hdr.partition_num == partition_num
+	        && (hdr.start_sec != pt_info.start_sec
+	            || memcmp(hdr.uuid, sb.uuid, sizeof(hdr.uuid)) != 0)))
+	{
+		printf("checkpoint %s belongs to another disk, "
+		       "checking from the start\n", state_path);
+		resume = 0;
+		fclose(fp);
+		return CKPT_NONE;
+	}
+
+	/* the state of another partition waits for the check of it */
+	if (hdr.partition_num != partition_num
+	    && !(whole_disk && hdr.whole_disk))
+	{
+		printf("checkpoint %s is of partition %d, checking partition %d "
+		       "from the start\n", state_path, hdr.partition_num,
+		       partition_num);
+		keep_state = 1;
+		fclose(fp);
+		return CKPT_NONE;
+	}
+	/* partitions before the saved one are done */
+	if (hdr.partition_num > partition_num)
+	{
+		fclose(fp);
+		return CKPT_DONE;
+	}
+	/* every later partition is checked from the start */
+	resume = 0;
+	if (hdr.partition_num < partition_num)
+	{
+		fclose(fp);
+		return CKPT_NONE;
+	}
+
+	if (hdr.wtime != sb.wtime || hdr.mnt_count != sb.mnt_count
+	    || hdr.num_inodes != sb.num_inodes || hdr.num_blocks != sb.num_blocks)
+	{
+		printf("partition %d changed since the checkpoint, "
+		       "checking from the start\n", partition_num);
+		fclose(fp);
+		return CKPT_NONE;
+	}
+
+	point = hdr.point;
+	if (point == CKPT_LINKS || point == CKPT_BLOCKMAP)
+	{
+		if (inode_map_load(fp) == -1)
+			point = CKPT_NONE;
+	}
+	if (point == CKPT_BLOCKMAP)
+	{
+		if (block_map_init(sb.num_blocks, sb.first_data_block,
+		                   sb.blocks_per_group) == -1
+		    || hdr.block_map_groups != block_map_groups()
+		    || block_map_load(fp) == -1)
+			point = CKPT_NONE;
+	}
+	fclose(fp);
+
+	if (point == CKPT_NONE)
+	{
+		printf("checkpoint %s is truncated, checking from the start\n",
+		       state_path);
+		return CKPT_NONE;
+	}
+	*group = hdr.group;
+	state_done = point == CKPT_DONE;
+	if (point != CKPT_DONE)
+		printf("resuming partition %d from %s pass at group %d\n",
+		       partition_num, point == CKPT_LINKS ? "link count" :
+		       "block bitmap", hdr.group);
+	return point;
+}
+
+
+/** @brief check if the interval since the last save has passed
+ *
+ *  @return 1 a checkpoint is due or 0 not
+ */
+int ckpt_due()
+{
+	return state_path != NULL && !keep_state
+	       && time(NULL) - last_save >= interval;
+}
+
+
+/** @brief save the state of the running check
+ *
+ *  @param point CKPT_* point reached
+ *  @param group first group not done at that point
+ *  @return void
+ */
+void ckpt_save(int point, int group)
+{
+	ckpt_header_t hdr;
+	FILE* fp = NULL;
+	int ok = 1;
+
+	if (state_path == NULL || keep_state)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CKPT_MAGIC;
+	hdr.version = CKPT_VERSION;
+	hdr.partition_num = cur_partition;
+	hdr.whole_disk = whole_disk;
+	hdr.point = point;
+	hdr.group = group;
+	hdr.disk_size = disk_size();
+	hdr.start_sec = pt_info.start_sec;
+	memcpy(hdr.uuid, sb.uuid, sizeof(hdr.uuid));
+	hdr.wtime = sb.wtime;
+	hdr.mnt_count = sb.mnt_count;
+	hdr.num_inodes = sb.num_inodes;
+	hdr.num_blocks = sb.num_blocks;
+	if (point == CKPT_BLOCKMAP)
+		hdr.block_map_groups = block_map_groups();
+
+	if ((fp = fopen(tmp_path, "wb")) == NULL)
+	{
+		perror("Could not open checkpoint file");
+		return;
+	}
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	if (ok && (point == CKPT_LINKS || point == CKPT_BLOCKMAP))
+		ok = inode_map_save(fp) == 0;
+	if (ok && point == CKPT_BLOCKMAP)
+		ok = block_map_save(fp) == 0;
+	/* the new state must be on disk before it replaces the old one */
+	ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0 || !ok || rename(tmp_path, state_path) != 0)
+	{
+		perror("Could not write checkpoint file");
+		unlink(tmp_path);
+		return;
+	}
+	last_save = time(NULL);
+	state_done = point == CKPT_DONE;
+}
+
+
+/** @brief remove the state file once every check is done and the
+ *   partition it names is finished
+ *
+ *  @return void
+ */
+void ckpt_finish()
+{
+	if (state_path != NULL && state_done)
+		unlink(state_path);
+}
+
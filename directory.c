@@ -18,8 +18,11 @@
 #include "ext2_fs.h"
 #include "utility.h"
 #include "readwrite.h"
+#include "icache.h"
 #include "fsck.h"
 #include "directory.h"
+#include "blockiter.h"
+#include "blockmap.h"
 
 /*** global variables ***/
 /** partition information */
@@ -28,202 +31,186 @@ extern partition_t pt_info;
 extern superblock_t sb;
 /** block group discriptor table */
 extern struct ext2_group_desc* bg_desc_table;
-/** local inode map */
-extern int* my_inode_map;
+/** local inode map, a saturating count per inode */
+extern unsigned char* my_inode_map;
 /** local local map */
-extern int* my_block_map;
+extern block_map_group_t* my_block_map;
 /** disk bitmap */
 extern unsigned char* bitmap;
 
 
-/** @brief find the end address of a directory entry 
- * 
- *  @param inode_num of the directory
- *  @return address of the end of directory entry
+/** @brief start parsing the entries of a directory block
+ *
+ *  @param it parse state
+ *  @param buf block content
+ *  @param size block size
+ *  @return void
  */
-unsigned int get_dir_entry_end(int inode_num, int newentry_size)
+void dirent_iter_init(dirent_iter_t* it, unsigned char* buf, int size)
 {
-	struct ext2_inode inode;
-	int inode_addr = 0;
-	
-	/* get inode addr (in byte) from inode number */
-	inode_addr = get_inode_addr(inode_num);
-	
-	/* read inode information from inode table entry */
-	read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
-
-	/* if it's not a directory, return */
-	if(!EXT2_S_ISDIR(inode.i_mode))
-		return -1;
+	it->buf = buf;
+	it->size = size;
+	it->offset = 0;
+	it->error = DIRENT_OK;
+}
 
-	unsigned char buf[sb.block_size]; /* 1024 bytes */
-	/* search in direct blocks */
-	int i = 0;
-	int ret = -1;
-	int found = 0;
-	for(i = 0; i < EXT2_NDIR_BLOCKS; i++)
-	{
-		if (inode.i_block[i] <= 0)
-			continue;
-		
-		int disk_offset = pt_info.base + inode.i_block[i] * sb.block_size;
-		read_bytes(disk_offset, buf, sb.block_size);
-		
-		/* traverse direct block[i] */
-		ret = find_dir_end_in_direct(disk_offset, buf, newentry_size);
-		if (ret > 0)
-		{
-			found = 1;
-			break;
-		}
-	}
 
-	if (!found && inode.i_block[EXT2_IND_BLOCK] != 0)
-	{	/* traverse singly indirect block */
-		read_bytes(pt_info.base + inode.i_block[EXT2_IND_BLOCK]*sb.block_size, 
-				    buf, sb.block_size);
-		ret = find_dir_end_singly((unsigned int*)buf, newentry_size);
-	}
-	if (!found && inode.i_block[EXT2_DIND_BLOCK] != 0)
-	{	/* traverse doubly indirect block */
-		read_bytes(pt_info.base + inode.i_block[EXT2_DIND_BLOCK]*sb.block_size, 
-				    buf, sb.block_size);
-		ret = find_dir_end_doubly((unsigned int*)buf, newentry_size);
-	}
-	if (!found && inode.i_block[EXT2_TIND_BLOCK] != 0)
-	{	/* traverse triply indirect block */
-		read_bytes(pt_info.base + inode.i_block[EXT2_TIND_BLOCK]*sb.block_size, 
-			 	    buf, sb.block_size);
-		ret = find_dir_end_triply((unsigned int*)buf, newentry_size);
-	}
-	return ret;
+/** @brief get the next entry of a directory block in place. An entry
+ *   whose rec_len or name does not fit the block stops the parse,
+ *   since nothing after it can be located.
+ *
+ *  @param it parse state
+ *  @param ent returns a view of the entry
+ *  @return 1 got an entry or 0 at the end or at a bad entry, which
+ *   sets it->error
+ */
+int dirent_next(dirent_iter_t* it, dirent_view_t* ent)
+{
+	int off = it->offset;
+	unsigned char* p = it->buf + off;
+	int rec_len = 0;
+
+	if (off >= it->size || it->error != DIRENT_OK)
+		return 0;
+
+	if (it->size - off < 8)
+		it->error = DIRENT_SHORT;
+	else if ((rec_len = *(__u16*)(p + 4)) < 8 || (rec_len & EXT2_DIR_ROUND))
+		it->error = DIRENT_BAD_LEN;
+	else if (rec_len > it->size - off)
+		it->error = DIRENT_OVERFLOW;
+	else if (p[6] + 8 > rec_len)
+		it->error = DIRENT_BAD_NAME;
+	if (it->error != DIRENT_OK)
+		return 0;
+
+	ent->ptr = p;
+	ent->offset = off;
+	ent->inode = *(__u32*)p;
+	ent->rec_len = rec_len;
+	ent->name_len = p[6];
+	ent->file_type = p[7];
+	ent->name = (const char*)(p + 8);
+	it->offset = off + rec_len;
+	return 1;
 }
 
 
-/** @brief search the end of directory entry in a direct block
- *  
- *  @param block block buffer
- *  @param new directory entry size to be appended
- *  @return new entry address or -1 if dir end is 
- *   not found in this block.
+/** @brief compare the name of an entry
+ *
+ *  @param ent entry
+ *  @param name name to compare with
+ *  @param len length of the name
+ *  @return 1 equal or 0 not
  */
-unsigned int find_dir_end_in_direct(unsigned int disk_offset,
-                           			unsigned char* buf,
-                           			int newentry_size)
+int dirent_name_is(const dirent_view_t* ent, const char* name, int len)
 {
-	struct ext2_dir_entry_2 dir_entry;
-	int dir_entry_base = 0;
+	return ent->name_len == len && memcmp(ent->name, name, len) == 0;
+}
 
-	while(1)
-	{
-		dir_entry.rec_len = *(__u16*)(buf + dir_entry_base + 4);
-		dir_entry.file_type = *(__u8*)(buf + dir_entry_base + 7);
-		dir_entry.name_len = *(__u8*)(buf + dir_entry_base + 6);
-		memcpy(dir_entry.name, buf + dir_entry_base + 8, dir_entry.name_len);
-		dir_entry.name[dir_entry.name_len] = '\0';
-		
 
-		if (dir_entry_base + dir_entry.rec_len >= sb.block_size)
-			break;
+/** @brief space wanted for a new directory entry */
+typedef struct dir_end_ctx
+{
+	int newentry_size;
+	long ret;
+} dir_end_ctx_t;
 
-		dir_entry_base += dir_entry.rec_len;
-	}
 
-	/* check found */
-	int name_size = (dir_entry.name_len - 1) / 4 * 4 + 4;
-	
-	int ret = -1;
-	if (dir_entry_base + 8 + name_size + newentry_size < sb.block_size)
+/** @brief block visitor looking for room at the end of a directory
+ *   block
+ *
+ *  @param block physical block number
+ *  @param logical logical block number
+ *  @param kind block kind
+ *  @param buf block content
+ *  @param priv dir_end_ctx_t of the search
+ *  @return ITER_STOP once room is found, else ITER_CONTINUE
+ */
+static int dir_end_visitor(unsigned int block, long logical, int kind,
+                           unsigned char* buf, void* priv)
+{
+	dir_end_ctx_t* ctx = (dir_end_ctx_t*)priv;
+
+	if (kind != BLOCK_DATA)
+		return ITER_CONTINUE;
+
+	long disk_offset = pt_info.base + (long)block * sb.block_size;
+	long ret = find_dir_end_in_direct(disk_offset, buf, ctx->newentry_size);
+	if (ret > 0)
 	{
-		ret = (disk_offset + dir_entry_base + 8 + name_size);
-		dir_entry.rec_len = 8 + name_size;
-		dir_entry.inode = *(__u32*)(buf + dir_entry_base + 0);
-		memcpy(dir_entry.name, buf + dir_entry_base + 8, dir_entry.name_len);
-		dir_entry.name[dir_entry.name_len] = '\0';
-		
-		write_bytes(disk_offset + dir_entry_base, &dir_entry, 
-		            dir_entry.rec_len);
+		ctx->ret = ret;
+		return ITER_STOP;
 	}
-	return ret;
+	return ITER_CONTINUE;
 }
 
 
-/** @brief traverse in singly indirect block of a directory 
- *  
- *  @param buf block content
- *  @param current_dir inode number of current dir
- *  @param parent_dir inode nmber of parent dir
+/** @brief find the end address of a directory entry 
+ * 
+ *  @param inode_num of the directory
+ *  @return address of the end of directory entry
  */
-unsigned int find_dir_end_singly(unsigned int* singly_buf, int newentry_size)
+long get_dir_entry_end(int inode_num, int newentry_size)
 {
-	unsigned char direct_buf[sb.block_size];
-	int i = 0;
-	int ret = -1;
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (singly_buf[i] == 0)
-			break;
-
-		int disk_offset = pt_info.base + singly_buf[i] * sb.block_size;
-		read_bytes(disk_offset, direct_buf, sb.block_size);
-		unsigned int ret = find_dir_end_in_direct(disk_offset,
-		                            direct_buf, newentry_size);
-		if (ret > 0)
-			break;
-	}
-	return ret;
+	struct ext2_inode inode;
+	
+	/* read inode information from inode table entry */
+	read_inode(inode_num, &inode);
+
+	/* if it's not a directory, return */
+	if(!EXT2_S_ISDIR(inode.i_mode))
+		return -1;
+
+	dir_end_ctx_t ctx;
+	ctx.newentry_size = newentry_size;
+	ctx.ret = -1;
+
+	/* search all data blocks of the directory */
+	iterate_blocks(&inode, ITER_READ_DATA, dir_end_visitor, &ctx);
+
+	return ctx.ret;
 }
 
 
-/** @brief traverse in doubly indirect block of a directory 
+/** @brief search the end of directory entry in a direct block
  *  
- *  @param buf block content
- *  @param current_dir inode number of current dir
- *  @param parent_dir inode nmber of parent dir
+ *  @param disk_offset disk offset of the block
+ *  @param buf block buffer
+ *  @param newentry_size size of the directory entry to be appended
+ *  @return new entry address or -1 if dir end is 
+ *   not found in this block.
  */
-unsigned int find_dir_end_doubly(unsigned int* doubly_buf, int newentry_size)
+long find_dir_end_in_direct(long disk_offset, unsigned char* buf,
+                            int newentry_size)
 {
-	unsigned int singly_buf[sb.block_size];
-	int i = 0;
-	int ret = -1;
-	for(i = 0; i < (sb.block_size / 4); i++)
+	dirent_iter_t it;
+	dirent_view_t ent, last;
+	int found = 0;
+
+	dirent_iter_init(&it, buf, sb.block_size);
+	while (dirent_next(&it, &ent))
 	{
-		if (doubly_buf[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + doubly_buf[i] * sb.block_size,
-		            singly_buf, sb.block_size);
-		unsigned int ret = find_dir_end_singly(singly_buf, newentry_size);
-		if (ret > 0)
-			break;
+		last = ent;
+		found = 1;
 	}
-	return ret;
-}
+	/* never append behind an entry that could not be parsed */
+	if (!found || it.error != DIRENT_OK)
+		return -1;
 
+	/* the last entry spans the rest of the block, an unused one is
+	 * taken over and a used one is shrunk to its name */
+	int used = last.inode == 0 ? 0 : EXT2_DIR_REC_LEN(last.name_len);
+	int wanted = (newentry_size + EXT2_DIR_ROUND) & ~EXT2_DIR_ROUND;
+	if (last.offset + used + wanted > sb.block_size)
+		return -1;
 
-/** @brief traverse in triply indirect block of a directory 
- *  
- *  @param buf block content
- *  @param current_dir inode number of current dir
- *  @param parent_dir inode nmber of parent dir
- */
-unsigned int find_dir_end_triply(unsigned int* triply_buf, int newentry_size)
-{
-	unsigned int doubly_buf[sb.block_size];
-	int i = 0;
-	int ret = -1;
-	for(i = 0; i < (sb.block_size / 4); i++)
+	if (used > 0)
 	{
-		if (triply_buf[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + triply_buf[i] * sb.block_size,
-		            doubly_buf, sb.block_size);
-		unsigned int ret = find_dir_end_doubly(doubly_buf, newentry_size);
-		if (ret > 0)
-			break;
+		__u16 rec_len = used;
+		write_bytes(disk_offset + last.offset + 4, &rec_len, sizeof(rec_len));
+		*(__u16*)(last.ptr + 4) = rec_len;
 	}
-	return ret;
+	return disk_offset + last.offset + used;
 }
 
-
@@ -19,10 +19,21 @@
 #include "ext2_fs.h"
 #include "utility.h"
 #include "readwrite.h"
+#include "icache.h"
+#include "isummary.h"
 #include "fsck.h"
 #include "traverse.h"
 #include "directory.h"
 #include "block.h"
+#include "blockmap.h"
+#include "bufpool.h"
+#include "mapstore.h"
+#include "inodemap.h"
+#include "stats.h"
+#include "trace.h"
+#include "problem.h"
+#include "checkpoint.h"
+#include "incremental.h"
 
 /*** global variables ***/
 /** partition information */
@@ -31,12 +42,18 @@ partition_t pt_info;
 superblock_t sb;
 /** block group discriptor table */
 struct ext2_group_desc* bg_desc_table = NULL;
-/** local inode map */
-int* my_inode_map = NULL;
-/** local local map */
-int* my_block_map = NULL;
+/** local inode map, a saturating count per inode */
+unsigned char* my_inode_map = NULL;
+/** local block map, an entry per group */
+block_map_group_t* my_block_map = NULL;
 /** disk bitmap */
 unsigned char* bitmap;
+/** groups holding a superblock backup, one byte per group */
+static unsigned char* backup_groups = NULL;
+/** inodes the inode scans visit, one bit per inode, NULL for all */
+static unsigned char* scan_map = NULL;
+/** scan every inode slot, whatever the bitmaps say */
+static int paranoid = 0;
 
 /** @brief initialize partition and superblock information 
  *   of a given partition
@@ -64,6 +81,11 @@ int fsck_partition_init(int partition_num)
 		        partition_num);
 		return -1;
 	}
+	if (build_backup_table() == -1)
+	{
+		printf("allocating backup group table failed\n");
+		return -1;
+	}
 	return 0;
 }
 
@@ -92,9 +114,9 @@ int read_partition_info(int partition_num, partition_t *pt)
 	{
 		pe_offset += PARTITION_ENTRY_SIZE * (partition_num - 1);
 		pt->type = buf[pe_offset + 0x4];
-		pt->start_sec = *(int*)(buf + pe_offset + 0x8);
-		pt->base = pt->start_sec * SECTOR_SIZE;
-		pt->length = *(int*)(buf + pe_offset + 0xc);
+		pt->start_sec = *(unsigned int*)(buf + pe_offset + 0x8);
+		pt->base = (long)pt->start_sec * SECTOR_SIZE;
+		pt->length = *(unsigned int*)(buf + pe_offset + 0xc);
 		return 0;
 	}
 	
@@ -115,8 +137,8 @@ int read_partition_info(int partition_num, partition_t *pt)
 		return -1;
 
 	/* read extended partition information */
-	int first_ebr = *(int*)(buf + BOOTSTRAP_SIZE + 16 * (i-1) +8);
-	int partition_first_sec = first_ebr;
+	unsigned int first_ebr = *(unsigned int*)(buf + BOOTSTRAP_SIZE + 16 * (i-1) +8);
+	unsigned int partition_first_sec = first_ebr;
 	
 	/* locating the extended partition */
 	for (i = 5; i < partition_num; i++)
@@ -130,7 +152,7 @@ int read_partition_info(int partition_num, partition_t *pt)
 			break;
 
 		/* get the start sector of of next ext partition */
-		partition_first_sec = first_ebr + *(int*)(buf + BOOTSTRAP_SIZE + 24);
+		partition_first_sec = first_ebr + *(unsigned int*)(buf + BOOTSTRAP_SIZE + 24);
 	}
 	/* reach the end of ext blocks and the given partition doesn't exist. */
 	if(i < partition_num)
@@ -142,9 +164,9 @@ int read_partition_info(int partition_num, partition_t *pt)
 	read_sector(partition_first_sec, buf, SECTOR_SIZE);
 	/* read the infor of partition partition_num */
 	pt->type = buf[BOOTSTRAP_SIZE + 4];
-	pt->start_sec = partition_first_sec + *(int*)(buf + BOOTSTRAP_SIZE + 8);
-	pt->base = pt->start_sec * SECTOR_SIZE;
-	pt->length = *(int*)(buf + BOOTSTRAP_SIZE + 12);
+	pt->start_sec = partition_first_sec + *(unsigned int*)(buf + BOOTSTRAP_SIZE + 8);
+	pt->base = (long)pt->start_sec * SECTOR_SIZE;
+	pt->length = *(unsigned int*)(buf + BOOTSTRAP_SIZE + 12);
 
 	return 0;
 }
@@ -171,21 +193,57 @@ int read_superblock_info(int partition_num)
 	read_sector(pt.start_sec + 1024/SECTOR_SIZE, &sb_t, 
 	            sizeof(struct ext2_super_block));
 	
+	if (sb_t.s_magic != EXT2_SUPER_MAGIC || sb_t.s_log_block_size > 6)
+	{
+		printf("partition %d has no ext2 superblock\n", partition_num);
+		return -1;
+	}
+
 	/** set global variable sb **/
 	sb.block_size = EXT2_BLOCK_SIZE(&sb_t);
 	sb.inode_size = EXT2_INODE_SIZE(&sb_t);
+	sb.first_data_block = sb_t.s_first_data_block;
 
 	sb.num_blocks = sb_t.s_blocks_count;
 	sb.blocks_per_group = EXT2_BLOCKS_PER_GROUP(&sb_t);
 
 	sb.num_inodes = sb_t.s_inodes_count;
 	sb.inodes_per_group = EXT2_INODES_PER_GROUP(&sb_t);
+	sb.first_ino = EXT2_FIRST_INO(&sb_t);
+
+	sb.wtime = sb_t.s_wtime;
+	sb.mnt_count = sb_t.s_mnt_count;
+	memcpy(sb.uuid, sb_t.s_uuid, sizeof(sb.uuid));
+
+	memcpy(sb.hash_seed, sb_t.s_hash_seed, sizeof(sb.hash_seed));
+	sb.unsigned_hash = (sb_t.s_flags & EXT2_FLAGS_UNSIGNED_HASH) != 0;
+
+	/* a group is described by one bitmap block */
+	if (sb.blocks_per_group <= 0 || sb.blocks_per_group > sb.block_size * 8
+	    || sb.inodes_per_group <= 0 || sb.inodes_per_group > sb.block_size * 8
+	    || sb.num_blocks <= sb.first_data_block)
+	{
+		printf("partition %d has an invalid group layout\n", partition_num);
+		return -1;
+	}
 	
-	/* calculate number of blocks */
-	sb.num_groups = (sb.num_blocks-1) / sb.blocks_per_group + 1;
+	/* calculate number of groups, counted from the first data block */
+	sb.num_groups = (sb.num_blocks - sb.first_data_block - 1)
+	                / sb.blocks_per_group + 1;
+
+	/* blocks taken by metadata in each group */
+	sb.gdt_blocks = ((long)sizeof(struct ext2_group_desc) * sb.num_groups - 1)
+	                / sb.block_size + 1;
+	sb.resize_inode = 
+	   (sb_t.s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO) != 0;
+	sb.reserved_gdt_blocks = sb.resize_inode ? sb_t.s_reserved_gdt_blocks : 0;
+	sb.itable_blocks = ((long)sb.inodes_per_group * sb.inode_size - 1)
+	                   / sb.block_size + 1;
+	sb.sparse_super = 
+	   (sb_t.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) != 0;
 	
 	printf("************ partition %d *************\n", pt_info.partition_num);
-	printf("start sector = %d  base = %d\n", pt_info.start_sec, pt_info.base);
+	printf("start sector = %u  base = %ld\n", pt_info.start_sec, pt_info.base);
 	printf("block size = %d\n", sb.block_size);
 	printf("inode size = %d\n\n", sb.inode_size);
 	printf("number of blocks = %d\n", sb.num_blocks);
@@ -216,14 +274,224 @@ int read_bg_desc_table()
 	if (bg_desc_table == NULL)
 		return -1;
 
-	/* read block group table from sector 4 of the partition */
-	read_sector(pt_info.start_sec + 2048/SECTOR_SIZE, 
-	            bg_desc_table, bg_desc_size * sb.num_groups);
+	/* the table starts in the block after the superblock */
+	read_bytes(pt_info.base + (long)(sb.first_data_block + 1) * sb.block_size,
+	           bg_desc_table, bg_desc_size * sb.num_groups);
 
 	return 0;
 }
 
 
+/** @brief find the groups holding a copy of the superblock and the
+ *   descriptor table. Every group has one, unless sparse_super limits
+ *   them to groups 0, 1 and the powers of 3, 5 and 7.
+ *
+ *  @return 0 success or -1 fail
+ */
+int build_backup_table()
+{
+	int i = 0;
+
+	free(backup_groups);
+	backup_groups = (unsigned char*)malloc(sb.num_groups);
+	if (backup_groups == NULL)
+		return -1;
+
+	for (i = 0; i < sb.num_groups; i++)
+		backup_groups[i] = !sb.sparse_super || i <= 1 || ispowerof(i, 3)
+		                   || ispowerof(i, 5) || ispowerof(i, 7);
+	return 0;
+}
+
+
+/** @brief check if a group holds a superblock copy
+ *
+ *  @param group group number
+ *  @return 1 yes or 0 no
+ */
+int group_has_super(int group)
+{
+	return backup_groups[group];
+}
+
+
+
+/** @brief scan every inode slot in the inode scans
+ *
+ *  @return void
+ */
+void fsck_set_paranoid()
+{
+	paranoid = 1;
+}
+
+
+/** @brief check if the inode scans visit an inode
+ *
+ *  @param inode_num inode number
+ *  @return 1 visit or 0 skip
+ */
+int inode_scan_wanted(int inode_num)
+{
+	return scan_map == NULL || (scan_map[inode_num >> 3] >> (inode_num & 7)) & 1;
+}
+
+
+/** @brief check that the free slots of a group are really unused.
+ *   Inode table blocks holding used inodes are read by the scans
+ *   anyway, all of their free slots are checked. Of the blocks with
+ *   only free slots, a few spread over the table are read.
+ *
+ *  @param group group number
+ *  @param buf block buffer
+ *  @return 1 all checked free slots unused or 0 not
+ */
+static int verify_free_slots(int group, unsigned char* buf)
+{
+	int per_block = sb.block_size / sb.inode_size;
+	int first = group * sb.inodes_per_group + 1;
+	int count = sb.inodes_per_group;
+	long blk = 0, next_sample = 0;
+	int samples = 0, j = 0;
+
+	if (first + count - 1 > sb.num_inodes)
+		count = sb.num_inodes - first + 1;
+
+	for (blk = 0; blk * per_block < count; blk++)
+	{
+		int used = 0, skipped = 0;
+		int end = (blk + 1) * per_block < count ? (blk + 1) * per_block
+		                                        : count;
+		for (j = blk * per_block; j < end; j++)
+		{
+			if (inode_scan_wanted(first + j))
+				used = 1;
+			else
+				skipped = 1;
+		}
+		if (!skipped)
+			continue;
+		if (!used)
+		{
+			/* free block, only a sample of them is read */
+			if (blk < next_sample || samples >= INODE_SAMPLE_BLOCKS)
+				continue;
+			samples++;
+			next_sample = (long)samples * sb.itable_blocks
+			              / INODE_SAMPLE_BLOCKS;
+		}
+
+		read_bytes(pt_info.base
+		           + ((long)bg_desc_table[group].bg_inode_table + blk)
+		             * sb.block_size, buf, sb.block_size);
+		for (j = blk * per_block; j < end; j++)
+		{
+			struct ext2_inode* inode = (struct ext2_inode*)
+			   (buf + (long)(j - blk * per_block) * sb.inode_size);
+			if (!inode_scan_wanted(first + j) && inode->i_links_count > 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+/** @brief find the inodes the inode scans visit: the ones the inode
+ *   bitmaps mark as used. Groups whose descriptor counts every inode
+ *   free are skipped without reading their bitmap, and so are groups
+ *   unchanged since an incremental check. A sample of the skipped slots
+ *   of each group is read, and a group where one of them is linked is
+ *   scanned in full. Slots in holes of a sparse image are zero and
+ *   skipped as well.
+ *
+ *  @return void
+ */
+void build_inode_scan()
+{
+	int g = 0, j = 0;
+	int per_block = sb.block_size / sb.inode_size;
+
+	free(scan_map);
+	scan_map = NULL;
+	if (paranoid)
+		return;
+	scan_map = (unsigned char*)calloc(sb.num_inodes / 8 + 1, 1);
+	if (scan_map == NULL)
+		return;
+
+	unsigned char* buf = acquire_block_buf();
+	for (g = 0; g < sb.num_groups; g++)
+	{
+		int first = g * sb.inodes_per_group + 1;
+		int count = sb.inodes_per_group;
+		if (first + count - 1 > sb.num_inodes)
+			count = sb.num_inodes - first + 1;
+		if (incr_group_trusted(g))
+			continue;
+
+		if (bg_desc_table[g].bg_free_inodes_count < sb.inodes_per_group)
+		{
+			read_bytes(pt_info.base
+			           + (long)bg_desc_table[g].bg_inode_bitmap * sb.block_size,
+			           buf, sb.block_size);
+			for (j = 0; j < count; j++)
+				if ((buf[j >> 3] >> (j & 7)) & 1)
+					scan_map[(first + j) >> 3] |= 1 << ((first + j) & 7);
+		}
+
+		if (!verify_free_slots(g, buf))
+		{
+			printf("inode bitmap of group %d misses used inodes, "
+			       "scanning the group\n", g);
+			for (j = 0; j < count; j++)
+				scan_map[(first + j) >> 3] |= 1 << ((first + j) & 7);
+		}
+
+		/* inode table blocks in a hole of the image are all zero */
+		long table = pt_info.base
+		             + (long)bg_desc_table[g].bg_inode_table * sb.block_size;
+		for (j = 0; j < count; j += per_block)
+		{
+			if (!is_hole(table + (long)j * sb.inode_size, sb.block_size))
+				continue;
+			int k = 0;
+			for (k = j; k < j + per_block && k < count; k++)
+				scan_map[(first + k) >> 3] &= ~(1 << ((first + k) & 7));
+		}
+	}
+	release_block_buf(buf);
+}
+
+
+/** @brief estimate the memory the check of a partition allocates,
+ *   from its superblock alone
+ *
+ *  @param partition_num partition number
+ *  @return bytes or -1 if the partition holds no ext2 filesystem
+ */
+long fsck_estimate_memory(int partition_num)
+{
+	if (read_superblock_info(partition_num) == -1)
+		return -1;
+
+	long inodes = (long)sb.num_inodes + 1;
+	long maps = inodes                                   /* inode map */
+	          + inodes * (2 * sizeof(__u16) + 2 * sizeof(__u32)
+	                      + EXT2_N_BLOCKS * sizeof(__u32))  /* summary */
+	          + (long)sb.num_blocks / 8 + 1;             /* block map */
+	/* maps over the limit live in files */
+	if (mstore_limit() > 0 && maps > mstore_limit())
+		maps = mstore_limit();
+	long mem = maps
+	         + 2 * (inodes / 8 + 1)         /* scan and marked inodes */
+	         + (long)sb.num_blocks / 8 + 1  /* touched blocks */
+	         + (long)sb.num_groups * (sizeof(struct ext2_group_desc) + 1)
+	         + ICACHE_BYTES
+	         + (long)BUF_POOL_INIT_SIZE * BUF_POOL_BATCH_BLOCKS
+	           * sb.block_size;
+	return mem;
+}
+
 
 /** @brief check errors and fix them 
  *
@@ -232,38 +500,148 @@ int read_bg_desc_table()
  */
 int fix_fs(int partition_num)
 {
+	int ret = -1;
+
+	stats_reset();
+	problem_begin_check(partition_num);
 	if (fsck_partition_init(partition_num) == -1)
-		return -1;
+		goto cleanup;
+	if (buf_pool_init(sb.block_size) == -1)
+		goto cleanup;
+	/* without the cache every inode is read on its own */
+	if (icache_init(sb.block_size) == -1)
+		printf("allocating inode cache failed\n");
+	stats_track_blocks(pt_info.base, sb.block_size, sb.num_blocks);
+	trace_begin_check(partition_num, pt_info.base, sb.block_size);
 	
-	my_inode_map = (int*)malloc((sb.num_inodes+1) * sizeof(int));
-	/* initialize local inode map */
-	int i = 0;
-	for (; i<= sb.num_inodes; i++)
-		my_inode_map[i] = 0;
+	/* local inode map, zeroed */
+	if (inode_map_init(sb.num_inodes) == -1)
+	{
+		printf("allocating local inode map failed\n");
+		goto cleanup;
+	}
 
-	/* traverse and check file system */
-	traverse_dir(EXT2_ROOT_INO, EXT2_ROOT_INO);
-	
-	/*** pass 2 - fix missing inodes ***/
-	fix_unreferenced_inode();
+	/* continue a check that was stopped */
+	int group = 0;
+	int point = ckpt_begin_check(partition_num, &group);
+	/* a resumed or paranoid check trusts no group */
+	incr_begin_check(partition_num, point == CKPT_NONE && !paranoid);
+	/* later passes loop over the summary instead of the inode tables,
+	 * and the scan marks the blocks too. Once the block map is restored
+	 * only the bitmaps are left to compare, which need neither. */
+	if (point < CKPT_BLOCKMAP)
+	{
+		build_inode_scan();
+		int mark = begin_block_map() == 0;
+		if (isum_build(mark) == -1)
+			printf("allocating inode summary failed\n");
+	}
+	if (point == CKPT_DONE)
+		printf("partition %d was already checked\n", partition_num);
 
-	/* traverse again */
-	for (i = 0; i<= sb.num_inodes; i++)
-		my_inode_map[i] = 0;
-	/* traverse and check file system */
-	traverse_dir(EXT2_ROOT_INO, EXT2_ROOT_INO);
+	if (point == CKPT_NONE)
+	{
+		/* traverse and check file system */
+		phase_begin(PHASE_TRAVERSE);
+		incr_begin_traversal();
+		traverse_dir(EXT2_ROOT_INO, EXT2_ROOT_INO);
+		
+		/*** pass 2 - fix missing inodes ***/
+		phase_begin(PHASE_UNREF);
+		fix_unreferenced_inode();
+
+		/* traverse again */
+		phase_begin(PHASE_RETRAVERSE);
+		inode_map_reset();
+		/* traverse and check file system */
+		incr_begin_traversal();
+		traverse_dir(EXT2_ROOT_INO, EXT2_ROOT_INO);
+		ckpt_save(CKPT_LINKS, 0);
+	}
 
 	/*** pass 3 - fix wrong link counts ***/
-	fix_link_counts();
+	if (point <= CKPT_LINKS)
+	{
+		phase_begin(PHASE_LINKS);
+		fix_link_counts(point == CKPT_LINKS ? group : 0);
+
+		phase_begin(PHASE_BLOCKMAP);
+		build_block_map();
+		ckpt_save(CKPT_BLOCKMAP, 0);
+	}
 
 	/*** pass 4 - fix block map ***/
-	fix_block_map();
+	if (point <= CKPT_BLOCKMAP)
+	{
+		if (point == CKPT_BLOCKMAP)
+			phase_begin(PHASE_BLOCKMAP);
+		fix_block_map(point == CKPT_BLOCKMAP ? group : 0);
+		phase_end(PHASE_BLOCKMAP);
+		ckpt_save(CKPT_DONE, 0);
+	}
 
+	/* fingerprint the groups as they are left */
+	incr_end_check();
+	ret = 0;
+
+cleanup:
+	/* a failed check releases and reports what it got to as well */
+	problem_end_check();
 	printf("\n");
 	
-	free(my_inode_map);
-	free(my_block_map);
-	return 0;
+	inode_map_free();
+	isum_free();
+	free(scan_map);
+	scan_map = NULL;
+	block_map_free();
+	icache_destroy();
+	buf_pool_destroy();
+	stats_end_check(partition_num);
+	return ret;
+}
+
+
+/** @brief drop the pages of the inode maps a pass going forward is
+ *   done with, up to the end of a group, when they are kept in files
+ *
+ *  @param i last inode the pass looked at
+ *  @return void
+ */
+static void evict_inodes(int i)
+{
+	if (i % sb.inodes_per_group != 0 && i != sb.num_inodes)
+		return;
+	long first = (long)(i - 1) / sb.inodes_per_group * sb.inodes_per_group + 1;
+	inode_map_evict(first, i + 1L);
+	isum_evict(first, i + 1L);
+}
+
+
+/** @brief check if an inode is linked while no entry refers to it.
+ *   The reserved inodes other than root are never linked, and free
+ *   slots are not read. Neither are the inodes of an unchanged group
+ *   the last check left unreferenced.
+ *
+ *  @param i inode number
+ *  @param summary inode summary or NULL to read the inode
+ *  @return 1 unreferenced or 0 not
+ */
+static int is_unreferenced(int i, inode_summary_t* summary)
+{
+	struct ext2_inode inode;
+
+	if (inode_map_get(i) != 0 || (i != EXT2_ROOT_INO && i < sb.first_ino))
+		return 0;
+	int stored = incr_stored_links(i);
+	if (stored == 0 || (stored < 0 && !inode_scan_wanted(i)))
+		return 0;
+	if (summary != NULL && stored < 0)
+		return summary->links[i] > 0;
+
+	trace_set_inode(i);
+	/* read inode information from inode table entry */
+	read_inode(i, &inode);
+	return inode.i_links_count > 0;
 }
 
 
@@ -273,53 +651,42 @@ int fix_fs(int partition_num)
  */
 void fix_unreferenced_inode()
 {
-	int inode_addr;;
 	struct ext2_inode inode;
 	int i = 0, j = 0;
 	int parent = 0, parent_missing = 0;
 
+	inode_summary_t* summary = isum_table();
+
 	int num = 0;
-	/* get number of referenced inodes */
+	/* get number of unreferenced inodes */
 	for (i = 1; i<= sb.num_inodes; i++)
 	{
-		/* get inode addr (in byte) from inode number */
-		inode_addr = get_inode_addr(i);
-		
-		/* read inode information from inode table entry */
-		read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
-		
-		if (my_inode_map[i] == 0 && inode.i_links_count > 0)
+		if (is_unreferenced(i, summary))
 			num++;
+		evict_inodes(i);
 	}
 	/* collect missing inodes, put them into uref_inodes array */
 	int uref_inodes[num+1];
 	int cnt = 1;
 	for (i = 1; i<= sb.num_inodes; i++)
 	{
-		/* get inode addr (in byte) from inode number */
-		inode_addr = get_inode_addr(i);
-		
-		/* read inode information from inode table entry */
-		read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
-		
-		if (my_inode_map[i] == 0 && inode.i_links_count > 0)
+		if (is_unreferenced(i, summary))
 			uref_inodes[cnt++] = i;
+		evict_inodes(i);
 	}
 	
 	/* begin fixings */
 	for (i = 1; i<= num; i++)
 	{
 		int uref_i = uref_inodes[i];
-		/* get inode addr (in byte) from inode number */
-		inode_addr = get_inode_addr(uref_i);
-		
+		trace_set_inode(uref_i);
 		/* read inode information from inode table entry */
-		read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
+		read_inode(uref_i, &inode);
 
 		/* get its file type, if it's not dir, put it into lost+found */
 		if (!EXT2_S_ISDIR(inode.i_mode))
 		{
-			printf("putting %d into lost+found\n", uref_i);
+			problem_report(PR_UNREF, "putting %d into lost+found", uref_i);
 			put_into_lostfound(uref_i);
 		}
 		else
@@ -335,142 +702,272 @@ void fix_unreferenced_inode()
 			}
 			if (!parent_missing)
 			{
-				printf("putting %d into lost+found\n", uref_i);
+				problem_report(PR_UNREF, "putting %d into lost+found", uref_i);
 				put_into_lostfound(uref_i);
 			}
 		}
 	}
+	trace_set_inode(0);
 }
 
 
 /** @brief fix wrong link counts 
  *  
+ *  @param first_group group to start from
  *  @return void
  */
-void fix_link_counts()
+void fix_link_counts(int first_group)
 {
-	int inode_addr;;
 	struct ext2_inode inode;
+	inode_summary_t* summary = isum_table();
 	int i = 0;
 
-	/* fix wrong link counts */
-	for (i = 1; i<= sb.num_inodes; i++)
+	/* fix wrong link counts, reserved inodes keep theirs */
+	for (i = first_group * sb.inodes_per_group + 1; i<= sb.num_inodes;
+	     evict_inodes(i++))
 	{
-		/* get inode addr (in byte) from inode number */
-		inode_addr = get_inode_addr(i);
-		
+		/* save the state between groups once in a while */
+		if (i % sb.inodes_per_group == 1 && ckpt_due())
+			ckpt_save(CKPT_LINKS, i / sb.inodes_per_group);
+		if (i != EXT2_ROOT_INO && i < sb.first_ino)
+			continue;
+		int links = inode_map_get(i);
+		/* an unchanged group holds the counts the last check left */
+		int stored = incr_stored_links(i);
+		if (stored >= 0)
+		{
+			if (stored == links)
+				continue;
+		}
+		else
+		{
+			/* a free slot nothing refers to has no link count to fix */
+			int wanted = inode_scan_wanted(i);
+			if (!wanted && links == 0)
+				continue;
+			/* a summarized count is compared without reading the inode */
+			if (summary != NULL && wanted && summary->links[i] == links)
+				continue;
+		}
+		trace_set_inode(i);
 		/* read inode information from inode table entry */
-		read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
+		read_inode(i, &inode);
 		
-		if (my_inode_map[i] != inode.i_links_count)
+		if (links != inode.i_links_count)
 		{
-			printf("inode %d link count error ", i);
-			printf("actual: %d  stored: %d\n",
-				    my_inode_map[i], inode.i_links_count);
-			inode.i_links_count = my_inode_map[i];
-			write_bytes((long)inode_addr, &inode, sizeof(inode));
+			problem_report(PR_LINK_COUNT, "inode %d link count error "
+			               "actual: %d  stored: %d",
+			               i, links, inode.i_links_count);
+			inode.i_links_count = links;
+			write_inode(i, &inode);
+			isum_set_links(i, inode.i_links_count);
 		}
 	}
+	trace_set_inode(0);
 }
 
 
-/** @brief fix block allocation map */
-void fix_block_map()
+/** @brief allocate the local block map and mark the metadata, before
+ *   the inode scan marks the blocks of the inodes in use
+ *
+ *  @return 0 success or -1 fail
+ */
+int begin_block_map()
 {
-	my_block_map = (int*)malloc(sb.num_groups*sb.blocks_per_group*4);
-	/* first data block start from 0 or 1 ? */
-	int s_fst_db = 1024 / sb.block_size;
-
-	/* initialize local inode map */
-	int i = 0, j = 0;
-	for (i = 0; i< sb.num_groups*sb.blocks_per_group; i++)
-	{
-		my_block_map[i] = 0;
-	}
+	int i = 0;
 
-	int blk_size = sb.block_size;
-	/* meta block and superblock covers 2048 bytes */
-	int size = 2048;
-	/* block group table covers some block */
-	int bg_desc_size = sizeof(struct ext2_group_desc);
-	size += bg_desc_size * sb.num_groups;
-	//int k = (size - 1) / blk_size *blk_size + blk_size;
-	int k = (size - 1) / blk_size + 1;
-	//printf("k = %d\n",k);
-	for (i = 0; i< k; i++)
+	/* initialize local block map */
+	if (block_map_init(sb.num_blocks, sb.first_data_block,
+	                   sb.blocks_per_group) == -1)
 	{
-		my_block_map[i] = 1;
+		printf("allocating local block map failed\n");
+		return -1;
 	}
 
-	/* inode table, block bitmap and inode bitmap in each
-	 * group also covers some block */
+	/* superblock, descriptor table and its reserved blocks at the
+	 * start of the groups with a copy, then bitmaps and inode table */
+	int super_blocks = 1 + sb.gdt_blocks + sb.reserved_gdt_blocks;
 	for (i = 0; i<sb.num_groups; i++)
 	{
-		/* mark superblock and bg descriptor table backup blocks */
-		if (i==1 || ispowerof(i, 3) || ispowerof(i, 5) || ispowerof(i, 7))
-		{
-			my_block_map[s_fst_db + i * sb.blocks_per_group] = 1;
-			my_block_map[s_fst_db + i * sb.blocks_per_group + 1] = 1;
-		}
-
-		/* block bitmap takes one block */
-		int addr = bg_desc_table[i].bg_block_bitmap;
-		my_block_map[addr] = 1;
-		/* inode bitmap takes one block */
-		addr = bg_desc_table[i].bg_inode_bitmap;
-		my_block_map[addr] = 1;
-		
-		/* inode table takes several blocks */
-		addr = bg_desc_table[i].bg_inode_table;
-		size = sb.inodes_per_group * sb.inode_size;
-		k = (size - 1) / blk_size + 1;
-		//printf("addr = %d  k = %d\n", addr, k);
-		for (j = addr; j < addr + k; j++)
-			my_block_map[j] = 1;
+		if (group_has_super(i))
+			block_map_set_range(sb.first_data_block
+			                    + (long)i * sb.blocks_per_group, super_blocks);
+		block_map_set(bg_desc_table[i].bg_block_bitmap);
+		block_map_set(bg_desc_table[i].bg_inode_bitmap);
+		block_map_set_range(bg_desc_table[i].bg_inode_table,
+		                    sb.itable_blocks);
 	}
 	
-	for (i = 1; i<= sb.num_inodes; i++)
+	/* the resize inode is not linked, its double indirect block
+	 * lists the reserved descriptor blocks already marked */
+	if (sb.resize_inode)
 	{
-		if (my_inode_map[i] <= 0)
+		struct ext2_inode inode;
+		read_inode(EXT2_RESIZE_INO, &inode);
+		block_map_set(inode.i_block[EXT2_DIND_BLOCK]);
+	}
+
+	/* without the record of scanned inodes every referenced inode
+	 * is marked when the map is finished */
+	if (mark_blocks_begin_scan() == -1)
+		printf("allocating scan marks failed\n");
+	return 0;
+}
+
+
+/** @brief check that the block bitmaps of the groups an incremental
+ *   check compares agree with the local block map
+ *
+ *  @return 1 agree or 0 not
+ */
+static int compared_bitmaps_agree()
+{
+	int g = 0, i = 0, agree = 1;
+
+	unsigned char* disk = acquire_block_buf();
+	unsigned char* expect = acquire_block_buf();
+	for (g = 0; g < sb.num_groups && agree; g++)
+	{
+		if (incr_group_trusted(g))
 			continue;
-		mark_block(i);
+		long group_start = sb.first_data_block + (long)g * sb.blocks_per_group;
+		int end = sb.blocks_per_group;
+		if (sb.num_blocks - group_start < end)
+			end = sb.num_blocks - group_start;
+
+		read_bytes(pt_info.base
+		           + (long)bg_desc_table[g].bg_block_bitmap * sb.block_size,
+		           disk, sb.block_size);
+		block_map_group_bits(g, expect);
+		for (i = 0; i < end && agree; i++)
+			if (((disk[i/8] ^ expect[i/8]) >> (i%8)) & 1)
+				agree = 0;
+	}
+	release_block_buf(expect);
+	release_block_buf(disk);
+	return agree;
+}
+
+
+/** @brief finish the local block map: the blocks of the metadata and
+ *   of every referenced inode. The inodes of groups unchanged since an
+ *   incremental check are not read, their blocks in the other groups
+ *   are marked from the database.
+ *
+ *  @return void
+ */
+void build_block_map()
+{
+	if (my_block_map == NULL && begin_block_map() == -1)
+		return;
+
+	/* keep the trees of referenced inodes only */
+	reconcile_block_marks();
+
+	/* a stray claim on an unchanged group or a bitmap that disagrees
+	 * may leave the saved blocks short, none of them is repaired
+	 * before every block tree is walked */
+	if (incr_trusted_groups() > 0
+	    && (incr_mark_trusted_blocks() == -1 || !compared_bitmaps_agree()))
+	{
+		printf("block bitmaps differ, marking the blocks of every inode\n");
+		incr_distrust();
+		if (begin_block_map() == -1)
+			return;
+		reconcile_block_marks();
 	}
 
-	/* compare block bitmap */
-	int num = sb.num_blocks;
-	bitmap = (unsigned char*)malloc(sb.block_size);
+	/* report blocks claimed more than once */
+	resolve_dup_blocks();
+	report_dup_blocks();
+}
+
+
+/** @brief fix block allocation map 
+ *
+ *  @param first_group group to start from
+ *  @return void
+ */
+void fix_block_map(int first_group)
+{
+	int i = 0;
+
+	/* compare block bitmap of each group */
+	bitmap = acquire_block_buf();
+	unsigned char* expect = acquire_block_buf();
 	int group_num = 0;
-	while (num > 0)
+	for (group_num = first_group; group_num < sb.num_groups; group_num++)
 	{
-		int end = 0;
-		if (num >= sb.blocks_per_group)
-			end = sb.blocks_per_group;
-		else
-			end = num - s_fst_db;
+		/* save the state between groups once in a while */
+		if (group_num > first_group && ckpt_due())
+			ckpt_save(CKPT_BLOCKMAP, group_num);
+		/* an unchanged group keeps the bitmap the last check left */
+		if (incr_group_trusted(group_num))
+		{
+			block_map_evict(group_num);
+			continue;
+		}
+
+		long group_start = sb.first_data_block
+		                   + (long)group_num * sb.blocks_per_group;
+		long bitmap_addr = pt_info.base
+		      + (long)bg_desc_table[group_num].bg_block_bitmap * sb.block_size;
+		int changed = 0;
+
+		/* the last group may be shorter */
+		int end = sb.blocks_per_group;
+		if (sb.num_blocks - group_start < end)
+			end = sb.num_blocks - group_start;
 		
-		read_bytes(pt_info.base + bg_desc_table[group_num].bg_block_bitmap * sb.block_size, 
-					bitmap, sb.block_size);
+		read_bytes(bitmap_addr, bitmap, sb.block_size);
+		block_map_group_bits(group_num, expect);
 		
 		for (i = 0; i< end; i++)
 		{
-			if ((((bitmap[i/8] & (1<<(i%8))) == 0) && (my_block_map[group_num*sb.blocks_per_group + i+s_fst_db] != 0))
-			 || (((bitmap[i/8] & (1<<(i%8))) != 0) && (my_block_map[group_num*sb.blocks_per_group + i+s_fst_db] == 0)) )
+			/* a whole byte that agrees needs no look at its bits */
+			if (i % 8 == 0 && i + 8 <= end && bitmap[i/8] == expect[i/8])
+			{
+				i += 7;
+				continue;
+			}
+			int used = (expect[i/8] >> (i%8)) & 1;
+			if ((((bitmap[i/8] & (1<<(i%8))) == 0) && used)
+			 || (((bitmap[i/8] & (1<<(i%8))) != 0) && !used) )
 			{
-				printf("block bitmap %d in group %d wrong, I got %d\n",
-					    i, group_num, my_block_map[group_num*sb.blocks_per_group + i]);
-				bitmap[i/8] = (bitmap[i/8] & (~(1<<(i%8)))) | (my_block_map[group_num*sb.blocks_per_group + i+ s_fst_db] << (i%8));
+				problem_report(PR_BLOCK_BITMAP,
+				               "block bitmap %d in group %d wrong, I got %d",
+				               i, group_num, used);
+				bitmap[i/8] = (bitmap[i/8] & (~(1<<(i%8)))) | (used << (i%8));
+				changed = 1;
 			}
 		}
+
+		/* bits past the end of the group are padding, always set */
+		int padding_fixed = 0;
+		for (i = end; i < sb.block_size * 8; i++)
+		{
+			if ((bitmap[i/8] & (1<<(i%8))) == 0)
+			{
+				bitmap[i/8] |= 1<<(i%8);
+				padding_fixed = 1;
+			}
+		}
+		if (padding_fixed)
+		{
+			problem_report(PR_BLOCK_BITMAP,
+			               "padding of block bitmap in group %d not set",
+			               group_num);
+			changed = 1;
+		}
 		
 		/* fix block map */
-		write_bytes((long)(pt_info.base + bg_desc_table[group_num].bg_block_bitmap * sb.block_size), 
-			               bitmap, sb.block_size);
-
-		group_num++;
-		num -= sb.blocks_per_group;
+		if (changed)
+			write_bytes(bitmap_addr, bitmap, sb.block_size);
+		block_map_evict(group_num);
 	}
 
-	free(bitmap);
+	release_block_buf(expect);
+	release_block_buf(bitmap);
 }
 
 
@@ -483,40 +980,57 @@ void fix_block_map()
 int put_into_lostfound(int inode_num)
 {
 	struct ext2_inode inode;
-	int inode_addr = 0;
 
-	/* get inode addr (in byte) from inode number */
-	inode_addr = get_inode_addr(inode_num);
-	
 	/* read inode information from inode table entry */
-	read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
+	read_inode(inode_num, &inode);
 
 	struct ext2_dir_entry_2 dir_entry;
+	memset(&dir_entry, 0, sizeof(dir_entry));
 	/* inode number */
 	dir_entry.inode = inode_num;
 	/* name is inode_number */
-	sprintf(dir_entry.name, "%d%c", inode_num, '\0');
-	dir_entry.name_len = strlen(dir_entry.name) - 1;
+	sprintf(dir_entry.name, "%d", inode_num);
+	dir_entry.name_len = strlen(dir_entry.name);
 	
 	/* type and rec_length */
 	dir_entry.file_type = imode_to_filetype(inode.i_mode);
 
 	int lf_inodenum = get_inode_by_filepath("/lost+found");
-	unsigned int base = get_dir_entry_end(lf_inodenum, 8 + dir_entry.name_len);
-	
-	dir_entry.rec_len = (base - pt_info.base - 1)/ sb.block_size * sb.block_size 
-	                     + sb.block_size - (base - pt_info.base);
-	
+	if (lf_inodenum > 0)
+		drop_dir_index(lf_inodenum);
+	long base = get_dir_entry_end(lf_inodenum, 8 + dir_entry.name_len);
 	if (base < 0)
 		return -1;
+	
+	/* the new entry spans the rest of the block */
+	dir_entry.rec_len = sb.block_size - (base - pt_info.base) % sb.block_size;
 
-	int entry_size = 8 + dir_entry.name_len;
+	int entry_size = EXT2_DIR_REC_LEN(dir_entry.name_len);
 	write_bytes(base, &dir_entry, entry_size);
 
 	return 0;
 }
 
 
+/** @brief turn an indexed directory into a plain one before entries
+ *   are appended to it. Appended entries would land outside the hash
+ *   ranges of the index, or split the ".." entry hiding its root.
+ *
+ *  @param inode_num inode number of the directory
+ *  @return void
+ */
+void drop_dir_index(int inode_num)
+{
+	struct ext2_inode inode;
+
+	read_inode(inode_num, &inode);
+	if (!EXT2_S_ISDIR(inode.i_mode) || !(inode.i_flags & EXT2_INDEX_FL))
+		return;
+	inode.i_flags &= ~EXT2_INDEX_FL;
+	write_inode(inode_num, &inode);
+}
+
+
 /** @brief fix inode number of self and parent record
  *
  *  @param inode_num inode number of current directory
@@ -527,15 +1041,15 @@ int put_into_lostfound(int inode_num)
  *  @return void.
  */
 void set_inode_num(unsigned int inode_num, unsigned int parent, 
-                   int offset, int fix_flag)
+                   long offset, int fix_flag)
 {
 	if (fix_flag == FIX_SELF)
 	{
-		write_bytes((long)offset, &inode_num, sizeof(unsigned int));
+		write_bytes(offset, &inode_num, sizeof(unsigned int));
 	}
 	else if (fix_flag == FIX_PARENT)
 	{
-		write_bytes((long)offset, &parent, sizeof(unsigned int));	
+		write_bytes(offset, &parent, sizeof(unsigned int));	
 	}
 }
 
@@ -548,21 +1062,21 @@ void set_inode_num(unsigned int inode_num, unsigned int parent,
 int get_parent_id(struct ext2_inode* inode)
 {
 	/* read first block of inode */
-	unsigned char buf[sb.block_size]; /* 1024 bytes */
-	int disk_offset = pt_info.base + inode->i_block[0] * sb.block_size;
+	unsigned char* buf = acquire_block_buf();
+	long disk_offset = pt_info.base + (long)inode->i_block[0] * sb.block_size;
 	read_bytes(disk_offset, buf, sb.block_size);
 
-	struct ext2_dir_entry_2 dir_entry;
-	int dir_entry_base = 0;
-
-	/* skip first dir entry . */
-	dir_entry.rec_len = *(__u16*)(buf + dir_entry_base + 4);
-	dir_entry_base += dir_entry.rec_len;
+	dirent_iter_t it;
+	dirent_view_t dir_entry;
+	int parent = 0;
 
-	/* go to second entry whic is .. */
-	dir_entry.inode = *(__u32*)(buf + dir_entry_base + 0);
+	/* skip first dir entry . and go to second entry which is .. */
+	dirent_iter_init(&it, buf, sb.block_size);
+	if (dirent_next(&it, &dir_entry) && dirent_next(&it, &dir_entry))
+		parent = dir_entry.inode;
 
-	return dir_entry.inode;
+	release_block_buf(buf);
+	return parent;
 }
 
 
@@ -583,84 +1097,23 @@ int get_inode_by_filepath(const char* filepath)
 	
 	int inode_num = EXT2_ROOT_INO; /* root inode = 2 */
 	struct ext2_inode inode;
-	int inode_addr = 0;
 	
 	char* filename = strtok(path, "/");
 	int ret = -1;
 	while(filename != NULL)
 	{
-		/* get inode addr (in byte) from inode number */
-		inode_addr = get_inode_addr(inode_num);
-
 		/* read inode information from inode table entry */
-		read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
+		read_inode(inode_num, &inode);
 
 		/* if it's not a directory, error */
 		if(!EXT2_S_ISDIR(inode.i_mode))
 			return -1;
 		
-		int found = 0;
-		unsigned char buf[sb.block_size]; /* 1024 bytes */
-		/* search in direct blocks */
-		int i = 0;
-		for(i = 0; i < EXT2_NDIR_BLOCKS; i++)
-		{
-			if (inode.i_block[i] <= 0)
-				continue;
-			
-			read_bytes(pt_info.base + inode.i_block[i] * sb.block_size, 
-			            buf, sb.block_size);
-
-			/* direct blocks */
-			ret = search_filename_in_dir_block(buf, filename);
-			if (ret > 0)
-			{
-				found = 1;
-				break;
-			}
-		}
-		/* if not found, search in singly indirect block */
-		if(!found && inode.i_block[i] > 0)
-		{
-			read_bytes(pt_info.base + inode.i_block[i] * sb.block_size, 
-			            buf, sb.block_size);
-			ret = search_filename_in_singly((unsigned int*)buf, filename);
-			if (ret > 0)
-			{
-				found = 1;
-				break;
-			}
-		}
-		i++;
-		/* if still not found, search in doubly indirect block */
-		if(!found && inode.i_block[i] > 0)
-		{
-			read_bytes(pt_info.base + inode.i_block[i] * sb.block_size, 
-			            buf, sb.block_size);
-			ret = search_filename_in_doubly((unsigned int*)buf, filename);
-			if (ret > 0)
-			{
-				found = 1;
-				break;
-			}
-		}
-		i++;
-		/* if still not found, search in triply indirect block */
-		if(!found && inode.i_block[i] > 0)
-		{
-			read_bytes(pt_info.base + inode.i_block[i] * sb.block_size, 
-			            buf, sb.block_size);
-			ret = search_filename_in_triply((unsigned int*)buf, filename);
-			if (ret > 0)
-			{
-				found = 1;
-				break;
-			}
-		}
-		/* At last, filename is not found in this directory */
-		if(!found)
+		/* search in all blocks of the directory */
+		ret = search_filename_in_dir(&inode, filename);
+		if(ret <= 0)
 		{
-			printf("file %s not found\n", filename);
+			problem_report(PR_LOOKUP, "file %s not found", filename);
 			return -1;
 		}
 		inode_num = ret;
@@ -0,0 +1,498 @@
+/** @file htree.c
+ *  @brief This module looks up names in hash-indexed directories
+ *
+ *   A directory with EXT2_INDEX_FL keeps a hash tree in its blocks:
+ *   block 0 holds the root of the index behind a fake "." and ".."
+ *   entry, the index entries map hash ranges to leaf blocks, and the
+ *   leaves are ordinary directory blocks. A lookup hashes the name,
+ *   walks down the index and reads a single leaf instead of every
+ *   block of the directory.
+ *
+ *   The index is not trusted: anything that does not look like a
+ *   valid root or node makes the lookup give up, and the caller falls
+ *   back to scanning the directory linearly.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "utility.h"
+#include "readwrite.h"
+#include "fsck.h"
+#include "bufpool.h"
+#include "blockiter.h"
+#include "latency.h"
+#include "htree.h"
+
+/*** global variables ***/
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+
+
+/** @brief position in one block of the index */
+typedef struct dx_frame
+{
+	unsigned char* buf;
+	struct dx_entry* entries;
+	int count;
+	int at;
+} dx_frame_t;
+
+
+/** @brief legacy hash of the first ext2 index
+ *
+ *  @param name name to hash
+ *  @param len length of the name
+ *  @param is_unsigned chars are hashed as unsigned
+ *  @return hash
+ */
+static __u32 dx_hack_hash(const char* name, int len, int is_unsigned)
+{
+	__u32 hash = 0, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	int c = 0;
+
+	while (len--)
+	{
+		c = is_unsigned ? (int)*(unsigned char*)name
+		                : (int)*(signed char*)name;
+		name++;
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+
+/** @brief pack a piece of a name into words padded with its length
+ *
+ *  @param msg name
+ *  @param len bytes left in the name
+ *  @param buf words to fill
+ *  @param num number of words
+ *  @param is_unsigned chars are hashed as unsigned
+ *  @return void
+ */
+static void str2hashbuf(const char* msg, int len, __u32* buf, int num,
+                        int is_unsigned)
+{
+	__u32 pad, val;
+	int i = 0, c = 0;
+
+	pad = (__u32)len | ((__u32)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++)
+	{
+		c = is_unsigned ? (int)((unsigned char*)msg)[i]
+		                : (int)((signed char*)msg)[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3)
+		{
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + (x), a = ROL32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+/** @brief reduced MD4 round used by the half_md4 hash
+ *
+ *  @param buf hash state
+ *  @param in 8 words of input
+ *  @return void
+ */
+static void half_md4_transform(__u32 buf[4], const __u32 in[8])
+{
+	__u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	/* round 1 */
+	ROUND(F, a, b, c, d, in[0] + K1,  3);
+	ROUND(F, d, a, b, c, in[1] + K1,  7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1,  3);
+	ROUND(F, d, a, b, c, in[5] + K1,  7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+	/* round 2 */
+	ROUND(G, a, b, c, d, in[1] + K2,  3);
+	ROUND(G, d, a, b, c, in[3] + K2,  5);
+	ROUND(G, c, d, a, b, in[5] + K2,  9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2,  3);
+	ROUND(G, d, a, b, c, in[2] + K2,  5);
+	ROUND(G, c, d, a, b, in[4] + K2,  9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	/* round 3 */
+	ROUND(H, a, b, c, d, in[3] + K3,  3);
+	ROUND(H, d, a, b, c, in[7] + K3,  9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3,  3);
+	ROUND(H, d, a, b, c, in[5] + K3,  9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+
+/** @brief TEA round used by the tea hash
+ *
+ *  @param buf hash state
+ *  @param in 4 words of input
+ *  @return void
+ */
+static void tea_transform(__u32 buf[4], const __u32 in[4])
+{
+	__u32 sum = 0;
+	__u32 b0 = buf[0], b1 = buf[1];
+	__u32 a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do
+	{
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+
+/** @brief hash a name the way the index of a directory does
+ *
+ *  @param name name to hash
+ *  @param len length of the name
+ *  @param version DX_HASH_* version
+ *  @return hash with the lowest bit clear
+ */
+__u32 dx_hash(const char* name, int len, int version)
+{
+	__u32 buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	__u32 in[8];
+	__u32 hash = 0;
+	int is_unsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+	int i = 0;
+
+	/* an all-zero seed means the default one */
+	for (i = 0; i < 4; i++)
+	{
+		if (sb.hash_seed[i] != 0)
+		{
+			memcpy(buf, sb.hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (version)
+	{
+		case DX_HASH_LEGACY:
+		case DX_HASH_LEGACY_UNSIGNED:
+			hash = dx_hack_hash(name, len, is_unsigned);
+			break;
+		case DX_HASH_HALF_MD4:
+		case DX_HASH_HALF_MD4_UNSIGNED:
+			for (; len > 0; len -= 32, name += 32)
+			{
+				str2hashbuf(name, len, in, 8, is_unsigned);
+				half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+		case DX_HASH_TEA_UNSIGNED:
+			for (; len > 0; len -= 16, name += 16)
+			{
+				str2hashbuf(name, len, in, 4, is_unsigned);
+				tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1U;
+	/* the largest hash marks the end of the index */
+	if (hash == 0xfffffffe)
+		hash = 0xfffffffc;
+	return hash;
+}
+
+
+/** @brief read a logical block of a directory
+ *
+ *  @param dir inode struct of the directory
+ *  @param logical logical block number
+ *  @param buf buffer of one block
+ *  @return 0 success or -1 if the block is absent
+ */
+static int read_dir_block(struct ext2_inode* dir, long logical,
+                          unsigned char* buf)
+{
+	unsigned int block = map_logical_block(dir, logical);
+
+	if (block == 0)
+		return -1;
+	int outer = latency_set_class(LAT_DIR);
+	read_bytes(pt_info.base + (long)block * sb.block_size,
+	           buf, sb.block_size);
+	latency_set_class(outer);
+	return 0;
+}
+
+
+/** @brief check the count and limit of the entries of an index block
+ *
+ *  @param frame frame of the block, entries set
+ *  @param limit number of entries that fit in the block
+ *  @return 0 valid or -1 not
+ */
+static int check_entries(dx_frame_t* frame, int limit)
+{
+	struct dx_countlimit* cl = (struct dx_countlimit*)frame->entries;
+
+	if (cl->limit != limit || cl->count == 0 || cl->count > limit)
+		return -1;
+	frame->count = cl->count;
+	return 0;
+}
+
+
+/** @brief find the entry whose hash range holds a hash
+ *
+ *  @param frame frame of an index block
+ *  @param hash hash of the name
+ *  @return void
+ */
+static void search_entries(dx_frame_t* frame, __u32 hash)
+{
+	int lo = 1, hi = frame->count - 1;
+
+	/* entry 0 has no hash and covers everything below entry 1 */
+	while (lo <= hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (frame->entries[mid].hash > hash)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	frame->at = lo - 1;
+}
+
+
+/** @brief read an interior node of the index into a frame
+ *
+ *  @param dir inode struct of the directory
+ *  @param frame frame to fill, buf set
+ *  @param logical logical block of the node
+ *  @return 0 success or -1 if it is not a valid node
+ */
+static int read_node(struct ext2_inode* dir, dx_frame_t* frame, long logical)
+{
+	struct ext2_dir_entry_2* fake = (struct ext2_dir_entry_2*)frame->buf;
+
+	if (logical == 0 || read_dir_block(dir, logical, frame->buf) == -1)
+		return -1;
+	/* a node hides behind one empty entry spanning the block */
+	if (fake->inode != 0 || fake->rec_len != sb.block_size
+	    || fake->name_len != 0)
+		return -1;
+	frame->entries = (struct dx_entry*)(frame->buf + 8);
+	return check_entries(frame, (sb.block_size - 8) / sizeof(struct dx_entry));
+}
+
+
+/** @brief read the root of the index into a frame
+ *
+ *  @param dir inode struct of the directory
+ *  @param frame frame to fill, buf set
+ *  @param version returns the DX_HASH_* version
+ *  @param levels returns the number of node levels below the root
+ *  @return 0 success or -1 if it is not a valid root
+ */
+static int read_root(struct ext2_inode* dir, dx_frame_t* frame,
+                     int* version, int* levels)
+{
+	struct ext2_dir_entry_2* dot = (struct ext2_dir_entry_2*)frame->buf;
+	struct ext2_dir_entry_2* dotdot = NULL;
+	struct dx_root_info* info = NULL;
+
+	if (read_dir_block(dir, 0, frame->buf) == -1)
+		return -1;
+
+	if (dot->rec_len != 12 || dot->name_len != 1 || dot->name[0] != '.')
+		return -1;
+	dotdot = (struct ext2_dir_entry_2*)(frame->buf + 12);
+	if (dotdot->rec_len != sb.block_size - 12 || dotdot->name_len != 2
+	    || dotdot->name[0] != '.' || dotdot->name[1] != '.')
+		return -1;
+
+	info = (struct dx_root_info*)(frame->buf + 24);
+	if (info->reserved_zero != 0 || info->info_length != 8
+	    || info->hash_version > DX_HASH_TEA
+	    || info->indirect_levels > DX_MAX_LEVELS - 1)
+		return -1;
+	*version = info->hash_version;
+	if (sb.unsigned_hash)
+		*version += DX_HASH_LEGACY_UNSIGNED;
+	*levels = info->indirect_levels;
+
+	frame->entries = (struct dx_entry*)(frame->buf + 24 + info->info_length);
+	return check_entries(frame, (sb.block_size - 32) / sizeof(struct dx_entry));
+}
+
+
+/** @brief move to the leaf after the current one if it continues the
+ *   hash of the name, which happens when names colliding on a hash
+ *   were split over two leaves
+ *
+ *  @param dir inode struct of the directory
+ *  @param frames frames from the root down to the last node level
+ *  @param levels number of node levels below the root
+ *  @param hash hash of the name
+ *  @return 1 moved or 0 no further leaf holds the hash
+ */
+static int next_leaf(struct ext2_inode* dir, dx_frame_t* frames, int levels,
+                     __u32 hash)
+{
+	int l = levels;
+	__u32 next_hash = 0;
+
+	/* climb to the first level with an entry to the right */
+	while (l >= 0 && frames[l].at + 1 >= frames[l].count)
+		l--;
+	if (l < 0)
+		return 0;
+	frames[l].at++;
+
+	/* the low bit marks a range continuing the one before */
+	next_hash = frames[l].entries[frames[l].at].hash;
+	if (!(next_hash & 1) || (next_hash & ~1U) != hash)
+		return 0;
+
+	/* and back down along the leftmost entries */
+	for (; l < levels; l++)
+	{
+		long logical = frames[l].entries[frames[l].at].block & DX_BLOCK_MASK;
+		if (read_node(dir, &frames[l + 1], logical) == -1)
+			return 0;
+		frames[l + 1].at = 0;
+	}
+	return 1;
+}
+
+
+/** @brief walk down the index to the leaves covering a name and
+ *   search them
+ *
+ *  @param dir inode struct of the directory
+ *  @param frames one frame per level, buffers set
+ *  @param leaf buffer of one block
+ *  @param filename name to look up
+ *  @return inode_num success or -1 if not found or the index is unusable
+ */
+static int search_index(struct ext2_inode* dir, dx_frame_t* frames,
+                        unsigned char* leaf, char* filename)
+{
+	int version = 0, levels = 0;
+	int inode_num = -1;
+	int l = 0;
+	__u32 hash = 0;
+
+	if (read_root(dir, &frames[0], &version, &levels) == -1)
+		return -1;
+	hash = dx_hash(filename, strlen(filename), version);
+
+	/* walk down to the leaf covering the hash */
+	search_entries(&frames[0], hash);
+	for (l = 0; l < levels; l++)
+	{
+		long logical = frames[l].entries[frames[l].at].block & DX_BLOCK_MASK;
+		if (read_node(dir, &frames[l + 1], logical) == -1)
+			return -1;
+		search_entries(&frames[l + 1], hash);
+	}
+
+	do
+	{
+		long logical = frames[levels].entries[frames[levels].at].block
+		               & DX_BLOCK_MASK;
+		if (logical == 0 || read_dir_block(dir, logical, leaf) == -1)
+			return -1;
+		inode_num = search_filename_in_dir_block(leaf, filename);
+	} while (inode_num <= 0 && next_leaf(dir, frames, levels, hash));
+
+	return inode_num > 0 ? inode_num : -1;
+}
+
+
+/** @brief look up a name through the index of a directory
+ *
+ *  @param dir inode struct of the directory
+ *  @param filename name to look up
+ *  @return inode_num success or -1 if not found or the index is unusable
+ */
+int htree_lookup(struct ext2_inode* dir, char* filename)
+{
+	dx_frame_t frames[DX_MAX_LEVELS];
+	unsigned char* leaf = NULL;
+	int len = strlen(filename);
+	int inode_num = -1;
+	int l = 0;
+
+	if (!(dir->i_flags & EXT2_INDEX_FL) || len == 0 || len > EXT2_NAME_LEN)
+		return -1;
+
+	memset(frames, 0, sizeof(frames));
+	for (l = 0; l < DX_MAX_LEVELS; l++)
+		frames[l].buf = acquire_block_buf();
+	leaf = acquire_block_buf();
+
+	inode_num = search_index(dir, frames, leaf, filename);
+
+	release_block_buf(leaf);
+	for (l = 0; l < DX_MAX_LEVELS; l++)
+		release_block_buf(frames[l].buf);
+	return inode_num;
+}
+
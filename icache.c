@@ -0,0 +1,251 @@
+/** @file icache.c
+ *  @brief This module caches the inode table blocks of the partition
+ *   being checked
+ *
+ *   Every pass reads inodes one by one, often the same directory
+ *   inode several times, and inodes close in number share a block of
+ *   the inode table. read_inode loads the whole block on a miss and
+ *   serves the inodes in it from memory afterwards. At most
+ *   ICACHE_BYTES of blocks are kept, older ones are dropped by a clock
+ *   sweep.
+ *
+ *   Writes go to the disk at once. write_bytes reports every write, so
+ *   cached blocks stay equal to the disk whoever writes them.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "utility.h"
+#include "readwrite.h"
+#include "fsck.h"
+#include "icache.h"
+#include "stats.h"
+
+/*** global variables ***/
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+
+/** cached blocks, NULL when the cache is off */
+static icache_slot_t* slots = NULL;
+/** contents of the cached blocks */
+static unsigned char* data = NULL;
+/** first slot of every hash chain */
+static int* buckets = NULL;
+static int num_slots = 0;
+static int num_buckets = 0;
+/** next slot the clock sweep looks at */
+static int hand = 0;
+/** size of a cached block */
+static int cache_block_size = 0;
+
+
+/** @brief allocate the cache for a partition
+ *
+ *  @param block_size block size of the partition
+ *  @return 0 success or -1 fail, inodes are then read directly
+ */
+int icache_init(int block_size)
+{
+	int i = 0;
+
+	icache_destroy();
+	cache_block_size = block_size;
+	num_slots = ICACHE_BYTES / block_size;
+	for (num_buckets = 1; num_buckets < 2 * num_slots; num_buckets <<= 1)
+		;
+
+	slots = (icache_slot_t*)malloc(num_slots * sizeof(icache_slot_t));
+	data = (unsigned char*)malloc((long)num_slots * block_size);
+	buckets = (int*)malloc(num_buckets * sizeof(int));
+	if (slots == NULL || data == NULL || buckets == NULL)
+	{
+		icache_destroy();
+		return -1;
+	}
+
+	for (i = 0; i < num_slots; i++)
+	{
+		slots[i].offset = -1;
+		slots[i].next = -1;
+		slots[i].referenced = 0;
+	}
+	for (i = 0; i < num_buckets; i++)
+		buckets[i] = -1;
+	hand = 0;
+	return 0;
+}
+
+
+/** @brief free the cache
+ *
+ *  @return void
+ */
+void icache_destroy()
+{
+	free(slots);
+	free(data);
+	free(buckets);
+	slots = NULL;
+	data = NULL;
+	buckets = NULL;
+	num_slots = num_buckets = 0;
+}
+
+
+/** @brief hash chain of a block
+ *
+ *  @param offset disk offset of the block
+ *  @return bucket index
+ */
+static int bucket_of(long offset)
+{
+	return (int)((offset / cache_block_size) & (num_buckets - 1));
+}
+
+
+/** @brief find a cached block
+ *
+ *  @param offset disk offset of the block
+ *  @return slot index or -1 if not cached
+ */
+static int lookup(long offset)
+{
+	int s = buckets[bucket_of(offset)];
+
+	while (s != -1 && slots[s].offset != offset)
+		s = slots[s].next;
+	return s;
+}
+
+
+/** @brief unlink a slot from its hash chain
+ *
+ *  @param s slot index
+ *  @return void
+ */
+static void unlink_slot(int s)
+{
+	int* link = &buckets[bucket_of(slots[s].offset)];
+
+	while (*link != s)
+		link = &slots[*link].next;
+	*link = slots[s].next;
+	slots[s].offset = -1;
+}
+
+
+/** @brief read a block into the cache, dropping one not used since
+ *   the clock hand last passed it
+ *
+ *  @param offset disk offset of the block
+ *  @return slot index
+ */
+static int load(long offset)
+{
+	while (slots[hand].offset != -1 && slots[hand].referenced)
+	{
+		slots[hand].referenced = 0;
+		hand = (hand + 1) % num_slots;
+	}
+	int s = hand;
+	hand = (hand + 1) % num_slots;
+
+	if (slots[s].offset != -1)
+		unlink_slot(s);
+	read_bytes(offset, data + (long)s * cache_block_size, cache_block_size);
+
+	int b = bucket_of(offset);
+	slots[s].offset = offset;
+	slots[s].next = buckets[b];
+	buckets[b] = s;
+	return s;
+}
+
+
+/** @brief keep the cached blocks equal to the disk after a write
+ *
+ *  @param offset disk offset written
+ *  @param buf bytes written
+ *  @param length number of bytes
+ *  @return void
+ */
+void icache_note_write(long offset, const void* buf, long length)
+{
+	long rel = offset - pt_info.base;
+	long first = 0, last = 0, blk = 0;
+
+	if (slots == NULL || rel < 0 || length <= 0)
+		return;
+
+	first = rel / cache_block_size;
+	last = (rel + length - 1) / cache_block_size;
+	for (blk = first; blk <= last; blk++)
+	{
+		long block_off = pt_info.base + blk * cache_block_size;
+		int s = lookup(block_off);
+		if (s == -1)
+			continue;
+
+		/* copy the part of the write falling in this block */
+		long from = offset > block_off ? offset : block_off;
+		long to = offset + length < block_off + cache_block_size ?
+		          offset + length : block_off + cache_block_size;
+		memcpy(data + (long)s * cache_block_size + (from - block_off),
+		       (const unsigned char*)buf + (from - offset), to - from);
+	}
+}
+
+
+/** @brief read an inode
+ *
+ *  @param inode_num inode number
+ *  @param inode returns the inode struct
+ *  @return void
+ */
+void read_inode(int inode_num, struct ext2_inode* inode)
+{
+	long addr = get_inode_addr(inode_num);
+
+	if (slots == NULL)
+	{
+		read_bytes(addr, inode, sizeof(struct ext2_inode));
+		return;
+	}
+
+	/* inodes never cross a block of the inode table */
+	long rel = addr - pt_info.base;
+	long block_off = addr - rel % cache_block_size;
+	int s = lookup(block_off);
+	stats_count_icache(s != -1);
+	if (s == -1)
+		s = load(block_off);
+	slots[s].referenced = 1;
+
+	memcpy(inode, data + (long)s * cache_block_size + (addr - block_off),
+	       sizeof(struct ext2_inode));
+}
+
+
+/** @brief write an inode back to disk
+ *
+ *  @param inode_num inode number
+ *  @param inode inode struct
+ *  @return void
+ */
+void write_inode(int inode_num, struct ext2_inode* inode)
+{
+	write_bytes(get_inode_addr(inode_num), inode, sizeof(struct ext2_inode));
+}
+
@@ -0,0 +1,78 @@
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "problem.h"
+
+/* longest manifest line */
+#define BATCH_LINE_MAX 4096
+/* without a budget the checks may take this share of the memory */
+#define BATCH_BUDGET_SHARE 2
+
+/* states of a job */
+#define BATCH_PENDING   0
+#define BATCH_RUNNING   1
+#define BATCH_DONE      2  /* every partition checked */
+#define BATCH_FAILED    3  /* a partition could not be checked */
+#define BATCH_CRASHED   4  /* the worker died during the check */
+#define BATCH_SKIPPED   5  /* no partition to check could be read */
+
+
+/** @brief an image of the manifest */
+typedef struct batch_job
+{
+	char* image;
+	int partition;       /* partition asked for, 0 for every Linux one */
+	int* parts;          /* partitions to check */
+	int num_parts;
+	long mem;            /* estimated bytes of the largest partition */
+	int state;
+	int failed_parts;
+	double seconds;
+	long problems[PR_NUM];
+} batch_job_t;
+
+/** @brief partitions and estimate of a job sent by the planner,
+ *   followed by the partition numbers */
+typedef struct batch_plan
+{
+	int job;
+	int num_parts;
+	long mem;
+} batch_plan_t;
+
+/** @brief outcome of a job sent by a worker */
+typedef struct batch_result
+{
+	int job;
+	int failed_parts;
+	double seconds;
+	long problems[PR_NUM];
+} batch_result_t;
+
+/** @brief a worker process */
+typedef struct batch_worker
+{
+	pid_t pid;           /* -1 when not running */
+	int job_fd;          /* job numbers to the worker */
+	int result_fd;       /* results from the worker */
+	int job;             /* job being checked or -1 */
+} batch_worker_t;
+
+
+void batch_set_workers(int n);
+
+void batch_set_budget(long mb);
+
+void batch_set_logs(const char* dir);
+
+int batch_run(const char* manifest, int direct);
+
+
+#endif
+
@@ -12,11 +12,13 @@
 
 void mark_block(int inode_num);
 
-unsigned int mark_block_singly(unsigned int* singly_buf);
+int mark_blocks_begin_scan();
 
-unsigned int mark_block_doubly(unsigned int* doubly_buf);
+void mark_scanned_inode(int inode_num, struct ext2_inode* inode);
 
-unsigned int mark_block_triply(unsigned int* triply_buf);
+void reconcile_block_marks();
+
+void resolve_dup_blocks();
 
 
 #endif
@@ -0,0 +1,49 @@
+
+#ifndef _BLOCKITER_H_
+#define _BLOCKITER_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+/* kinds of blocks passed to a visitor, equal to the indirection depth */
+#define BLOCK_DATA 0
+#define BLOCK_IND  1
+#define BLOCK_DIND 2
+#define BLOCK_TIND 3
+
+/* iterator flags */
+#define ITER_READ_DATA 0x1  /* read data blocks and pass their contents */
+
+/* visitor return values */
+#define ITER_CONTINUE 0
+#define ITER_STOP     1
+
+
+/** @brief visitor called for every block of an inode
+ *
+ *  @param block physical block number
+ *  @param logical logical number of the first data block it maps
+ *  @param kind BLOCK_DATA or the indirection depth
+ *  @param buf block contents, NULL for data blocks without ITER_READ_DATA
+ *  @param priv caller context
+ *  @return ITER_CONTINUE or ITER_STOP
+ */
+typedef int (*block_visitor_t)(unsigned int block, long logical, int kind,
+                               unsigned char* buf, void* priv);
+
+
+int inode_has_blocks(struct ext2_inode* inode);
+
+int iterate_blocks(struct ext2_inode* inode, int flags,
+                   block_visitor_t visit, void* priv);
+
+unsigned int map_logical_block(struct ext2_inode* inode, long logical);
+
+
+#endif
+
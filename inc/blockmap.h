@@ -0,0 +1,82 @@
+
+#ifndef _BLOCKMAP_H_
+#define _BLOCKMAP_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+/* saved in place of the used prefix of a group with a segment */
+#define BLOCKMAP_SEGMENT 0xffffffffU
+/* initial number of slots of the duplicate block hash table */
+#define DUP_TABLE_INIT_SIZE 64
+/* initial number of owners recorded per duplicate block */
+#define DUP_OWNERS_INIT_SIZE 4
+
+
+/** @brief a group of the local block map. Without a segment the
+ *   first used_prefix blocks are used and the rest are free. */
+typedef struct block_map_group
+{
+	unsigned char* seg;        /* one bit per block of the group or NULL */
+	unsigned int used_prefix;
+} block_map_group_t;
+
+/** @brief a block claimed more than once */
+typedef struct dup_block
+{
+	unsigned int block;
+	int collisions;    /* claims seen after the first one */
+	int inode_claims;  /* claims made by inodes, counted when resolving */
+	int num_owners;
+	int max_owners;
+	int* owners;       /* distinct inodes claiming the block */
+} dup_block_t;
+
+
+// ************* local block map ************* //
+int block_map_init(unsigned int num_blocks, unsigned int first_block,
+                   unsigned int per_group);
+
+void block_map_free();
+
+unsigned int block_map_groups();
+
+void block_map_set(unsigned int block);
+
+void block_map_set_range(unsigned int start, unsigned int count);
+
+void block_map_clear(unsigned int block);
+
+int block_map_test(unsigned int block);
+
+int block_map_test_and_set(unsigned int block);
+
+int block_map_group_bits(unsigned int g, unsigned char* bits);
+
+void block_map_evict(unsigned int g);
+
+int block_map_save(FILE* fp);
+
+int block_map_load(FILE* fp);
+
+
+// ********** multiply-claimed blocks ********** //
+void dup_block_record(unsigned int block);
+
+void dup_block_add_owner(unsigned int block, int inode_num);
+
+int dup_block_release(unsigned int block);
+
+int dup_block_count();
+
+void report_dup_blocks();
+
+
+#endif
+
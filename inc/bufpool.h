@@ -0,0 +1,43 @@
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* alignment of pooled buffers, enough for O_DIRECT on any device */
+#define BUF_POOL_ALIGN 4096
+/* number of blocks held by a batch buffer */
+#define BUF_POOL_BATCH_BLOCKS 16
+/* initial capacity of the free list */
+#define BUF_POOL_INIT_SIZE 16
+
+
+/** @brief pool of block-sized scratch buffers */
+typedef struct buf_pool
+{
+	int buf_size;
+	int num_free;
+	int max_free;
+	int num_allocated;
+	void** free_list;
+} buf_pool_t;
+
+
+int buf_pool_init(int buf_size);
+
+void buf_pool_destroy();
+
+void* acquire_block_buf();
+
+void release_block_buf(void* buf);
+
+void* acquire_batch_buf();
+
+void release_batch_buf(void* buf);
+
+
+#endif
+
@@ -0,0 +1,63 @@
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* state file header */
+#define CKPT_MAGIC   0x54504b43  /* "CKPT" */
+#define CKPT_VERSION 5
+
+/* seconds between two checkpoints inside a phase */
+#define CKPT_DEFAULT_INTERVAL 60
+
+/* point of a check a state file resumes from */
+#define CKPT_NONE     0  /* nothing saved, check from the start */
+#define CKPT_LINKS    1  /* inode map done, link counts from a group */
+#define CKPT_BLOCKMAP 2  /* block map done, bitmaps from a group */
+#define CKPT_DONE     3  /* partition checked */
+
+
+/** @brief state file header, followed by the inode map and, from
+ *   CKPT_BLOCKMAP on, the block map */
+typedef struct ckpt_header
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t partition_num;
+	int32_t whole_disk;      /* saved by a check of every partition */
+	int32_t point;           /* CKPT_* */
+	int32_t group;           /* first group not done at that point */
+	uint64_t disk_size;      /* bytes of the image or device */
+	uint32_t start_sec;      /* first sector of the partition */
+	uint8_t uuid[16];        /* filesystem UUID */
+	uint32_t wtime;          /* superblock write time */
+	uint32_t mnt_count;      /* superblock mount count */
+	uint32_t num_inodes;
+	uint32_t num_blocks;
+	uint32_t block_map_groups;
+} ckpt_header_t;
+
+
+void ckpt_set_file(const char* path);
+
+void ckpt_set_interval(int seconds);
+
+void ckpt_set_resume();
+
+void ckpt_set_whole_disk();
+
+int ckpt_begin_check(int partition_num, int* group);
+
+int ckpt_due();
+
+void ckpt_save(int point, int group);
+
+void ckpt_finish();
+
+
+#endif
+
@@ -10,19 +10,48 @@
 #include "ext2_fs.h"
 
 
-unsigned int get_dir_entry_end(int inode_num, int newentry_size);
+/* why dirent_next stopped before the end of a block */
+#define DIRENT_OK        0
+#define DIRENT_SHORT     1  /* header runs past the end of the block */
+#define DIRENT_BAD_LEN   2  /* rec_len too small or not a multiple of 4 */
+#define DIRENT_OVERFLOW  3  /* rec_len runs past the end of the block */
+#define DIRENT_BAD_NAME  4  /* name longer than the record */
 
-unsigned int find_dir_end_in_direct(unsigned int disk_offset,
-                           			unsigned char* block,
-                           			int newentry_size);
 
-unsigned int find_dir_end_singly(unsigned int* block, int newentry_size);
+/** @brief view of one entry inside a directory block, nothing is
+ *   copied and the name is not NUL terminated */
+typedef struct dirent_view
+{
+	unsigned char* ptr;   /* entry inside the block */
+	int offset;           /* offset of the entry in the block */
+	__u32 inode;
+	__u16 rec_len;
+	__u8 name_len;
+	__u8 file_type;
+	const char* name;
+} dirent_view_t;
 
-unsigned int find_dir_end_doubly(unsigned int* block, int newentry_size);
+/** @brief position of a parse of one directory block */
+typedef struct dirent_iter
+{
+	unsigned char* buf;
+	int size;
+	int offset;
+	int error;            /* DIRENT_* once a bad entry stopped the parse */
+} dirent_iter_t;
 
-unsigned int find_dir_end_triply(unsigned int* block, int newentry_size);
 
+void dirent_iter_init(dirent_iter_t* it, unsigned char* buf, int size);
 
-#endif
+int dirent_next(dirent_iter_t* it, dirent_view_t* ent);
+
+int dirent_name_is(const dirent_view_t* ent, const char* name, int len);
+
+long get_dir_entry_end(int inode_num, int newentry_size);
 
+long find_dir_end_in_direct(long disk_offset, unsigned char* block,
+                            int newentry_size);
+
+
+#endif
 
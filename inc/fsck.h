@@ -17,6 +17,8 @@
 #define BOOTSTRAP_SIZE 0x1be
 #define FIX_SELF 0
 #define FIX_PARENT 1
+/* inode table blocks of a group read to verify its free inode slots */
+#define INODE_SAMPLE_BLOCKS 4
 
 
 /** @brief partition information */
@@ -24,9 +26,9 @@ typedef struct partition_info
 {
 	int partition_num;
 	int type;
-	int start_sec;
-	int base;
-	int length;
+	unsigned int start_sec;
+	long base;           /* byte offset of the partition on disk */
+	unsigned int length;
 } partition_t;
 
 /** @brief super block information */
@@ -34,14 +36,30 @@ typedef struct superblock_info
 {
 	int block_size;
 	int inode_size;
+	int first_data_block; /* block holding the superblock */
 
 	int	num_blocks;
 	int blocks_per_group;
 
 	int num_inodes;
 	int inodes_per_group;
+	int first_ino;        /* first inode not reserved by the filesystem */
 
 	int num_groups;	
+
+	unsigned int wtime;   /* last write time, tells if the image changed */
+	unsigned int mnt_count;
+	unsigned char uuid[16];
+
+	unsigned int hash_seed[4]; /* seed of the directory index hash */
+	int unsigned_hash;         /* names hashed as unsigned chars */
+
+	/* metadata footprint of the groups */
+	int gdt_blocks;          /* blocks of the group descriptor table */
+	int resize_inode;        /* inode 7 holds the reserved blocks */
+	int reserved_gdt_blocks; /* blocks kept after it for resizing */
+	int itable_blocks;       /* blocks of the inode table of a group */
+	int sparse_super;        /* superblock copies only in some groups */
 } superblock_t;
 
 
@@ -54,15 +72,31 @@ int read_superblock_info(int partition_num);
 
 int read_bg_desc_table();
 
+int build_backup_table();
+
+int group_has_super(int group);
+
+void fsck_set_paranoid();
+
+int inode_scan_wanted(int inode_num);
+
+void build_inode_scan();
+
+long fsck_estimate_memory(int partition_num);
+
 
 // *************** fixing *************** //
 int fix_fs(int partition_num);
 
 void fix_unreferenced_inode();
 
-void fix_link_counts();
+void fix_link_counts(int first_group);
 
-void fix_block_map();
+int begin_block_map();
+
+void build_block_map();
+
+void fix_block_map(int first_group);
 
 
 // *************** Utilities *************** //
@@ -72,8 +106,10 @@ int get_parent_id(struct ext2_inode* inode);
 
 int put_into_lostfound(int inode_num);
 
+void drop_dir_index(int inode_num);
+
 void set_inode_num(unsigned int inode_num, unsigned int parent, 
-                   int addr, int fix_flag);
+                   long addr, int fix_flag);
 
 
 
@@ -0,0 +1,60 @@
+
+#ifndef _HTREE_H_
+#define _HTREE_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+/* hash versions of a directory index, the unsigned variants are used
+ * when the superblock says names are hashed as unsigned chars */
+#define DX_HASH_LEGACY            0
+#define DX_HASH_HALF_MD4          1
+#define DX_HASH_TEA               2
+#define DX_HASH_LEGACY_UNSIGNED   3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED      5
+
+/* deepest index below the root */
+#define DX_MAX_LEVELS 2
+
+/* the block of an index entry keeps the top byte for future use */
+#define DX_BLOCK_MASK 0x00ffffff
+
+
+/** @brief index header after the "." and ".." entries of the root */
+struct dx_root_info
+{
+	__u32 reserved_zero;
+	__u8 hash_version;
+	__u8 info_length;       /* 8 */
+	__u8 indirect_levels;
+	__u8 unused_flags;
+};
+
+/** @brief index entry, the first one of a block holds the count and
+ *   limit in place of its hash */
+struct dx_entry
+{
+	__u32 hash;
+	__u32 block;            /* logical block of the directory */
+};
+
+struct dx_countlimit
+{
+	__u16 limit;
+	__u16 count;
+};
+
+
+__u32 dx_hash(const char* name, int len, int version);
+
+int htree_lookup(struct ext2_inode* dir, char* filename);
+
+
+#endif
+
@@ -0,0 +1,38 @@
+
+#ifndef _ICACHE_H_
+#define _ICACHE_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+/* memory held by cached inode table blocks */
+#define ICACHE_BYTES (4 << 20)
+
+
+/** @brief cached inode table block */
+typedef struct icache_slot
+{
+	long offset;     /* disk offset of the block, -1 if empty */
+	int next;        /* next slot of the hash chain, -1 at the end */
+	int referenced;  /* used since the clock hand last passed */
+} icache_slot_t;
+
+
+int icache_init(int block_size);
+
+void icache_destroy();
+
+void icache_note_write(long offset, const void* buf, long length);
+
+void read_inode(int inode_num, struct ext2_inode* inode);
+
+void write_inode(int inode_num, struct ext2_inode* inode);
+
+
+#endif
+
@@ -0,0 +1,140 @@
+
+#ifndef _INCREMENTAL_H_
+#define _INCREMENTAL_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+/* fingerprint database header */
+#define INCR_MAGIC   0x52434e49  /* "INCR" */
+#define INCR_VERSION 3
+
+/* directory entries are stored as inode numbers, the top bit marks
+ * a subdirectory the traversal descends into */
+#define INCR_SUBDIR     0x80000000U
+#define INCR_INODE_MASK 0x7fffffffU
+
+/* saved link counts are 16 bits like the on-disk ones */
+#define INCR_MAX_LINKS 0xffff
+
+
+/** @brief database header, followed by the group fingerprints, the
+ *   link counts the check left, the directories sorted by inode, their
+ *   entries and their blocks, the foreign extents and the indirect
+ *   extents, both sorted by group and start */
+typedef struct incr_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint32_t num_inodes;
+	uint32_t num_groups;
+	uint32_t num_dirs;
+	uint32_t num_entries;
+	uint32_t num_dir_blocks;
+	uint32_t num_extents;
+	uint32_t num_indirect;
+} incr_header_t;
+
+
+/** @brief a directory of the database */
+typedef struct incr_dir
+{
+	uint32_t inode;
+	uint32_t first_entry;
+	uint32_t num_entries;
+	uint32_t first_block;
+	uint32_t num_blocks;   /* data and indirect blocks */
+	uint32_t mtime;        /* inode times and size when it was read */
+	uint32_t ctime;
+	uint32_t size;
+} incr_dir_t;
+
+
+/** @brief a run of blocks the inodes of a group own in other groups,
+ *   or of indirect blocks they own anywhere */
+typedef struct incr_extent
+{
+	uint32_t group;        /* group of the owning inodes */
+	uint32_t start;
+	uint32_t count;
+} incr_extent_t;
+
+
+/** @brief a block of a saved directory, to find the directories a
+ *   write lands in */
+typedef struct incr_dir_block
+{
+	uint32_t block;
+	uint32_t dir;          /* index of the directory in the database */
+} incr_dir_block_t;
+
+
+/** @brief directories and indirect blocks a group fingerprint hashes */
+typedef struct incr_view
+{
+	incr_dir_t* dirs;           /* sorted by inode */
+	uint32_t num_dirs;
+	uint32_t* blocks;
+	incr_extent_t* indirect;    /* sorted by group and start */
+	uint32_t num_indirect;
+} incr_view_t;
+
+
+/** @brief entries and blocks of a directory being traversed */
+typedef struct incr_rec
+{
+	uint32_t* entries;
+	int num_entries;
+	int max_entries;
+	uint32_t* blocks;
+	int num_blocks;
+	int max_blocks;
+} incr_rec_t;
+
+
+void incr_set_db(const char* path);
+
+int incr_enabled();
+
+void incr_begin_check(int partition_num, int reuse);
+
+int incr_trusted_groups();
+
+int incr_group_trusted(int group);
+
+int incr_stored_links(unsigned int inode_num);
+
+void incr_distrust();
+
+void incr_begin_traversal();
+
+int incr_cached_dir(unsigned int inode_num, unsigned int parent,
+                    struct ext2_inode* inode, uint32_t** entries);
+
+void incr_keep_dir(unsigned int inode_num);
+
+void incr_rec_entry(incr_rec_t* rec, unsigned int inode_num, int subdir);
+
+void incr_rec_block(incr_rec_t* rec, unsigned int block);
+
+void incr_end_dir(unsigned int inode_num, struct ext2_inode* inode,
+                  incr_rec_t* rec);
+
+void incr_rec_extent(unsigned int inode_num, unsigned int block, int kind);
+
+int incr_mark_trusted_blocks();
+
+void incr_note_write(long offset, long length);
+
+void incr_end_check();
+
+
+#endif
+
@@ -0,0 +1,43 @@
+
+#ifndef _INODEMAP_H_
+#define _INODEMAP_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* a cell holding this keeps its count in the overflow table */
+#define INODE_MAP_SATURATED 255
+/* initial number of slots of the overflow table */
+#define INODE_MAP_OVERFLOW_INIT_SIZE 64
+
+
+/** @brief link count of an inode too large for its cell */
+typedef struct inode_map_overflow
+{
+	unsigned int inode;   /* 0 marks a free slot */
+	unsigned int count;
+} inode_map_overflow_t;
+
+
+int inode_map_init(int num_inodes);
+
+void inode_map_free();
+
+void inode_map_reset();
+
+int inode_map_inc(unsigned int inode_num);
+
+int inode_map_get(unsigned int inode_num);
+
+void inode_map_evict(long first, long end);
+
+int inode_map_save(FILE* fp);
+
+int inode_map_load(FILE* fp);
+
+
+#endif
+
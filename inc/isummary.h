@@ -0,0 +1,41 @@
+
+#ifndef _ISUMMARY_H_
+#define _ISUMMARY_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+
+/** @brief the fields of every inode the passes after the scan need,
+ *   one array per field indexed by inode number */
+typedef struct inode_summary
+{
+	int num_inodes;
+	__u16* mode;
+	__u16* links;
+	__u32* size;
+	__u32* blocks;
+	__u32 (*block)[EXT2_N_BLOCKS];  /* block pointers of i_block */
+} inode_summary_t;
+
+
+int isum_build(int mark);
+
+void isum_free();
+
+void isum_evict(long first, long end);
+
+inode_summary_t* isum_table();
+
+void isum_get_inode(int inode_num, struct ext2_inode* inode);
+
+void isum_set_links(int inode_num, __u16 links);
+
+
+#endif
+
@@ -0,0 +1,57 @@
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* operations */
+#define LAT_READ  0
+#define LAT_WRITE 1
+#define LAT_NUM_OPS 2
+
+/* access classes. LAT_AUTO lets the offset decide. */
+#define LAT_AUTO      -1
+#define LAT_INODE      0  /* inode table */
+#define LAT_DIR        1  /* directory block read through its inode */
+#define LAT_INDIRECT   2  /* indirect block */
+#define LAT_BITMAP     3  /* block or inode bitmap */
+#define LAT_DATA       4  /* any other block of the filesystem */
+#define LAT_OTHER      5  /* partition tables, superblock, descriptors */
+#define LAT_NUM_CLASSES 6
+
+/* buckets: values below 8 exactly, then 8 per power of two */
+#define LAT_SUB_BITS   3
+#define LAT_SUB_COUNT  (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS   40  /* about 18 minutes in ns */
+#define LAT_NUM_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 2) * LAT_SUB_COUNT)
+
+
+/** @brief log-bucketed histogram of latencies in ns */
+typedef struct lat_hist
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[LAT_NUM_BUCKETS];
+} lat_hist_t;
+
+
+void latency_enable();
+
+int latency_enabled();
+
+int latency_set_class(int cls);
+
+uint64_t latency_start();
+
+void latency_end(int op, long offset, uint64_t start);
+
+void latency_report(FILE* fp);
+
+
+#endif
+
@@ -0,0 +1,39 @@
+
+#ifndef _MAPSTORE_H_
+#define _MAPSTORE_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* maps of a check allocated at once */
+#define MSTORE_MAX_MAPS 16
+/* directory of the map files when TMPDIR is not set */
+#define MSTORE_DEFAULT_DIR "/tmp"
+
+
+/** @brief a map of the check, in memory or in a file */
+typedef struct mstore_map
+{
+	void* ptr;
+	long bytes;
+	int fd;             /* backing file or -1 in memory */
+} mstore_map_t;
+
+
+void mstore_set_limit(long mb);
+
+long mstore_limit();
+
+void* mstore_alloc(long bytes);
+
+void mstore_free(void* ptr);
+
+void mstore_zero(void* ptr);
+
+void mstore_evict(void* ptr, long from, long to);
+
+
+#endif
+
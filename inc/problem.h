@@ -0,0 +1,48 @@
+
+#ifndef _PROBLEM_H_
+#define _PROBLEM_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* problem categories */
+#define PR_DOT          0  /* wrong "." entry */
+#define PR_DOTDOT       1  /* wrong ".." entry */
+#define PR_UNREF        2  /* unreferenced inode moved to lost+found */
+#define PR_LOOKUP       3  /* path lookup failed */
+#define PR_LINK_COUNT   4  /* wrong link count */
+#define PR_BLOCK_BITMAP 5  /* wrong bit in a block bitmap */
+#define PR_DUP_BLOCK    6  /* block claimed more than once */
+#define PR_DIR_ENTRY    7  /* directory entry not fitting its block */
+#define PR_NUM          8
+
+/* problems of a category printed before the rest is only counted */
+#define PROBLEM_DEFAULT_LIMIT 20
+/* size of the output buffers */
+#define PROBLEM_BUF_SIZE (1 << 20)
+
+
+void problem_init();
+
+int problem_set_detail(const char* path);
+
+void problem_set_limit(int limit);
+
+void problem_begin_check(int partition_num);
+
+void problem_report(int category, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+void problem_end_check();
+
+void problem_totals(long* out);
+
+const char* problem_desc(int category);
+
+void problem_close();
+
+
+#endif
+
@@ -9,8 +9,22 @@
 
 #define SECTOR_SIZE 512
 
+/* O_DIRECT mode: requests are served from a private cache of aligned
+ * chunks, the device only sees whole aligned chunks */
+#define DIO_ALIGN   4096
+#define DIO_CHUNK   (64 * 1024)
+#define DIO_CACHE_CHUNKS 64
+
 extern int64_t lseek64(int, int64_t, int);
 
+int direct_io_enable();
+
+int disk_open(const char* path, int use_direct);
+
+int hole_map_build();
+
+int is_hole(long offset, long length);
+
 void read_bytes(long base, void* into, int buf_len);
 void write_bytes(long base, void* from, int buf_len);
 
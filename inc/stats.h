@@ -0,0 +1,94 @@
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* phases of a check, in the order fix_fs runs them */
+#define PHASE_INIT       0
+#define PHASE_TRAVERSE   1
+#define PHASE_UNREF      2
+#define PHASE_RETRAVERSE 3
+#define PHASE_LINKS      4
+#define PHASE_BLOCKMAP   5
+#define NUM_PHASES       6
+
+/* formats of the report printed at exit */
+#define STATS_NONE 0
+#define STATS_TEXT 1
+#define STATS_PROM 2
+#define STATS_JSON 3
+
+
+/** @brief I/O issued through readwrite.c */
+typedef struct io_counters
+{
+	long reads;          /* read_bytes calls */
+	long read_bytes;
+	long sector_reads;   /* read_sector calls */
+	long sector_bytes;
+	long writes;         /* write_bytes calls */
+	long write_bytes;
+	long blocks;         /* distinct filesystem blocks first touched */
+	long rereads;        /* block reads a whole-disk cache would serve */
+	long dio_hits;       /* O_DIRECT chunk cache lookups served */
+	long dio_misses;     /* chunks read into the O_DIRECT cache */
+	long icache_hits;    /* inodes read from a cached table block */
+	long icache_misses;  /* table blocks read into the inode cache */
+} io_counters_t;
+
+
+/** @brief time and I/O spent in one phase */
+typedef struct phase_stats
+{
+	double wall;
+	double cpu;
+	io_counters_t io;
+} phase_stats_t;
+
+
+/** @brief statistics of one checked partition */
+typedef struct check_stats
+{
+	int partition_num;
+	double wall;
+	double cpu;
+	io_counters_t total;
+	phase_stats_t phases[NUM_PHASES];
+} check_stats_t;
+
+
+void stats_set_record(const char* path, const char* image);
+
+int stats_set_report(const char* format, const char* path);
+
+void stats_reset();
+
+void stats_track_blocks(long base, int block_size, unsigned int num_blocks);
+
+void phase_begin(int phase);
+
+void phase_end(int phase);
+
+int stats_phase();
+
+void stats_count_read(long offset, long bytes);
+
+void stats_count_sector_read(long offset, long bytes);
+
+void stats_count_write(long offset, long bytes);
+
+void stats_count_dio(int hit);
+
+void stats_count_icache(int hit);
+
+int stats_end_check(int partition_num);
+
+int stats_report();
+
+
+#endif
+
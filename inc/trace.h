@@ -0,0 +1,65 @@
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* trace file header */
+#define TRACE_MAGIC   0x5254464d  /* "MFTR" */
+#define TRACE_VERSION 1
+
+/* record operations */
+#define TRACE_READ  0
+#define TRACE_WRITE 1
+#define TRACE_CHECK 2  /* start of a check: offset = partition base,
+                        * inode = partition number, length = block size */
+
+/* packing of the info field of a record */
+#define TRACE_LEN_BITS   24
+#define TRACE_LEN_MASK   ((1U << TRACE_LEN_BITS) - 1)
+#define TRACE_PHASE_SHIFT 24
+#define TRACE_PHASE_MASK 0x3f
+#define TRACE_OP_SHIFT   30
+
+
+/** @brief trace file header */
+typedef struct trace_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+} trace_header_t;
+
+
+/** @brief one access, 16 bytes. info holds the length in the low 24
+ *   bits, the phase in the next 6 and the operation in the top 2. */
+typedef struct trace_record
+{
+	uint64_t offset;
+	uint32_t inode;
+	uint32_t info;
+} trace_record_t;
+
+
+#define TRACE_LEN(r)   ((r)->info & TRACE_LEN_MASK)
+#define TRACE_PHASE(r) (((r)->info >> TRACE_PHASE_SHIFT) & TRACE_PHASE_MASK)
+#define TRACE_OP(r)    ((r)->info >> TRACE_OP_SHIFT)
+
+
+int trace_open(const char* path);
+
+void trace_close();
+
+unsigned int trace_set_inode(unsigned int inode_num);
+
+void trace_begin_check(int partition_num, long base, int block_size);
+
+void trace_access(int op, long offset, long length);
+
+
+#endif
+
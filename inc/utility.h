@@ -17,19 +17,15 @@
 #define EXT2_S_ISCHR(m) (((m)&(0xf000)) == (EXT2_S_IFCHR))
 #define EXT2_S_ISFIFO(m) (((m)&(0xf000)) == (EXT2_S_IFIFO))
 
-int get_inode_addr(int inode_num);
-int check_bitmap(int bitmap_base, int index);
+long get_inode_addr(int inode_num);
+int check_bitmap(long bitmap_base, int index);
 int imode_to_filetype(__u16 i_mode);
 int ispowerof(int s, int a);
 
 
 int search_filename_in_dir_block(unsigned char* block, char* filename);
 
-int search_filename_in_singly(unsigned int* block, char* filename);
-
-int search_filename_in_doubly(unsigned int* block, char* filename);
-
-int search_filename_in_triply(unsigned int* block, char* filename);
+int search_filename_in_dir(struct ext2_inode* inode, char* filename);
 
 #endif
 
@@ -0,0 +1,1156 @@
+/** @file incremental.c
+ *  @brief This module keeps a database of group fingerprints to check
+ *   a filesystem incrementally
+ *
+ *   After a check, every group gets a fingerprint hashing its
+ *   descriptor, both of its bitmaps, its inode table, the blocks of the
+ *   directories whose inodes it holds and the indirect blocks of its
+ *   inodes, that is every block a pass reads on its behalf. Saved
+ *   alongside are the results those passes leave: the link count of
+ *   each inode, the runs of blocks its inodes own in other groups, and
+ *   the entries of its directories.
+ *
+ *   The next check hashes every group again. A group with the same
+ *   fingerprint is trusted: its inodes are not scanned, a directory in
+ *   it is replayed from its saved entries, and its inodes are only read
+ *   when the traversal counts a different number of links than was
+ *   saved. Its bitmap is not compared, and its blocks in the groups that
+ *   are compared come from the saved runs. Should an inode of a compared
+ *   group claim a block of a trusted one it did not own before, or a
+ *   compared bitmap disagree, the blocks of every inode are marked
+ *   before anything is repaired. See build_block_map.
+ *
+ *   A directory whose blocks are written during the check is read
+ *   again rather than replayed, and its group hashed again at the end
+ *   like every group written to. One database file is kept per
+ *   partition.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "fsck.h"
+#include "readwrite.h"
+#include "bufpool.h"
+#include "mapstore.h"
+#include "blockiter.h"
+#include "blockmap.h"
+#include "inodemap.h"
+#include "incremental.h"
+
+/*** global variables ***/
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+/** block group discriptor table */
+extern struct ext2_group_desc* bg_desc_table;
+
+/* group flags */
+#define GROUP_UNCHANGED 0x1  /* fingerprint matches the database */
+#define GROUP_DIRTY     0x2  /* written to, hashed again at the end */
+
+/** database path prefix, NULL when disabled */
+static char* db_path = NULL;
+/** partition being checked */
+static int cur_partition = 0;
+/** flags of each group of the partition */
+static unsigned char* group_flags = NULL;
+/** fingerprints read at the start */
+static uint64_t* cur_fp = NULL;
+/** unchanged groups are trusted */
+static int trusting = 0;
+static int num_trusted = 0;
+
+/** database of the last check */
+static incr_header_t old_hdr;
+static uint64_t* old_fp = NULL;
+static uint16_t* old_links = NULL;
+static incr_dir_t* old_dirs = NULL;
+static uint32_t* old_entries = NULL;
+static uint32_t* old_blocks = NULL;
+static incr_extent_t* old_extents = NULL;
+static incr_extent_t* old_indirect = NULL;
+/** blocks of the saved directories sorted by block */
+static incr_dir_block_t* old_dir_blocks = NULL;
+/** saved directories whose blocks were written during the check */
+static unsigned char* old_dir_written = NULL;
+
+/** database built by the running check */
+static incr_dir_t* new_dirs = NULL;
+static int new_num_dirs = 0, new_max_dirs = 0;
+static uint32_t* new_entries = NULL;
+static int new_num_entries = 0, new_max_entries = 0;
+static uint32_t* new_blocks = NULL;
+static int new_num_blocks = 0, new_max_blocks = 0;
+static incr_extent_t* new_extents = NULL;
+static int new_num_extents = 0, new_max_extents = 0;
+static incr_extent_t* new_indirect = NULL;
+static int new_num_indirect = 0, new_max_indirect = 0;
+/** last extent and indirect extent of each group, -1 for none */
+static int* last_extent = NULL;
+static int* last_indirect = NULL;
+/** an inode of a compared group claimed a block of a trusted group it
+ *  did not own at the last check */
+static int stray_claim = 0;
+/** a traversal ran and every directory was recorded */
+static int traversed = 0;
+static int failed = 0;
+/** directories taken from the database */
+static int reused = 0;
+
+
+/** @brief keep a fingerprint database
+ *
+ *  @param path file prefix, the partition number is appended
+ *  @return void
+ */
+void incr_set_db(const char* path)
+{
+	free(db_path);
+	db_path = strdup(path);
+}
+
+
+/** @brief check if fingerprints are kept
+ *
+ *  @return 1 enabled or 0 not
+ */
+int incr_enabled()
+{
+	return db_path != NULL;
+}
+
+
+/** @brief mix bytes into a hash, 8 bytes at a time
+ *
+ *  @param h hash so far
+ *  @param p bytes
+ *  @param n number of bytes
+ *  @return new hash
+ */
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t n)
+{
+	const unsigned char* c = (const unsigned char*)p;
+	uint64_t v = 0;
+
+	while (n >= 8)
+	{
+		memcpy(&v, c, 8);
+		h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+		c += 8;
+		n -= 8;
+	}
+	while (n-- > 0)
+		h = (h ^ *c++) * 0x100000001b3ULL;
+	return h;
+}
+
+
+/** @brief compare block numbers for qsort */
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/** @brief compare directories by inode for qsort */
+static int cmp_dir(const void* a, const void* b)
+{
+	return cmp_u32(&((const incr_dir_t*)a)->inode,
+	               &((const incr_dir_t*)b)->inode);
+}
+
+
+/** @brief group of an inode
+ *
+ *  @param inode_num inode number
+ *  @return group number
+ */
+static int inode_group(unsigned int inode_num)
+{
+	return (inode_num - 1) / sb.inodes_per_group;
+}
+
+
+/** @brief mix the number and content of a block into a hash
+ *
+ *  @param h hash so far
+ *  @param block block number
+ *  @param buf block buffer
+ *  @return new hash
+ */
+static uint64_t hash_block(uint64_t h, uint32_t block, unsigned char* buf)
+{
+	h = hash_bytes(h, &block, sizeof(block));
+	if (block >= sb.num_blocks)
+		return h;
+	read_bytes(pt_info.base + (long)block * sb.block_size, buf, sb.block_size);
+	return hash_bytes(h, buf, sb.block_size);
+}
+
+
+/** @brief compare extents by group and start for qsort */
+static int cmp_extent(const void* a, const void* b)
+{
+	const incr_extent_t* x = (const incr_extent_t*)a;
+	const incr_extent_t* y = (const incr_extent_t*)b;
+
+	if (x->group != y->group)
+		return x->group < y->group ? -1 : 1;
+	return cmp_u32(&x->start, &y->start);
+}
+
+
+/** @brief find the first directory of a group in a view
+ *
+ *  @param view view sorted by inode
+ *  @param group group number
+ *  @return index of the directory or num_dirs
+ */
+static uint32_t first_dir(incr_view_t* view, int group)
+{
+	uint32_t lo = 0, hi = view->num_dirs;
+	uint32_t inode = (uint32_t)group * sb.inodes_per_group + 1;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (view->dirs[mid].inode < inode)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+/** @brief find the first extent of a group
+ *
+ *  @param exts extents sorted by group
+ *  @param num number of extents
+ *  @param group group number
+ *  @return index of the extent or num
+ */
+static uint32_t first_extent(incr_extent_t* exts, uint32_t num, int group)
+{
+	uint32_t lo = 0, hi = num;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (exts[mid].group < group)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+/** @brief hash the descriptor, bitmaps, inode table, directory blocks
+ *   and indirect blocks of a group
+ *
+ *  @param group group number
+ *  @param buf block buffer
+ *  @param view directories and indirect blocks to hash
+ *  @return fingerprint
+ */
+static uint64_t group_fingerprint(int group, unsigned char* buf,
+                                  incr_view_t* view)
+{
+	struct ext2_group_desc* gd = &bg_desc_table[group];
+	uint64_t h = 0xcbf29ce484222325ULL ^ group;
+	uint32_t d = 0, r = 0, j = 0;
+
+	h = hash_bytes(h, gd, sizeof(struct ext2_group_desc));
+	h = hash_block(h, gd->bg_block_bitmap, buf);
+	h = hash_block(h, gd->bg_inode_bitmap, buf);
+	for (j = 0; j < sb.itable_blocks; j++)
+		h = hash_block(h, gd->bg_inode_table + j, buf);
+
+	/* blocks of the directories whose inodes the group holds */
+	for (d = first_dir(view, group); d < view->num_dirs
+	     && inode_group(view->dirs[d].inode) == group; d++)
+	{
+		incr_dir_t* dir = &view->dirs[d];
+		for (j = 0; j < dir->num_blocks; j++)
+			h = hash_block(h, view->blocks[dir->first_block + j], buf);
+	}
+
+	/* indirect blocks of its inodes */
+	for (r = first_extent(view->indirect, view->num_indirect, group);
+	     r < view->num_indirect && view->indirect[r].group == group; r++)
+		for (j = 0; j < view->indirect[r].count; j++)
+			h = hash_block(h, view->indirect[r].start + j, buf);
+	return h;
+}
+
+
+/** @brief compare directory blocks by block for qsort */
+static int cmp_dir_block(const void* a, const void* b)
+{
+	return cmp_u32(&((const incr_dir_block_t*)a)->block,
+	               &((const incr_dir_block_t*)b)->block);
+}
+
+
+/** @brief release the databases of a check
+ *
+ *  @return void
+ */
+static void free_dbs()
+{
+	free(group_flags);
+	free(cur_fp);
+	free(old_fp);
+	mstore_free(old_links);
+	free(old_dirs);
+	free(old_entries);
+	free(old_blocks);
+	free(old_extents);
+	free(old_indirect);
+	free(old_dir_blocks);
+	free(old_dir_written);
+	free(new_dirs);
+	free(new_entries);
+	free(new_blocks);
+	free(new_extents);
+	free(new_indirect);
+	free(last_extent);
+	free(last_indirect);
+	group_flags = NULL;
+	cur_fp = NULL;
+	old_fp = NULL;
+	old_links = NULL;
+	old_dirs = NULL;
+	old_entries = NULL;
+	old_blocks = NULL;
+	old_extents = NULL;
+	old_indirect = NULL;
+	old_dir_blocks = NULL;
+	old_dir_written = NULL;
+	new_dirs = NULL;
+	new_entries = NULL;
+	new_blocks = NULL;
+	new_extents = NULL;
+	new_indirect = NULL;
+	last_extent = NULL;
+	last_indirect = NULL;
+	memset(&old_hdr, 0, sizeof(old_hdr));
+	new_num_dirs = new_max_dirs = 0;
+	new_num_entries = new_max_entries = 0;
+	new_num_blocks = new_max_blocks = 0;
+	new_num_extents = new_max_extents = 0;
+	new_num_indirect = new_max_indirect = 0;
+	trusting = 0;
+	num_trusted = 0;
+	stray_claim = 0;
+}
+
+
+/** @brief read the database of the last check
+ *
+ *  @param path database file
+ *  @return 0 success or -1 fail
+ */
+static int load_db(const char* path)
+{
+	FILE* fp = NULL;
+	size_t n = (size_t)sb.num_inodes + 1;
+	int ok = 0;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return -1;
+	if (fread(&old_hdr, sizeof(old_hdr), 1, fp) == 1
+	    && old_hdr.magic == INCR_MAGIC && old_hdr.version == INCR_VERSION
+	    && old_hdr.block_size == sb.block_size
+	    && old_hdr.num_blocks == sb.num_blocks
+	    && old_hdr.num_inodes == sb.num_inodes
+	    && old_hdr.num_groups == sb.num_groups)
+	{
+		old_fp = (uint64_t*)malloc(old_hdr.num_groups * sizeof(uint64_t));
+		old_links = (uint16_t*)mstore_alloc(n * sizeof(uint16_t));
+		old_dirs = (incr_dir_t*)malloc((old_hdr.num_dirs + 1)
+		                               * sizeof(incr_dir_t));
+		old_entries = (uint32_t*)malloc((old_hdr.num_entries + 1)
+		                                * sizeof(uint32_t));
+		old_blocks = (uint32_t*)malloc((old_hdr.num_dir_blocks + 1)
+		                               * sizeof(uint32_t));
+		old_extents = (incr_extent_t*)malloc((old_hdr.num_extents + 1)
+		                                     * sizeof(incr_extent_t));
+		old_indirect = (incr_extent_t*)malloc((old_hdr.num_indirect + 1)
+		                                      * sizeof(incr_extent_t));
+		ok = old_fp != NULL && old_links != NULL && old_dirs != NULL
+		     && old_entries != NULL && old_blocks != NULL
+		     && old_extents != NULL && old_indirect != NULL
+		     && fread(old_fp, sizeof(uint64_t), old_hdr.num_groups, fp)
+		        == old_hdr.num_groups
+		     && fread(old_links, sizeof(uint16_t), n, fp) == n
+		     && fread(old_dirs, sizeof(incr_dir_t), old_hdr.num_dirs, fp)
+		        == old_hdr.num_dirs
+		     && fread(old_entries, sizeof(uint32_t), old_hdr.num_entries, fp)
+		        == old_hdr.num_entries
+		     && fread(old_blocks, sizeof(uint32_t), old_hdr.num_dir_blocks,
+		              fp) == old_hdr.num_dir_blocks
+		     && fread(old_extents, sizeof(incr_extent_t),
+		              old_hdr.num_extents, fp) == old_hdr.num_extents
+		     && fread(old_indirect, sizeof(incr_extent_t),
+		              old_hdr.num_indirect, fp) == old_hdr.num_indirect;
+	}
+	fclose(fp);
+	return ok ? 0 : -1;
+}
+
+
+/** @brief drop the database of the last check
+ *
+ *  @return void
+ */
+static void drop_old_db()
+{
+	free(old_fp);
+	mstore_free(old_links);
+	free(old_dirs);
+	free(old_entries);
+	free(old_blocks);
+	free(old_extents);
+	free(old_indirect);
+	free(old_dir_blocks);
+	free(old_dir_written);
+	old_fp = NULL;
+	old_links = NULL;
+	old_dirs = NULL;
+	old_entries = NULL;
+	old_blocks = NULL;
+	old_extents = NULL;
+	old_indirect = NULL;
+	old_dir_blocks = NULL;
+	old_dir_written = NULL;
+	memset(&old_hdr, 0, sizeof(old_hdr));
+}
+
+
+/** @brief index the blocks of the saved directories, so that a write
+ *   to one keeps its directory from being replayed
+ *
+ *  @return 0 success or -1 fail
+ */
+static int index_dir_blocks()
+{
+	uint32_t d = 0, j = 0, n = 0;
+
+	old_dir_blocks = (incr_dir_block_t*)malloc((old_hdr.num_dir_blocks + 1)
+	                                           * sizeof(incr_dir_block_t));
+	old_dir_written = (unsigned char*)calloc(old_hdr.num_dirs + 1, 1);
+	if (old_dir_blocks == NULL || old_dir_written == NULL)
+		return -1;
+	for (d = 0; d < old_hdr.num_dirs; d++)
+	{
+		incr_dir_t* dir = &old_dirs[d];
+		if (dir->first_block + dir->num_blocks > old_hdr.num_dir_blocks)
+			return -1;
+		for (j = 0; j < dir->num_blocks; j++)
+		{
+			old_dir_blocks[n].block = old_blocks[dir->first_block + j];
+			old_dir_blocks[n].dir = d;
+			n++;
+		}
+	}
+	qsort(old_dir_blocks, n, sizeof(incr_dir_block_t), cmp_dir_block);
+	return 0;
+}
+
+
+/** @brief load the database of a partition, fingerprint its groups
+ *   and trust the groups that did not change since it was saved
+ *
+ *  @param partition_num partition number
+ *  @param reuse trust unchanged groups, 0 to check every group
+ *  @return void
+ */
+void incr_begin_check(int partition_num, int reuse)
+{
+	char path[4096];
+	incr_view_t view;
+	int g = 0;
+
+	if (db_path == NULL)
+		return;
+	free_dbs();
+	cur_partition = partition_num;
+	traversed = 0;
+	failed = 0;
+	reused = 0;
+
+	group_flags = (unsigned char*)calloc(sb.num_groups, 1);
+	cur_fp = (uint64_t*)malloc(sb.num_groups * sizeof(uint64_t));
+	last_extent = (int*)malloc(sb.num_groups * sizeof(int));
+	last_indirect = (int*)malloc(sb.num_groups * sizeof(int));
+	if (group_flags == NULL || cur_fp == NULL || last_extent == NULL
+	    || last_indirect == NULL)
+	{
+		failed = 1;
+		return;
+	}
+	for (g = 0; g < sb.num_groups; g++)
+		last_extent[g] = last_indirect[g] = -1;
+	/* a resumed check does not traverse, nothing is saved at its end */
+	if (!reuse)
+		return;
+
+	snprintf(path, sizeof(path), "%s.%d", db_path, partition_num);
+	if (load_db(path) == -1 || index_dir_blocks() == -1)
+	{
+		printf("no fingerprints of partition %d, checking every group\n",
+		       partition_num);
+		drop_old_db();
+		return;
+	}
+
+	/* the groups are hashed over the directories and indirect blocks
+	 * they had, any of them changed changes the fingerprint */
+	view.dirs = old_dirs;
+	view.num_dirs = old_hdr.num_dirs;
+	view.blocks = old_blocks;
+	view.indirect = old_indirect;
+	view.num_indirect = old_hdr.num_indirect;
+	unsigned char* buf = acquire_block_buf();
+	for (g = 0; g < sb.num_groups; g++)
+	{
+		cur_fp[g] = group_fingerprint(g, buf, &view);
+		if (cur_fp[g] != old_fp[g])
+			continue;
+		group_flags[g] |= GROUP_UNCHANGED;
+		num_trusted++;
+	}
+	release_block_buf(buf);
+	trusting = num_trusted > 0;
+	printf("%d of %d groups unchanged since the last check\n",
+	       num_trusted, sb.num_groups);
+}
+
+
+/** @brief number of groups trusted from the database
+ *
+ *  @return number of groups
+ */
+int incr_trusted_groups()
+{
+	return trusting ? num_trusted : 0;
+}
+
+
+/** @brief check if a group is trusted: its fingerprint did not change
+ *   and the passes use its saved results instead of scanning it
+ *
+ *  @param group group number
+ *  @return 1 trusted or 0 not
+ */
+int incr_group_trusted(int group)
+{
+	return trusting && group >= 0 && group < sb.num_groups
+	       && (group_flags[group] & GROUP_UNCHANGED);
+}
+
+
+/** @brief get the link count the last check left on an inode of a
+ *   trusted group
+ *
+ *  @param inode_num inode number
+ *  @return link count or -1 if its group is not trusted
+ */
+int incr_stored_links(unsigned int inode_num)
+{
+	if (inode_num == 0 || !incr_group_trusted(inode_group(inode_num)))
+		return -1;
+	return old_links[inode_num];
+}
+
+
+/** @brief stop trusting any group, the blocks of every inode are then
+ *   marked again and all their runs recorded anew
+ *
+ *  @return void
+ */
+void incr_distrust()
+{
+	int g = 0;
+
+	trusting = 0;
+	new_num_extents = 0;
+	new_num_indirect = 0;
+	if (last_extent != NULL)
+		for (g = 0; g < sb.num_groups; g++)
+			last_extent[g] = last_indirect[g] = -1;
+}
+
+
+/** @brief start recording the directories of a traversal, dropping
+ *   those of an earlier one
+ *
+ *  @return void
+ */
+void incr_begin_traversal()
+{
+	new_num_dirs = 0;
+	new_num_entries = 0;
+	new_num_blocks = 0;
+	reused = 0;
+	traversed = 1;
+}
+
+
+/** @brief find a directory in the database of the last check
+ *
+ *  @param inode_num inode number of the directory
+ *  @return its record or NULL
+ */
+static incr_dir_t* find_old_dir(unsigned int inode_num)
+{
+	incr_dir_t key;
+
+	if (old_dirs == NULL)
+		return NULL;
+	key.inode = inode_num;
+	return (incr_dir_t*)bsearch(&key, old_dirs, old_hdr.num_dirs,
+	                            sizeof(incr_dir_t), cmp_dir);
+}
+
+
+/** @brief get the saved entries of a directory, if its group is
+ *   trusted, its inode times and size are unchanged, none of its
+ *   blocks was written during the check and its ".." still names the
+ *   parent it is reached from
+ *
+ *  @param inode_num inode number of the directory
+ *  @param parent inode number of the parent directory
+ *  @param inode inode of the directory
+ *  @param entries set to the entries, INCR_SUBDIR flagged
+ *  @return number of entries or -1 if the directory must be read
+ */
+int incr_cached_dir(unsigned int inode_num, unsigned int parent,
+                    struct ext2_inode* inode, uint32_t** entries)
+{
+	if (inode_num == 0 || !incr_group_trusted(inode_group(inode_num)))
+		return -1;
+
+	incr_dir_t* dir = find_old_dir(inode_num);
+	if (dir == NULL || dir->num_entries < 2 || old_dir_written[dir - old_dirs]
+	    || dir->first_entry + dir->num_entries > old_hdr.num_entries
+	    || dir->mtime != inode->i_mtime || dir->ctime != inode->i_ctime
+	    || dir->size != inode->i_size)
+		return -1;
+
+	uint32_t* e = old_entries + dir->first_entry;
+	if ((e[0] & INCR_INODE_MASK) != inode_num
+	    || (e[1] & INCR_INODE_MASK) != parent)
+		return -1;
+	*entries = e;
+	return dir->num_entries;
+}
+
+
+/** @brief grow an array of 32 bit values
+ *
+ *  @param arr array
+ *  @param max capacity, updated
+ *  @param need number of values needed
+ *  @return 0 success or -1 fail
+ */
+static int grow(uint32_t** arr, int* max, int need)
+{
+	if (need <= *max)
+		return 0;
+	int n = *max > 0 ? *max : 64;
+	while (n < need)
+		n *= 2;
+	uint32_t* p = (uint32_t*)realloc(*arr, (long)n * sizeof(uint32_t));
+	if (p == NULL)
+		return -1;
+	*arr = p;
+	*max = n;
+	return 0;
+}
+
+
+/** @brief append a directory to the new database
+ *
+ *  @param inode_num inode number of the directory
+ *  @param entries its entries
+ *  @param num_entries number of entries
+ *  @param blocks its blocks
+ *  @param num_blocks number of blocks
+ *  @param stamp times and size of its inode
+ *  @return void
+ */
+static void add_dir(unsigned int inode_num, uint32_t* entries,
+                    int num_entries, uint32_t* blocks, int num_blocks,
+                    incr_dir_t* stamp)
+{
+	if (failed)
+		return;
+	if (new_num_dirs == new_max_dirs)
+	{
+		int n = new_max_dirs > 0 ? new_max_dirs * 2 : 64;
+		incr_dir_t* p =
+		   (incr_dir_t*)realloc(new_dirs, (long)n * sizeof(incr_dir_t));
+		if (p == NULL)
+		{
+			failed = 1;
+			return;
+		}
+		new_dirs = p;
+		new_max_dirs = n;
+	}
+	if (grow(&new_entries, &new_max_entries, new_num_entries + num_entries)
+	    == -1
+	    || grow(&new_blocks, &new_max_blocks, new_num_blocks + num_blocks)
+	    == -1)
+	{
+		failed = 1;
+		return;
+	}
+
+	incr_dir_t* dir = &new_dirs[new_num_dirs++];
+	dir->inode = inode_num;
+	dir->first_entry = new_num_entries;
+	dir->num_entries = num_entries;
+	dir->first_block = new_num_blocks;
+	dir->num_blocks = num_blocks;
+	dir->mtime = stamp->mtime;
+	dir->ctime = stamp->ctime;
+	dir->size = stamp->size;
+	memcpy(new_entries + new_num_entries, entries,
+	       num_entries * sizeof(uint32_t));
+	memcpy(new_blocks + new_num_blocks, blocks, num_blocks * sizeof(uint32_t));
+	new_num_entries += num_entries;
+	new_num_blocks += num_blocks;
+}
+
+
+/** @brief carry a directory replayed from the database over to the
+ *   new one
+ *
+ *  @param inode_num inode number of the directory
+ *  @return void
+ */
+void incr_keep_dir(unsigned int inode_num)
+{
+	incr_dir_t* dir = find_old_dir(inode_num);
+
+	if (dir == NULL)
+		return;
+	add_dir(inode_num, old_entries + dir->first_entry, dir->num_entries,
+	        old_blocks + dir->first_block, dir->num_blocks, dir);
+	reused++;
+}
+
+
+/** @brief record an entry of a directory being read
+ *
+ *  @param rec record of the directory
+ *  @param inode_num inode number in the entry
+ *  @param subdir 1 if the traversal descends into it
+ *  @return void
+ */
+void incr_rec_entry(incr_rec_t* rec, unsigned int inode_num, int subdir)
+{
+	if (grow(&rec->entries, &rec->max_entries, rec->num_entries + 1) == -1)
+	{
+		failed = 1;
+		return;
+	}
+	rec->entries[rec->num_entries++] = (inode_num & INCR_INODE_MASK)
+	                                   | (subdir ? INCR_SUBDIR : 0);
+}
+
+
+/** @brief record a data or indirect block of a directory being read
+ *
+ *  @param rec record of the directory
+ *  @param block block number
+ *  @return void
+ */
+void incr_rec_block(incr_rec_t* rec, unsigned int block)
+{
+	if (grow(&rec->blocks, &rec->max_blocks, rec->num_blocks + 1) == -1)
+	{
+		failed = 1;
+		return;
+	}
+	rec->blocks[rec->num_blocks++] = block;
+}
+
+
+/** @brief add a directory that was read to the new database and free
+ *   its record
+ *
+ *  @param inode_num inode number of the directory
+ *  @param inode inode of the directory
+ *  @param rec record of the directory
+ *  @return void
+ */
+void incr_end_dir(unsigned int inode_num, struct ext2_inode* inode,
+                  incr_rec_t* rec)
+{
+	incr_dir_t stamp;
+
+	stamp.mtime = inode->i_mtime;
+	stamp.ctime = inode->i_ctime;
+	stamp.size = inode->i_size;
+	add_dir(inode_num, rec->entries, rec->num_entries,
+	        rec->blocks, rec->num_blocks, &stamp);
+	free(rec->entries);
+	free(rec->blocks);
+	memset(rec, 0, sizeof(incr_rec_t));
+}
+
+
+/** @brief append an extent to an array
+ *
+ *  @param arr array
+ *  @param num number of extents, updated
+ *  @param max capacity, updated
+ *  @param ext extent to append
+ *  @return index of the extent or -1 if out of memory
+ */
+static int add_extent(incr_extent_t** arr, int* num, int* max,
+                      incr_extent_t* ext)
+{
+	if (*num == *max)
+	{
+		int n = *max > 0 ? *max * 2 : 64;
+		incr_extent_t* p = (incr_extent_t*)realloc(*arr,
+		                   (long)n * sizeof(incr_extent_t));
+		if (p == NULL)
+			return -1;
+		*arr = p;
+		*max = n;
+	}
+	(*arr)[*num] = *ext;
+	return (*num)++;
+}
+
+
+/** @brief extend the last extent of a group by a block or start a new
+ *   one
+ *
+ *  @param arr array
+ *  @param num number of extents, updated
+ *  @param max capacity, updated
+ *  @param last last extent of each group
+ *  @param group group of the owning inode
+ *  @param block block number
+ *  @return void
+ */
+static void extend_run(incr_extent_t** arr, int* num, int* max, int* last,
+                       int group, unsigned int block)
+{
+	incr_extent_t ext;
+	int k = last[group];
+
+	if (k >= 0 && (*arr)[k].start + (*arr)[k].count == block)
+	{
+		(*arr)[k].count++;
+		return;
+	}
+	ext.group = group;
+	ext.start = block;
+	ext.count = 1;
+	if ((k = add_extent(arr, num, max, &ext)) == -1)
+		failed = 1;
+	else
+		last[group] = k;
+}
+
+
+/** @brief check if a saved extent of a group holds a block
+ *
+ *  @param group group of the owning inodes
+ *  @param block block number
+ *  @return 1 held or 0 not
+ */
+static int old_extent_holds(int group, unsigned int block)
+{
+	incr_extent_t key;
+	uint32_t lo = 0, hi = old_hdr.num_extents;
+
+	/* first extent past the one that would hold the block */
+	key.group = group;
+	key.start = block;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (cmp_extent(&old_extents[mid], &key) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && old_extents[lo - 1].group == group
+	       && block < old_extents[lo - 1].start + old_extents[lo - 1].count;
+}
+
+
+/** @brief record a block marked for an inode of a group that is not
+ *   trusted: its indirect blocks, and the blocks it owns in other
+ *   groups. Runs of blocks are kept as one extent per run.
+ *
+ *  @param inode_num inode owning the block
+ *  @param block block number
+ *  @param kind BLOCK_DATA or the indirection depth
+ *  @return void
+ */
+void incr_rec_extent(unsigned int inode_num, unsigned int block, int kind)
+{
+	if (last_extent == NULL || failed || block < sb.first_data_block
+	    || block >= sb.num_blocks || inode_num == 0)
+		return;
+	int g = inode_group(inode_num);
+	if (incr_group_trusted(g))
+		return;
+
+	if (kind != BLOCK_DATA)
+		extend_run(&new_indirect, &new_num_indirect, &new_max_indirect,
+		           last_indirect, g, block);
+	int bg = (block - sb.first_data_block) / sb.blocks_per_group;
+	if (bg == g)
+		return;
+	/* the bitmap of a trusted group is not compared, so only a block it
+	 * already gave to this group may be claimed there */
+	if (incr_group_trusted(bg) && !old_extent_holds(g, block))
+		stray_claim = 1;
+	extend_run(&new_extents, &new_num_extents, &new_max_extents,
+	           last_extent, g, block);
+}
+
+
+/** @brief mark the blocks the inodes of trusted groups own in the
+ *   groups that are compared, from the saved extents
+ *
+ *  @return 0 success or -1 if an inode of a compared group claims a
+ *   block of a trusted group it did not own at the last check
+ */
+int incr_mark_trusted_blocks()
+{
+	uint32_t e = 0, j = 0;
+
+	if (!trusting)
+		return 0;
+	for (e = 0; e < old_hdr.num_extents; e++)
+	{
+		incr_extent_t* ext = &old_extents[e];
+		if (!incr_group_trusted(ext->group))
+			continue;
+		for (j = 0; j < ext->count; j++)
+		{
+			unsigned int block = ext->start + j;
+			if (block < sb.first_data_block || block >= sb.num_blocks)
+				break;
+			if (incr_group_trusted((block - sb.first_data_block)
+			                       / sb.blocks_per_group))
+				continue;
+			if (block_map_test_and_set(block) > 0)
+				dup_block_record(block);
+		}
+	}
+	return stray_claim ? -1 : 0;
+}
+
+
+/** @brief mark the groups a write lands in as changed, and the saved
+ *   directories it lands in as written along with their groups
+ *
+ *  @param offset byte offset on disk
+ *  @param length length in bytes
+ *  @return void
+ */
+void incr_note_write(long offset, long length)
+{
+	long block = 0, last = 0;
+	incr_dir_block_t key;
+
+	if (group_flags == NULL || offset < pt_info.base || length <= 0)
+		return;
+	block = (offset - pt_info.base) / sb.block_size;
+	last = (offset + length - 1 - pt_info.base) / sb.block_size;
+	for (; block <= last; block++)
+	{
+		if (block < sb.first_data_block || block >= sb.num_blocks)
+			continue;
+		group_flags[(block - sb.first_data_block) / sb.blocks_per_group]
+		   |= GROUP_DIRTY;
+		if (old_dir_blocks == NULL)
+			continue;
+
+		/* every directory holding the block, duplicates are adjacent */
+		key.block = block;
+		incr_dir_block_t* hit = (incr_dir_block_t*)bsearch(&key,
+		   old_dir_blocks, old_hdr.num_dir_blocks,
+		   sizeof(incr_dir_block_t), cmp_dir_block);
+		if (hit == NULL)
+			continue;
+		while (hit > old_dir_blocks && hit[-1].block == block)
+			hit--;
+		for (; hit < old_dir_blocks + old_hdr.num_dir_blocks
+		       && hit->block == block; hit++)
+		{
+			old_dir_written[hit->dir] = 1;
+			group_flags[inode_group(old_dirs[hit->dir].inode)] |= GROUP_DIRTY;
+		}
+	}
+}
+
+
+/** @brief write the link counts the check left, from the inode map
+ *
+ *  @param fp database file
+ *  @return 0 success or -1 fail
+ */
+static int save_links(FILE* fp)
+{
+	uint16_t chunk[1024];
+	int i = 0, n = 0;
+
+	for (i = 0; i <= sb.num_inodes; i++)
+	{
+		int links = inode_map_get(i);
+		chunk[n++] = links > INCR_MAX_LINKS ? INCR_MAX_LINKS : links;
+		if (n == 1024 || i == sb.num_inodes)
+		{
+			if (fwrite(chunk, sizeof(uint16_t), n, fp) != n)
+				return -1;
+			n = 0;
+		}
+	}
+	return 0;
+}
+
+
+/** @brief write the database of the finished check
+ *
+ *  @param path database file
+ *  @param fps group fingerprints
+ *  @return 0 success or -1 fail
+ */
+static int save_db(const char* path, uint64_t* fps)
+{
+	char tmp[4096 + 8];
+	incr_header_t hdr;
+	FILE* fp = NULL;
+	int ok = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = INCR_MAGIC;
+	hdr.version = INCR_VERSION;
+	hdr.block_size = sb.block_size;
+	hdr.num_blocks = sb.num_blocks;
+	hdr.num_inodes = sb.num_inodes;
+	hdr.num_groups = sb.num_groups;
+	hdr.num_dirs = new_num_dirs;
+	hdr.num_entries = new_num_entries;
+	hdr.num_dir_blocks = new_num_blocks;
+	hdr.num_extents = new_num_extents;
+	hdr.num_indirect = new_num_indirect;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "wb")) == NULL)
+		return -1;
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+	     && fwrite(fps, sizeof(uint64_t), sb.num_groups, fp) == sb.num_groups
+	     && save_links(fp) == 0
+	     && fwrite(new_dirs, sizeof(incr_dir_t), new_num_dirs, fp)
+	        == new_num_dirs
+	     && fwrite(new_entries, sizeof(uint32_t), new_num_entries, fp)
+	        == new_num_entries
+	     && fwrite(new_blocks, sizeof(uint32_t), new_num_blocks, fp)
+	        == new_num_blocks
+	     && fwrite(new_extents, sizeof(incr_extent_t), new_num_extents, fp)
+	        == new_num_extents
+	     && fwrite(new_indirect, sizeof(incr_extent_t), new_num_indirect, fp)
+	        == new_num_indirect;
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+
+/** @brief fingerprint the groups as the check left them and save the
+ *   database
+ *
+ *  @return void
+ */
+void incr_end_check()
+{
+	char path[4096];
+	incr_view_t view;
+	uint32_t e = 0;
+	int g = 0, hashed = 0;
+
+	if (db_path == NULL)
+		return;
+
+	/* trusted groups keep the extents they were saved with */
+	for (e = 0; e < old_hdr.num_extents && !failed; e++)
+		if (incr_group_trusted(old_extents[e].group)
+		    && add_extent(&new_extents, &new_num_extents, &new_max_extents,
+		                  &old_extents[e]) == -1)
+			failed = 1;
+	for (e = 0; e < old_hdr.num_indirect && !failed; e++)
+		if (incr_group_trusted(old_indirect[e].group)
+		    && add_extent(&new_indirect, &new_num_indirect,
+		                  &new_max_indirect, &old_indirect[e]) == -1)
+			failed = 1;
+
+	/* a resumed check did not traverse, keep the old database */
+	if (!traversed || failed)
+	{
+		if (failed)
+			printf("out of memory for fingerprints, database not saved\n");
+		free_dbs();
+		return;
+	}
+
+	qsort(new_dirs, new_num_dirs, sizeof(incr_dir_t), cmp_dir);
+	qsort(new_extents, new_num_extents, sizeof(incr_extent_t), cmp_extent);
+	qsort(new_indirect, new_num_indirect, sizeof(incr_extent_t), cmp_extent);
+
+	/* a trusted group not written to still has the fingerprint read at
+	 * the start, the others are hashed as they are left */
+	view.dirs = new_dirs;
+	view.num_dirs = new_num_dirs;
+	view.blocks = new_blocks;
+	view.indirect = new_indirect;
+	view.num_indirect = new_num_indirect;
+	unsigned char* buf = acquire_block_buf();
+	for (g = 0; g < sb.num_groups; g++)
+	{
+		if (incr_group_trusted(g) && !(group_flags[g] & GROUP_DIRTY))
+			continue;
+		cur_fp[g] = group_fingerprint(g, buf, &view);
+		hashed++;
+	}
+	release_block_buf(buf);
+
+	snprintf(path, sizeof(path), "%s.%d", db_path, cur_partition);
+	if (save_db(path, cur_fp) == -1)
+		perror("Could not write fingerprint database");
+	else
+		printf("%d directories reused, %d groups fingerprinted\n",
+		       reused, hashed);
+	free_dbs();
+}
@@ -0,0 +1,264 @@
+/** @file inodemap.c
+ *  @brief This module contains the local inode map, the number of
+ *   directory entries found for every inode
+ *
+ *   Each inode has a byte. Counts up to INODE_MAP_SATURATED - 1 are
+ *   kept in it, a cell holding INODE_MAP_SATURATED has its count in a
+ *   small hash table instead. Link counts that high are rare, so the
+ *   table stays tiny and the map takes a quarter of the memory an int
+ *   per inode took, which keeps more of it in cache while the
+ *   traversals count entries all over it.
+ *
+ *   The cells come from the map store, so they follow --mem-limit like
+ *   the other maps indexed by inode number.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "mapstore.h"
+#include "inodemap.h"
+
+/*** global variables ***/
+/** local inode map, a saturating count per inode */
+extern unsigned char* my_inode_map;
+
+/** inodes covered by the map, from 0 on */
+static int map_num_inodes = 0;
+
+/** hash table of the counts of saturated cells */
+static inode_map_overflow_t* overflow = NULL;
+static int overflow_size = 0;
+static int overflow_used = 0;
+
+
+/** @brief allocate a zeroed local inode map
+ *
+ *  @param num_inodes number of inodes of the filesystem
+ *  @return 0 success or -1 fail
+ */
+int inode_map_init(int num_inodes)
+{
+	inode_map_free();
+
+	my_inode_map = (unsigned char*)mstore_alloc((long)num_inodes + 1);
+	if (my_inode_map == NULL)
+		return -1;
+	map_num_inodes = num_inodes;
+	return 0;
+}
+
+
+/** @brief clear the overflow table
+ *
+ *  @return void
+ */
+static void overflow_free()
+{
+	free(overflow);
+	overflow = NULL;
+	overflow_size = 0;
+	overflow_used = 0;
+}
+
+
+/** @brief release the local inode map
+ *
+ *  @return void
+ */
+void inode_map_free()
+{
+	mstore_free(my_inode_map);
+	my_inode_map = NULL;
+	map_num_inodes = 0;
+	overflow_free();
+}
+
+
+/** @brief set every count back to zero
+ *
+ *  @return void
+ */
+void inode_map_reset()
+{
+	mstore_zero(my_inode_map);
+	overflow_free();
+}
+
+
+/** @brief find the slot of an inode in the overflow table
+ *
+ *  @param inode_num inode number
+ *  @return slot holding the inode or the free slot it belongs to
+ */
+static inode_map_overflow_t* overflow_slot(unsigned int inode_num)
+{
+	unsigned int i = (inode_num * 2654435761u) & (overflow_size - 1);
+
+	while (overflow[i].inode != 0 && overflow[i].inode != inode_num)
+		i = (i + 1) & (overflow_size - 1);
+
+	return &overflow[i];
+}
+
+
+/** @brief double the size of the overflow table
+ *
+ *  @return 0 success or -1 fail
+ */
+static int overflow_grow()
+{
+	inode_map_overflow_t* old_table = overflow;
+	int old_size = overflow_size;
+	int new_size = old_size ? old_size * 2 : INODE_MAP_OVERFLOW_INIT_SIZE;
+	int i = 0;
+
+	overflow = (inode_map_overflow_t*)calloc(new_size,
+	                                         sizeof(inode_map_overflow_t));
+	if (overflow == NULL)
+	{
+		overflow = old_table;
+		return -1;
+	}
+	overflow_size = new_size;
+
+	for (i = 0; i < old_size; i++)
+		if (old_table[i].inode != 0)
+			*overflow_slot(old_table[i].inode) = old_table[i];
+	free(old_table);
+
+	return 0;
+}
+
+
+/** @brief put the count of a saturated cell in the overflow table
+ *
+ *  @param inode_num inode number
+ *  @param count link count
+ *  @return void
+ */
+static void overflow_set(unsigned int inode_num, unsigned int count)
+{
+	/* keep the table at most 3/4 full */
+	if ((overflow_used + 1) * 4 > overflow_size * 3 && overflow_grow() == -1)
+	{
+		printf("Allocating link count table failed\n");
+		exit(-1);
+	}
+	inode_map_overflow_t* slot = overflow_slot(inode_num);
+	if (slot->inode == 0)
+	{
+		slot->inode = inode_num;
+		overflow_used++;
+	}
+	slot->count = count;
+}
+
+
+/** @brief count one more directory entry of an inode
+ *
+ *  @param inode_num inode number
+ *  @return the new count
+ */
+int inode_map_inc(unsigned int inode_num)
+{
+	unsigned char* cell = &my_inode_map[inode_num];
+
+	if (*cell < INODE_MAP_SATURATED - 1)
+		return ++*cell;
+	if (*cell == INODE_MAP_SATURATED - 1)
+	{
+		*cell = INODE_MAP_SATURATED;
+		overflow_set(inode_num, INODE_MAP_SATURATED);
+		return INODE_MAP_SATURATED;
+	}
+	return ++overflow_slot(inode_num)->count;
+}
+
+
+/** @brief get the number of directory entries of an inode
+ *
+ *  @param inode_num inode number
+ *  @return count
+ */
+int inode_map_get(unsigned int inode_num)
+{
+	if (my_inode_map[inode_num] < INODE_MAP_SATURATED)
+		return my_inode_map[inode_num];
+	return overflow_slot(inode_num)->count;
+}
+
+
+/** @brief drop the pages of a range of inodes a pass going forward is
+ *   done with, when the map is kept in a file
+ *
+ *  @param first first inode of the range
+ *  @param end inode after the range
+ *  @return void
+ */
+void inode_map_evict(long first, long end)
+{
+	mstore_evict(my_inode_map, first, end);
+}
+
+
+/** @brief write the local inode map to a state file: the cells, the
+ *   number of overflow entries and the entries
+ *
+ *  @param fp state file
+ *  @return 0 success or -1 fail
+ */
+int inode_map_save(FILE* fp)
+{
+	size_t n = (size_t)map_num_inodes + 1;
+	uint32_t used = overflow_used;
+	int i = 0;
+
+	if (fwrite(my_inode_map, 1, n, fp) != n
+	    || fwrite(&used, sizeof(used), 1, fp) != 1)
+		return -1;
+	for (i = 0; i < overflow_size; i++)
+		if (overflow[i].inode != 0
+		    && fwrite(&overflow[i], sizeof(overflow[i]), 1, fp) != 1)
+			return -1;
+	return 0;
+}
+
+
+/** @brief read the local inode map written by inode_map_save into an
+ *   initialized map
+ *
+ *  @param fp state file
+ *  @return 0 success or -1 fail
+ */
+int inode_map_load(FILE* fp)
+{
+	size_t n = (size_t)map_num_inodes + 1;
+	uint32_t used = 0, i = 0;
+	inode_map_overflow_t entry;
+
+	overflow_free();
+	if (fread(my_inode_map, 1, n, fp) != n
+	    || fread(&used, sizeof(used), 1, fp) != 1)
+		return -1;
+	for (i = 0; i < used; i++)
+	{
+		if (fread(&entry, sizeof(entry), 1, fp) != 1
+		    || entry.inode == 0 || entry.inode > (unsigned int)map_num_inodes
+		    || my_inode_map[entry.inode] != INODE_MAP_SATURATED)
+			return -1;
+		overflow_set(entry.inode, entry.count);
+	}
+	/* every saturated cell needs its entry */
+	for (i = 0; i < n; i++)
+		if (my_inode_map[i] == INODE_MAP_SATURATED)
+			used--;
+	return used == 0 ? 0 : -1;
+}
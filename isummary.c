@@ -0,0 +1,265 @@
+/** @file isummary.c
+ *  @brief This module keeps a summary of the inode table in memory
+ *
+ *   The inode tables are read once, before the traversal, and the few
+ *   fields the later passes look at are copied into one array per
+ *   field: the mode, link count, size, block count and block
+ *   pointers. Finding unreferenced inodes and comparing link counts
+ *   then loop over these arrays instead of decoding an on-disk inode
+ *   per step, and the block trees are walked from the saved pointers.
+ *
+ *   The blocks of the inodes in use can be marked in the same sweep,
+ *   see reconcile_block_marks for how the map is narrowed down to the
+ *   referenced ones afterwards.
+ *
+ *   Only the slots the inode scans visit are summarized, any other
+ *   inode is read from disk when asked for. The passes change nothing
+ *   in the summarized fields but the link count, which is updated
+ *   here when it is repaired.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "utility.h"
+#include "readwrite.h"
+#include "fsck.h"
+#include "bufpool.h"
+#include "icache.h"
+#include "mapstore.h"
+#include "isummary.h"
+#include "block.h"
+#include "trace.h"
+
+/*** global variables ***/
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+/** block group discriptor table */
+extern struct ext2_group_desc* bg_desc_table;
+
+/** summary of the partition being checked */
+static inode_summary_t summary;
+/** summary is built */
+static int built = 0;
+
+
+/** @brief check if an inode table block holds an inode the scans visit
+ *
+ *  @param first inode number of its first slot
+ *  @param count number of its slots
+ *  @return 1 yes or 0 no
+ */
+static int block_wanted(int first, int count)
+{
+	int j = 0;
+
+	if (first + count - 1 > sb.num_inodes)
+		count = sb.num_inodes - first + 1;
+	for (j = 0; j < count; j++)
+		if (inode_scan_wanted(first + j))
+			return 1;
+	return 0;
+}
+
+
+/** @brief copy the fields of the inodes in a run of inode table blocks
+ *
+ *  @param first inode number of the first slot of the run
+ *  @param count number of slots in the run
+ *  @param buf content of the run
+ *  @param mark mark the blocks of the inodes in use
+ *  @return void
+ */
+static void summarize(int first, int count, unsigned char* buf, int mark)
+{
+	int j = 0;
+
+	for (j = 0; j < count; j++)
+	{
+		int i = first + j;
+		if (!inode_scan_wanted(i))
+			continue;
+		struct ext2_inode* inode =
+		    (struct ext2_inode*)(buf + (long)j * sb.inode_size);
+		summary.mode[i] = inode->i_mode;
+		summary.links[i] = inode->i_links_count;
+		summary.size[i] = inode->i_size;
+		summary.blocks[i] = inode->i_blocks;
+		memcpy(summary.block[i], inode->i_block, sizeof(inode->i_block));
+
+		/* the reserved inodes other than root are never linked */
+		if (mark && inode->i_links_count > 0
+		    && (i == EXT2_ROOT_INO || i >= sb.first_ino))
+		{
+			trace_set_inode(i);
+			mark_scanned_inode(i, inode);
+		}
+	}
+}
+
+
+/** @brief read the inode tables and build the summary. Blocks without
+ *   an inode the scans visit are not read, the others are read in
+ *   runs of contiguous blocks.
+ *
+ *  @param mark mark the blocks of the inodes in use while at it
+ *  @return 0 success or -1 if the arrays could not be allocated
+ */
+int isum_build(int mark)
+{
+	long n = (long)sb.num_inodes + 1;
+	int per_block = sb.block_size / sb.inode_size;
+	int g = 0;
+
+	isum_free();
+	summary.num_inodes = sb.num_inodes;
+	summary.mode = (__u16*)mstore_alloc(n * sizeof(__u16));
+	summary.links = (__u16*)mstore_alloc(n * sizeof(__u16));
+	summary.size = (__u32*)mstore_alloc(n * sizeof(__u32));
+	summary.blocks = (__u32*)mstore_alloc(n * sizeof(__u32));
+	summary.block = (__u32(*)[EXT2_N_BLOCKS])
+	                mstore_alloc(n * sizeof(*summary.block));
+	if (summary.mode == NULL || summary.links == NULL || summary.size == NULL
+	    || summary.blocks == NULL || summary.block == NULL)
+	{
+		isum_free();
+		return -1;
+	}
+
+	unsigned char* batch = acquire_batch_buf();
+	for (g = 0; g < sb.num_groups; g++)
+	{
+		int first = g * sb.inodes_per_group + 1;
+		int count = sb.inodes_per_group;
+		if (first + count - 1 > sb.num_inodes)
+			count = sb.num_inodes - first + 1;
+		int nblocks = (count + per_block - 1) / per_block;
+		long table = pt_info.base
+		             + (long)bg_desc_table[g].bg_inode_table * sb.block_size;
+		int blk = 0;
+
+		while (blk < nblocks)
+		{
+			if (!block_wanted(first + blk * per_block, per_block))
+			{
+				blk++;
+				continue;
+			}
+
+			/* gather a run of wanted blocks and read it at once */
+			int run = 1;
+			while (blk + run < nblocks && run < BUF_POOL_BATCH_BLOCKS
+			       && block_wanted(first + (blk + run) * per_block,
+			                       per_block))
+				run++;
+			read_bytes(table + (long)blk * sb.block_size, batch,
+			           run * sb.block_size);
+
+			int slots = run * per_block;
+			if (blk * per_block + slots > count)
+				slots = count - blk * per_block;
+			summarize(first + blk * per_block, slots, batch, mark);
+			blk += run;
+		}
+		isum_evict(first, first + count);
+	}
+	release_batch_buf(batch);
+	trace_set_inode(0);
+
+	built = 1;
+	return 0;
+}
+
+
+/** @brief free the summary
+ *
+ *  @return void
+ */
+void isum_free()
+{
+	mstore_free(summary.mode);
+	mstore_free(summary.links);
+	mstore_free(summary.size);
+	mstore_free(summary.blocks);
+	mstore_free(summary.block);
+	memset(&summary, 0, sizeof(summary));
+	built = 0;
+}
+
+
+/** @brief drop the pages of the summary of a range of inodes a pass
+ *   going forward is done with, when it is kept in files
+ *
+ *  @param first first inode of the range
+ *  @param end inode after the range
+ *  @return void
+ */
+void isum_evict(long first, long end)
+{
+	mstore_evict(summary.mode, first * sizeof(__u16), end * sizeof(__u16));
+	mstore_evict(summary.links, first * sizeof(__u16), end * sizeof(__u16));
+	mstore_evict(summary.size, first * sizeof(__u32), end * sizeof(__u32));
+	mstore_evict(summary.blocks, first * sizeof(__u32), end * sizeof(__u32));
+	mstore_evict(summary.block, first * sizeof(*summary.block),
+	             end * sizeof(*summary.block));
+}
+
+
+/** @brief get the summary arrays. Only inodes inode_scan_wanted
+ *   accepts are in them.
+ *
+ *  @return summary or NULL if not built
+ */
+inode_summary_t* isum_table()
+{
+	return built ? &summary : NULL;
+}
+
+
+/** @brief get an inode with the summarized fields filled in, enough
+ *   to walk its block tree. Inodes not summarized are read in full.
+ *
+ *  @param inode_num inode number
+ *  @param inode returns the inode struct
+ *  @return void
+ */
+void isum_get_inode(int inode_num, struct ext2_inode* inode)
+{
+	if (!built || !inode_scan_wanted(inode_num))
+	{
+		read_inode(inode_num, inode);
+		return;
+	}
+
+	memset(inode, 0, sizeof(struct ext2_inode));
+	inode->i_mode = summary.mode[inode_num];
+	inode->i_links_count = summary.links[inode_num];
+	inode->i_size = summary.size[inode_num];
+	inode->i_blocks = summary.blocks[inode_num];
+	memcpy(inode->i_block, summary.block[inode_num], sizeof(inode->i_block));
+}
+
+
+/** @brief record a repaired link count
+ *
+ *  @param inode_num inode number
+ *  @param links new link count
+ *  @return void
+ */
+void isum_set_links(int inode_num, __u16 links)
+{
+	if (built && inode_num <= summary.num_inodes)
+		summary.links[inode_num] = links;
+}
+
@@ -0,0 +1,291 @@
+/** @file latency.c
+ *  @brief This module keeps latency histograms of disk requests
+ *
+ *   Every read and write through readwrite.c is timed and counted in a
+ *   log-bucketed histogram per operation and access class: inode
+ *   table, directory block, indirect block, bitmap, other data and the
+ *   remaining metadata. Buckets hold 8 steps per power of two, so any
+ *   recorded value is known within 12.5%.
+ *
+ *   Each thread counts into its own histograms, linked into a global
+ *   list on first use, so recording takes no lock. The report merges
+ *   all of them.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+#include "fsck.h"
+#include "latency.h"
+
+/*** global variables ***/
+/** partition information */
+extern partition_t pt_info;
+/** superblock information */
+extern superblock_t sb;
+/** block group discriptor table */
+extern struct ext2_group_desc* bg_desc_table;
+
+static const char* op_names[LAT_NUM_OPS] = {"read", "write"};
+static const char* class_names[LAT_NUM_CLASSES] =
+	{"inode", "directory", "indirect", "bitmap", "data", "other"};
+
+
+/** @brief histograms of one thread */
+typedef struct lat_set
+{
+	lat_hist_t hist[LAT_NUM_OPS][LAT_NUM_CLASSES];
+	struct lat_set* next;
+} lat_set_t;
+
+/** histograms of all threads */
+static lat_set_t* all_sets = NULL;
+/** histograms of this thread */
+static __thread lat_set_t* thread_set = NULL;
+/** class set by the caller for the next requests of this thread */
+static __thread int thread_class = LAT_AUTO;
+
+static int enabled = 0;
+
+
+/** @brief start timing requests
+ *
+ *  @return void
+ */
+void latency_enable()
+{
+	enabled = 1;
+}
+
+
+/** @brief check if requests are timed
+ *
+ *  @return 1 enabled or 0 not
+ */
+int latency_enabled()
+{
+	return enabled;
+}
+
+
+/** @brief set the access class of the following requests of this
+ *   thread, for requests whose class the offset does not tell
+ *
+ *  @param cls LAT_* class or LAT_AUTO
+ *  @return the previous class, to restore when done
+ */
+int latency_set_class(int cls)
+{
+	int prev = thread_class;
+	thread_class = cls;
+	return prev;
+}
+
+
+/** @brief read the monotonic clock
+ *
+ *  @return time in ns or 0 when timing is disabled
+ */
+uint64_t latency_start()
+{
+	struct timespec ts;
+
+	if (!enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+
+/** @brief access class of a request from the metadata at its offset
+ *
+ *  @param offset byte offset on disk
+ *  @return LAT_* class
+ */
+static int classify(long offset)
+{
+	if (bg_desc_table == NULL || sb.block_size == 0 || offset < pt_info.base)
+		return LAT_OTHER;
+
+	long block = (offset - pt_info.base) / sb.block_size;
+	long fst_db = sb.first_data_block;
+	if (block < fst_db || block >= sb.num_blocks)
+		return LAT_OTHER;
+
+	long group = (block - fst_db) / sb.blocks_per_group;
+	struct ext2_group_desc* gd = &bg_desc_table[group];
+	if (block == gd->bg_block_bitmap || block == gd->bg_inode_bitmap)
+		return LAT_BITMAP;
+	if (block >= gd->bg_inode_table && block < gd->bg_inode_table
+	                                           + sb.itable_blocks)
+		return LAT_INODE;
+	/* superblock and descriptor copies precede the bitmaps */
+	if (block < gd->bg_block_bitmap)
+		return LAT_OTHER;
+	return LAT_DATA;
+}
+
+
+/** @brief histogram bucket of a value
+ *
+ *  @param v value
+ *  @return bucket index
+ */
+static int bucket_of(uint64_t v)
+{
+	int msb = 0;
+
+	if (v < LAT_SUB_COUNT)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb > LAT_MAX_BITS)
+		return LAT_NUM_BUCKETS - 1;
+	return (msb - LAT_SUB_BITS + 1) * LAT_SUB_COUNT
+	       + ((v >> (msb - LAT_SUB_BITS)) & (LAT_SUB_COUNT - 1));
+}
+
+
+/** @brief highest value counted in a bucket
+ *
+ *  @param b bucket index
+ *  @return value
+ */
+static uint64_t bucket_max(int b)
+{
+	if (b < LAT_SUB_COUNT)
+		return b;
+	int msb = b / LAT_SUB_COUNT + LAT_SUB_BITS - 1;
+	uint64_t sub = b % LAT_SUB_COUNT;
+	return ((LAT_SUB_COUNT + sub + 1) << (msb - LAT_SUB_BITS)) - 1;
+}
+
+
+/** @brief histograms of the calling thread, registered on first use
+ *
+ *  @return histogram set or NULL if out of memory
+ */
+static lat_set_t* get_thread_set()
+{
+	if (thread_set != NULL)
+		return thread_set;
+
+	lat_set_t* set = (lat_set_t*)calloc(1, sizeof(lat_set_t));
+	if (set == NULL)
+		return NULL;
+	do
+		set->next = all_sets;
+	while (!__sync_bool_compare_and_swap(&all_sets, set->next, set));
+	thread_set = set;
+	return set;
+}
+
+
+/** @brief count a finished request
+ *
+ *  @param op LAT_READ or LAT_WRITE
+ *  @param offset byte offset on disk
+ *  @param start value of latency_start() before the request
+ *  @return void
+ */
+void latency_end(int op, long offset, uint64_t start)
+{
+	lat_set_t* set = NULL;
+
+	if (start == 0 || (set = get_thread_set()) == NULL)
+		return;
+
+	uint64_t ns = latency_start() - start;
+	int cls = thread_class != LAT_AUTO ? thread_class : classify(offset);
+	lat_hist_t* h = &set->hist[op][cls];
+
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->buckets[bucket_of(ns)]++;
+}
+
+
+/** @brief value below which a fraction of a histogram lies
+ *
+ *  @param h histogram
+ *  @param q fraction between 0 and 1
+ *  @return value in ns
+ */
+static uint64_t percentile(lat_hist_t* h, double q)
+{
+	uint64_t rank = (uint64_t)(q * h->count + 0.5);
+	uint64_t seen = 0;
+	int b = 0;
+
+	if (rank == 0)
+		rank = 1;
+	for (b = 0; b < LAT_NUM_BUCKETS; b++)
+	{
+		seen += h->buckets[b];
+		if (seen >= rank)
+			return bucket_max(b) < h->max ? bucket_max(b) : h->max;
+	}
+	return h->max;
+}
+
+
+/** @brief print percentiles of every operation and class seen
+ *
+ *  @param fp output file
+ *  @return void
+ */
+void latency_report(FILE* fp)
+{
+	lat_hist_t merged;
+	lat_set_t* set = NULL;
+	int op = 0, cls = 0, b = 0;
+
+	if (!enabled)
+		return;
+
+	fprintf(fp, "*** request latency (us) ***\n");
+	fprintf(fp, "%-16s %9s %9s %9s %9s %9s %9s %9s\n", "request", "count",
+	        "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (op = 0; op < LAT_NUM_OPS; op++)
+		for (cls = 0; cls < LAT_NUM_CLASSES; cls++)
+		{
+			memset(&merged, 0, sizeof(merged));
+			for (set = all_sets; set != NULL; set = set->next)
+			{
+				lat_hist_t* h = &set->hist[op][cls];
+				merged.count += h->count;
+				merged.sum += h->sum;
+				if (h->max > merged.max)
+					merged.max = h->max;
+				for (b = 0; b < LAT_NUM_BUCKETS; b++)
+					merged.buckets[b] += h->buckets[b];
+			}
+			if (merged.count == 0)
+				continue;
+
+			char name[32];
+			snprintf(name, sizeof(name), "%s %s", op_names[op],
+			         class_names[cls]);
+			fprintf(fp, "%-16s %9" PRIu64 " %9.1f %9.1f %9.1f %9.1f %9.1f "
+			            "%9.1f\n", name, merged.count,
+			        (double)merged.sum / merged.count / 1000,
+			        percentile(&merged, 0.5) / 1000.0,
+			        percentile(&merged, 0.9) / 1000.0,
+			        percentile(&merged, 0.99) / 1000.0,
+			        percentile(&merged, 0.999) / 1000.0,
+			        merged.max / 1000.0);
+		}
+	fprintf(fp, "\n");
+}
+
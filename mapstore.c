@@ -0,0 +1,207 @@
+/** @file mapstore.c
+ *  @brief This module allocates the large maps of a check, in memory or
+ *   in temporary files when they do not fit under the memory limit
+ *
+ *   Without a limit every map is plain memory. With one, maps are kept
+ *   in memory while their total stays under it, the others are mapped
+ *   from unlinked files in TMPDIR. Their pages are then written back
+ *   and dropped by the kernel under memory pressure, so the check
+ *   slows down to the speed of the disk instead of running out of
+ *   memory.
+ *
+ *   The maps are indexed by inode number, so a group owns a
+ *   contiguous range of each. The passes going through the groups in
+ *   order call mstore_evict on the ranges they are done with, which
+ *   drops those pages at once rather than when the kernel gets to it.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "mapstore.h"
+
+/** bytes of maps kept in memory, 0 for no limit */
+static long limit = 0;
+/** bytes of the maps in memory */
+static long resident = 0;
+
+static mstore_map_t maps[MSTORE_MAX_MAPS];
+static int num_maps = 0;
+
+
+/** @brief set the memory the maps of a check may take
+ *
+ *  @param mb megabytes, 0 for no limit
+ *  @return void
+ */
+void mstore_set_limit(long mb)
+{
+	limit = mb << 20;
+}
+
+
+/** @brief get the memory the maps of a check may take
+ *
+ *  @return bytes, 0 for no limit
+ */
+long mstore_limit()
+{
+	return limit;
+}
+
+
+/** @brief map a zeroed, unlinked temporary file
+ *
+ *  @param bytes size of the map
+ *  @param fd returns the file descriptor
+ *  @return the map or NULL fail
+ */
+static void* map_file(long bytes, int* fd)
+{
+	char path[4096];
+	const char* dir = getenv("TMPDIR");
+
+	if (dir == NULL || dir[0] == '\0')
+		dir = MSTORE_DEFAULT_DIR;
+	snprintf(path, sizeof(path), "%s/myfsck-map-XXXXXX", dir);
+	if ((*fd = mkstemp(path)) == -1)
+		return NULL;
+	unlink(path);
+
+	void* ptr = MAP_FAILED;
+	if (ftruncate(*fd, bytes) == 0)
+		ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		close(*fd);
+		return NULL;
+	}
+	return ptr;
+}
+
+
+/** @brief allocate a zeroed map, in a file if it does not fit under
+ *   the limit
+ *
+ *  @param bytes size of the map
+ *  @return the map or NULL fail, also when MSTORE_MAX_MAPS are taken
+ */
+void* mstore_alloc(long bytes)
+{
+	void* ptr = NULL;
+	int fd = -1;
+
+	/* an untracked map could not be zeroed or evicted */
+	if (num_maps == MSTORE_MAX_MAPS)
+		return NULL;
+	if (limit > 0 && resident + bytes > limit)
+		ptr = map_file(bytes, &fd);
+	if (ptr == NULL)
+	{
+		fd = -1;
+		if ((ptr = calloc(bytes, 1)) == NULL)
+			return NULL;
+	}
+
+	maps[num_maps].ptr = ptr;
+	maps[num_maps].bytes = bytes;
+	maps[num_maps].fd = fd;
+	num_maps++;
+	if (fd == -1)
+		resident += bytes;
+	return ptr;
+}
+
+
+/** @brief find a map allocated here
+ *
+ *  @param ptr start of the map
+ *  @return the map or NULL
+ */
+static mstore_map_t* find_map(void* ptr)
+{
+	int i = 0;
+
+	for (i = 0; i < num_maps; i++)
+		if (maps[i].ptr == ptr)
+			return &maps[i];
+	return NULL;
+}
+
+
+/** @brief free a map
+ *
+ *  @param ptr start of the map, NULL is ignored
+ *  @return void
+ */
+void mstore_free(void* ptr)
+{
+	mstore_map_t* map = find_map(ptr);
+
+	if (map == NULL)
+		return;
+	if (map->fd == -1)
+	{
+		free(ptr);
+		resident -= map->bytes;
+	}
+	else
+	{
+		munmap(ptr, map->bytes);
+		close(map->fd);
+	}
+	*map = maps[--num_maps];
+}
+
+
+/** @brief clear a map. A file is cut to nothing and grown back, so
+ *   none of its pages is read or written.
+ *
+ *  @param ptr start of the map
+ *  @return void
+ */
+void mstore_zero(void* ptr)
+{
+	mstore_map_t* map = find_map(ptr);
+
+	if (map == NULL)
+		return;
+	if (map->fd == -1 || ftruncate(map->fd, 0) == -1
+	    || ftruncate(map->fd, map->bytes) == -1)
+		memset(ptr, 0, map->bytes);
+}
+
+
+/** @brief drop the pages of a range of a map kept in a file, for a
+ *   pass going forward that is done with everything before the end of
+ *   the range. They are read back when touched again. Maps in memory
+ *   are left alone.
+ *
+ *  @param ptr start of the map
+ *  @param from first byte of the range
+ *  @param to byte after the range
+ *  @return void
+ */
+void mstore_evict(void* ptr, long from, long to)
+{
+	mstore_map_t* map = find_map(ptr);
+	long page = sysconf(_SC_PAGE_SIZE);
+
+	if (map == NULL || map->fd == -1)
+		return;
+	if (to > map->bytes)
+		to = map->bytes;
+	/* the page holding the end is still in use */
+	from = from / page * page;
+	to = to / page * page;
+	if (from < to)
+		madvise((unsigned char*)ptr + from, to - from, MADV_DONTNEED);
+}
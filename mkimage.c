@@ -0,0 +1,1348 @@
+/** @file mkimage.c
+ *  @brief Synthetic ext2 disk image generator
+ *
+ *   Builds a disk image with an MBR, one primary and any number of
+ *   logical partitions, each holding a freshly generated ext2
+ *   filesystem. The directory tree, file sizes and block placement are
+ *   driven by a seeded generator so images are reproducible. File data
+ *   is never written, the image file stays sparse and large images are
+ *   cheap to create. Optionally the corruptions myfsck repairs are
+ *   injected afterwards.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "genhd.h"
+#include "ext2_fs.h"
+
+#define SECTOR_SIZE 512
+#define PARTITION_ALIGN 2048          /* sectors between partitions */
+#define MAX_BLOCKS_PER_GROUP 65528    /* group counters are 16 bits */
+#define DEFAULT_INODE_RATIO 8192      /* bytes per inode */
+#define LOST_FOUND_SIZE 16384         /* preallocated lost+found size */
+#define MAX_FILE_SIZE 0x7fffffffULL   /* no large_file feature */
+#define IMAGE_TIME 1262304000         /* fixed timestamp, 2010-01-01 */
+
+/* file size distributions */
+#define DIST_FIXED   0
+#define DIST_UNIFORM 1
+#define DIST_EXP     2
+
+/* corruption types */
+#define CORRUPT_DOT    0
+#define CORRUPT_DOTDOT 1
+#define CORRUPT_ORPHAN 2
+#define CORRUPT_LINKS  3
+#define CORRUPT_BITMAP 4
+#define NUM_CORRUPT    5
+
+static const char* corrupt_names[NUM_CORRUPT] =
+	{"dot", "dotdot", "orphan", "links", "bitmap"};
+
+
+/** @brief generator parameters */
+typedef struct image_params
+{
+	char* output;
+	uint64_t fs_size;
+	int block_size;
+	uint32_t num_inodes;
+	int inode_size;
+	int depth;
+	int fanout;
+	int files_per_dir;
+	int dist;
+	uint64_t size_a;
+	uint64_t size_b;
+	int frag;
+	int num_logical;
+	uint64_t seed;
+	int sparse_super;
+	int corrupt[NUM_CORRUPT];
+} image_params_t;
+
+
+/** @brief state of the filesystem being generated */
+typedef struct fs_state
+{
+	int fd;
+	off_t base;
+
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint32_t first_data_block;
+	uint32_t blocks_per_group;
+	uint32_t num_groups;
+	uint32_t inodes_per_group;
+	uint32_t num_inodes;
+	uint32_t inode_size;
+	uint32_t itable_blocks;
+	uint32_t gdt_blocks;
+	uint32_t ptrs_per_block;
+	int sparse_super;
+
+	unsigned char* block_bitmap;
+	unsigned char* inode_bitmap;
+	struct ext2_group_desc* gdt;
+
+	uint32_t cursor;
+	uint32_t free_blocks;
+	uint64_t dir_reserve;
+	uint32_t free_inodes;
+	uint32_t next_dir_group;
+	uint32_t last_inode;
+
+	uint32_t* dirs;
+	uint32_t num_dirs;
+	uint32_t max_dirs;
+	uint32_t num_files;
+	uint32_t num_truncated;
+} fs_state_t;
+
+
+/** @brief directory contents under construction */
+typedef struct dir_builder
+{
+	unsigned char* data;
+	uint32_t size;
+	uint32_t last;
+	uint32_t block_size;
+} dir_builder_t;
+
+
+static uint64_t rng_state = 1;
+
+
+/** @brief next value of the xorshift64* generator
+ *
+ *  @return uint64_t
+ */
+static uint64_t rng_next()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+
+/** @brief uniform random number in [0, n)
+ *
+ *  @param n upper bound
+ *  @return uint64_t
+ */
+static uint64_t rng_below(uint64_t n)
+{
+	return n ? rng_next() % n : 0;
+}
+
+
+/** @brief uniform random number in [0, 1)
+ *
+ *  @return double
+ */
+static double rng_unit()
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/** @brief parse a size with an optional K/M/G/T suffix
+ *
+ *  @param s string to parse
+ *  @return size in bytes
+ */
+static uint64_t parse_size(const char* s)
+{
+	char* end = NULL;
+	uint64_t v = strtoull(s, &end, 10);
+
+	switch (*end)
+	{
+		case 'T': case 't': v <<= 10;
+		case 'G': case 'g': v <<= 10;
+		case 'M': case 'm': v <<= 10;
+		case 'K': case 'k': v <<= 10;
+	}
+	return v;
+}
+
+
+/** @brief parse a file size distribution: fixed:S, uniform:MIN:MAX
+ *   or exp:MEAN
+ *
+ *  @param s string to parse
+ *  @param p parameters to fill
+ *  @return 0 success or -1 fail
+ */
+static int parse_dist(const char* s, image_params_t* p)
+{
+	const char* arg = strchr(s, ':');
+	if (arg == NULL)
+		return -1;
+	arg++;
+
+	if (strncmp(s, "fixed:", 6) == 0)
+	{
+		p->dist = DIST_FIXED;
+		p->size_a = parse_size(arg);
+	}
+	else if (strncmp(s, "exp:", 4) == 0)
+	{
+		p->dist = DIST_EXP;
+		p->size_a = parse_size(arg);
+	}
+	else if (strncmp(s, "uniform:", 8) == 0)
+	{
+		const char* max = strchr(arg, ':');
+		if (max == NULL)
+			return -1;
+		p->dist = DIST_UNIFORM;
+		p->size_a = parse_size(arg);
+		p->size_b = parse_size(max + 1);
+		if (p->size_b < p->size_a)
+			return -1;
+	}
+	else
+		return -1;
+	return 0;
+}
+
+
+/** @brief parse a corruption list such as dot=1,orphan=3,bitmap=10
+ *
+ *  @param s string to parse
+ *  @param p parameters to fill
+ *  @return 0 success or -1 fail
+ */
+static int parse_corrupt(char* s, image_params_t* p)
+{
+	char* item = strtok(s, ",");
+	while (item != NULL)
+	{
+		char* eq = strchr(item, '=');
+		int i = 0;
+		if (eq == NULL)
+			return -1;
+		*eq = '\0';
+		for (i = 0; i < NUM_CORRUPT; i++)
+		{
+			if (strcmp(item, corrupt_names[i]) == 0)
+				break;
+		}
+		if (i == NUM_CORRUPT)
+			return -1;
+		p->corrupt[i] = atoi(eq + 1);
+		item = strtok(NULL, ",");
+	}
+	return 0;
+}
+
+
+/** @brief draw a file size from the configured distribution
+ *
+ *  @param p parameters
+ *  @return size in bytes
+ */
+static uint64_t draw_file_size(image_params_t* p)
+{
+	uint64_t size = 0;
+
+	switch (p->dist)
+	{
+		case DIST_FIXED:
+			size = p->size_a;
+			break;
+		case DIST_UNIFORM:
+			size = p->size_a + rng_below(p->size_b - p->size_a + 1);
+			break;
+		case DIST_EXP:
+			size = (uint64_t)(-log(1 - rng_unit()) * p->size_a);
+			break;
+	}
+	return size > MAX_FILE_SIZE ? MAX_FILE_SIZE : size;
+}
+
+
+/** @brief write bytes at an offset of the current partition
+ *
+ *  @param st filesystem state
+ *  @param offset offset from the partition start
+ *  @param buf bytes to write
+ *  @param len number of bytes
+ *  @return void
+ */
+static void fs_write(fs_state_t* st, off_t offset, const void* buf, size_t len)
+{
+	if (pwrite(st->fd, buf, len, st->base + offset) != (ssize_t)len)
+	{
+		perror("write image");
+		exit(-1);
+	}
+}
+
+
+/** @brief read bytes at an offset of the current partition
+ *
+ *  @param st filesystem state
+ *  @param offset offset from the partition start
+ *  @param buf buffer to fill
+ *  @param len number of bytes
+ *  @return void
+ */
+static void fs_read(fs_state_t* st, off_t offset, void* buf, size_t len)
+{
+	if (pread(st->fd, buf, len, st->base + offset) != (ssize_t)len)
+	{
+		perror("read image");
+		exit(-1);
+	}
+}
+
+
+/** @brief check if n is a power of a
+ *
+ *  @param n number to test
+ *  @param a base
+ *  @return 1 yes or 0 no
+ */
+static int is_power(uint32_t n, uint32_t a)
+{
+	while (n > 1 && n % a == 0)
+		n /= a;
+	return n == 1;
+}
+
+
+/** @brief check if a group carries a superblock backup
+ *
+ *  @param st filesystem state
+ *  @param group group number
+ *  @return 1 yes or 0 no
+ */
+static int group_has_super(fs_state_t* st, uint32_t group)
+{
+	if (group <= 1 || !st->sparse_super)
+		return 1;
+	return is_power(group, 3) || is_power(group, 5) || is_power(group, 7);
+}
+
+
+/** @brief first block of a group
+ *
+ *  @param st filesystem state
+ *  @param group group number
+ *  @return block number
+ */
+static uint32_t group_start(fs_state_t* st, uint32_t group)
+{
+	return st->first_data_block + group * st->blocks_per_group;
+}
+
+
+/** @brief mark a block used in the in-memory bitmap
+ *
+ *  @param st filesystem state
+ *  @param block block number
+ *  @return void
+ */
+static void use_block(fs_state_t* st, uint32_t block)
+{
+	st->block_bitmap[block >> 3] |= 1 << (block & 7);
+	st->gdt[(block - st->first_data_block) / st->blocks_per_group]
+		.bg_free_blocks_count--;
+	st->free_blocks--;
+}
+
+
+/** @brief allocate one block. With probability frag percent the
+ *   allocation cursor jumps to a random position first.
+ *
+ *  @param st filesystem state
+ *  @param frag fragmentation level in percent
+ *  @return block number or 0 if the filesystem is full
+ */
+static uint32_t alloc_block(fs_state_t* st, int frag)
+{
+	uint32_t scanned = 0;
+	uint32_t span = st->num_blocks - st->first_data_block;
+
+	if (st->free_blocks == 0)
+		return 0;
+	if (frag > 0 && rng_below(100) < (uint64_t)frag)
+		st->cursor = st->first_data_block + rng_below(span);
+
+	while (scanned < span)
+	{
+		if (st->cursor >= st->num_blocks)
+			st->cursor = st->first_data_block;
+		/* skip full bytes */
+		if ((st->cursor & 7) == 0 && st->block_bitmap[st->cursor >> 3] == 0xff
+		    && st->cursor + 8 <= st->num_blocks)
+		{
+			st->cursor += 8;
+			scanned += 8;
+			continue;
+		}
+		if (!(st->block_bitmap[st->cursor >> 3] & (1 << (st->cursor & 7))))
+		{
+			uint32_t block = st->cursor++;
+			use_block(st, block);
+			return block;
+		}
+		st->cursor++;
+		scanned++;
+	}
+	return 0;
+}
+
+
+/** @brief allocate an inode, preferring a given group
+ *
+ *  @param st filesystem state
+ *  @param group preferred group
+ *  @param is_dir 1 if the inode is a directory
+ *  @return inode number or 0 if none is left
+ */
+static uint32_t alloc_inode(fs_state_t* st, uint32_t group, int is_dir)
+{
+	uint32_t g = 0;
+
+	for (g = 0; g < st->num_groups; g++)
+	{
+		uint32_t grp = (group + g) % st->num_groups;
+		uint32_t free_count = st->gdt[grp].bg_free_inodes_count;
+		if (free_count == 0)
+			continue;
+
+		/* inodes are never freed, so each group fills up in order */
+		uint32_t index = grp * st->inodes_per_group
+		                 + st->inodes_per_group - free_count;
+		st->inode_bitmap[index >> 3] |= 1 << (index & 7);
+		st->gdt[grp].bg_free_inodes_count--;
+		if (is_dir)
+			st->gdt[grp].bg_used_dirs_count++;
+		st->free_inodes--;
+		if (index + 1 > st->last_inode)
+			st->last_inode = index + 1;
+		return index + 1;
+	}
+	return 0;
+}
+
+
+/** @brief byte offset of an inode in the partition
+ *
+ *  @param st filesystem state
+ *  @param ino inode number
+ *  @return offset
+ */
+static off_t inode_offset(fs_state_t* st, uint32_t ino)
+{
+	uint32_t group = (ino - 1) / st->inodes_per_group;
+	uint32_t index = (ino - 1) % st->inodes_per_group;
+
+	return (off_t)st->gdt[group].bg_inode_table * st->block_size
+	       + (off_t)index * st->inode_size;
+}
+
+
+/** @brief allocate blocks for one subtree of a block map
+ *
+ *  @param st filesystem state
+ *  @param frag fragmentation level
+ *  @param depth 0 for a data block, indirection depth otherwise
+ *  @param next next logical block to map, advanced
+ *  @param total number of data blocks
+ *  @param data file contents or NULL
+ *  @param meta number of indirect blocks, advanced
+ *  @return block number of the subtree root
+ */
+static uint32_t fill_tree(fs_state_t* st, int frag, int depth, uint64_t* next,
+                          uint64_t total, const unsigned char* data,
+                          uint32_t* meta)
+{
+	uint32_t block = alloc_block(st, frag);
+	uint32_t i = 0;
+
+	if (depth == 0)
+	{
+		if (data != NULL)
+			fs_write(st, (off_t)block * st->block_size,
+			         data + *next * st->block_size, st->block_size);
+		(*next)++;
+		return block;
+	}
+
+	uint32_t* ptrs = (uint32_t*)calloc(st->ptrs_per_block, sizeof(uint32_t));
+	for (i = 0; i < st->ptrs_per_block && *next < total; i++)
+		ptrs[i] = fill_tree(st, frag, depth - 1, next, total, data, meta);
+	fs_write(st, (off_t)block * st->block_size, ptrs, st->block_size);
+	free(ptrs);
+	(*meta)++;
+
+	return block;
+}
+
+
+/** @brief number of indirect blocks needed to map a number of blocks
+ *
+ *  @param st filesystem state
+ *  @param n number of data blocks
+ *  @return uint64_t
+ */
+static uint64_t indirect_overhead(fs_state_t* st, uint64_t n)
+{
+	uint64_t ppb = st->ptrs_per_block, meta = 0;
+
+	if (n <= EXT2_NDIR_BLOCKS)
+		return 0;
+	n -= EXT2_NDIR_BLOCKS;
+	meta++;
+	if (n <= ppb)
+		return meta;
+	n -= ppb;
+	meta += 1 + (n < ppb * ppb ? (n + ppb - 1) / ppb : ppb);
+	if (n <= ppb * ppb)
+		return meta;
+	n -= ppb * ppb;
+	meta += 1 + (n + ppb * ppb - 1) / (ppb * ppb) + (n + ppb - 1) / ppb;
+	return meta;
+}
+
+
+/** @brief allocate and write the block map of an inode
+ *
+ *  @param st filesystem state
+ *  @param frag fragmentation level
+ *  @param inode inode to fill i_block and i_blocks of
+ *  @param num_blocks number of data blocks
+ *  @param data contents to write or NULL to leave holes
+ *  @return void
+ */
+static void map_blocks(fs_state_t* st, int frag, struct ext2_inode* inode,
+                       uint64_t num_blocks, const unsigned char* data)
+{
+	uint64_t next = 0;
+	uint32_t meta = 0;
+	int i = 0;
+
+	for (i = 0; i < EXT2_NDIR_BLOCKS && next < num_blocks; i++)
+		inode->i_block[i] = fill_tree(st, frag, 0, &next, num_blocks,
+		                              data, &meta);
+	for (i = 1; i <= 3 && next < num_blocks; i++)
+		inode->i_block[EXT2_NDIR_BLOCKS + i - 1] =
+			fill_tree(st, frag, i, &next, num_blocks, data, &meta);
+
+	inode->i_blocks = (num_blocks + meta) * (st->block_size / 512);
+}
+
+
+/** @brief write an inode to the inode table
+ *
+ *  @param st filesystem state
+ *  @param ino inode number
+ *  @param inode inode contents
+ *  @return void
+ */
+static void write_inode(fs_state_t* st, uint32_t ino, struct ext2_inode* inode)
+{
+	fs_write(st, inode_offset(st, ino), inode, sizeof(struct ext2_inode));
+}
+
+
+/** @brief fill the fields shared by all generated inodes
+ *
+ *  @param inode inode to initialize
+ *  @param mode i_mode
+ *  @return void
+ */
+static void init_inode(struct ext2_inode* inode, __u16 mode)
+{
+	memset(inode, 0, sizeof(struct ext2_inode));
+	inode->i_mode = mode;
+	inode->i_atime = IMAGE_TIME;
+	inode->i_ctime = IMAGE_TIME;
+	inode->i_mtime = IMAGE_TIME;
+	inode->i_links_count = 1;
+}
+
+
+/** @brief append an entry to a directory under construction
+ *
+ *  @param db directory builder
+ *  @param ino inode number
+ *  @param name entry name
+ *  @param type EXT2_FT_* file type
+ *  @return void
+ */
+static void dir_add(dir_builder_t* db, uint32_t ino, const char* name, int type)
+{
+	int name_len = strlen(name);
+	uint32_t rec_len = EXT2_DIR_REC_LEN(name_len);
+	uint32_t pos = 0;
+
+	if (db->size > 0)
+	{
+		unsigned char* last = db->data + db->last;
+		uint32_t last_len = EXT2_DIR_REC_LEN(last[6]);
+		pos = db->last + last_len;
+		/* start a new block if the entry does not fit */
+		if (pos + rec_len > db->size)
+			pos = db->size;
+		else
+			*(__u16*)(last + 4) = last_len;
+	}
+	if (pos == db->size)
+	{
+		db->data = (unsigned char*)realloc(db->data, db->size + db->block_size);
+		memset(db->data + db->size, 0, db->block_size);
+		db->size += db->block_size;
+	}
+
+	unsigned char* entry = db->data + pos;
+	*(__u32*)(entry + 0) = ino;
+	*(__u16*)(entry + 4) = db->size - pos;
+	entry[6] = name_len;
+	entry[7] = type;
+	memcpy(entry + 8, name, name_len);
+	db->last = pos;
+}
+
+
+/** @brief write a directory to disk
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @param ino directory inode number
+ *  @param db directory contents
+ *  @param links link count
+ *  @param extra_blocks empty blocks appended to the directory
+ *  @return void
+ */
+static void write_dir(fs_state_t* st, image_params_t* p, uint32_t ino,
+                      dir_builder_t* db, int links, uint32_t extra_blocks)
+{
+	struct ext2_inode inode;
+	uint32_t i = 0;
+
+	/* empty blocks hold a single unused entry spanning the block */
+	for (i = 0; i < extra_blocks; i++)
+	{
+		db->data = (unsigned char*)realloc(db->data, db->size + db->block_size);
+		memset(db->data + db->size, 0, db->block_size);
+		*(__u16*)(db->data + db->size + 4) = db->block_size;
+		db->size += db->block_size;
+	}
+
+	if (st->dir_reserve > db->size / st->block_size)
+		st->dir_reserve -= db->size / st->block_size;
+	else
+		st->dir_reserve = 0;
+
+	init_inode(&inode, EXT2_S_IFDIR | 0755);
+	inode.i_links_count = links;
+	inode.i_size = db->size;
+	map_blocks(st, p->frag, &inode, db->size / st->block_size, db->data);
+	write_inode(st, ino, &inode);
+
+	if (st->num_dirs == st->max_dirs)
+	{
+		st->max_dirs = st->max_dirs ? st->max_dirs * 2 : 1024;
+		st->dirs = (uint32_t*)realloc(st->dirs, st->max_dirs * sizeof(uint32_t));
+	}
+	st->dirs[st->num_dirs++] = ino;
+}
+
+
+/** @brief create a regular file with a random size
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @param group preferred group
+ *  @return inode number or 0 if inodes ran out
+ */
+static uint32_t make_file(fs_state_t* st, image_params_t* p, uint32_t group)
+{
+	struct ext2_inode inode;
+	uint32_t ino = alloc_inode(st, group, 0);
+	if (ino == 0)
+		return 0;
+
+	uint64_t size = draw_file_size(p);
+	uint64_t blocks = (size + st->block_size - 1) / st->block_size;
+	/* keep room for the directories still to be written */
+	if (blocks + indirect_overhead(st, blocks) + 64 + st->dir_reserve
+	    > st->free_blocks)
+	{
+		size = 0;
+		blocks = 0;
+		st->num_truncated++;
+	}
+
+	init_inode(&inode, EXT2_S_IFREG | 0644);
+	inode.i_size = size;
+	map_blocks(st, p->frag, &inode, blocks, NULL);
+	write_inode(st, ino, &inode);
+	st->num_files++;
+
+	return ino;
+}
+
+
+/** @brief create a directory and its subtree
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @param parent parent inode number
+ *  @param depth depth of the new directory
+ *  @return inode number or 0 if inodes ran out
+ */
+static uint32_t make_dir(fs_state_t* st, image_params_t* p, uint32_t parent,
+                         int depth)
+{
+	dir_builder_t db = {NULL, 0, 0, st->block_size};
+	char name[32];
+	int i = 0, subdirs = 0;
+
+	/* spread directories over the groups */
+	uint32_t group = st->next_dir_group++ % st->num_groups;
+	uint32_t ino = alloc_inode(st, group, 1);
+	if (ino == 0)
+		return 0;
+	group = (ino - 1) / st->inodes_per_group;
+	st->cursor = group_start(st, group);
+
+	dir_add(&db, ino, ".", EXT2_FT_DIR);
+	dir_add(&db, parent, "..", EXT2_FT_DIR);
+
+	for (i = 0; i < p->files_per_dir; i++)
+	{
+		uint32_t child = make_file(st, p, group);
+		if (child == 0)
+			break;
+		sprintf(name, "f%d", i);
+		dir_add(&db, child, name, EXT2_FT_REG_FILE);
+	}
+	for (i = 0; depth < p->depth && i < p->fanout; i++)
+	{
+		uint32_t child = make_dir(st, p, ino, depth + 1);
+		if (child == 0)
+			break;
+		sprintf(name, "d%d", i);
+		dir_add(&db, child, name, EXT2_FT_DIR);
+		subdirs++;
+	}
+
+	write_dir(st, p, ino, &db, 2 + subdirs, 0);
+	free(db.data);
+	return ino;
+}
+
+
+/** @brief compute the layout of a filesystem and mark its metadata
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @return 0 success or -1 fail
+ */
+static int layout_fs(fs_state_t* st, image_params_t* p)
+{
+	uint32_t g = 0, b = 0;
+	uint32_t bs = p->block_size;
+	uint32_t inodes_per_block = bs / p->inode_size;
+
+	st->block_size = bs;
+	st->inode_size = p->inode_size;
+	st->ptrs_per_block = bs / 4;
+	st->sparse_super = p->sparse_super;
+	st->first_data_block = bs == 1024 ? 1 : 0;
+	st->blocks_per_group = 8 * bs > MAX_BLOCKS_PER_GROUP
+	                       ? MAX_BLOCKS_PER_GROUP : 8 * bs;
+	st->num_blocks = p->fs_size / bs;
+	if ((uint64_t)st->num_blocks * bs != p->fs_size - p->fs_size % bs
+	    || p->fs_size / bs > 0xffffffffULL)
+	{
+		fprintf(stderr, "filesystem too large for %u byte blocks\n", bs);
+		return -1;
+	}
+	st->num_groups = (st->num_blocks - st->first_data_block
+	                  + st->blocks_per_group - 1) / st->blocks_per_group;
+
+	uint32_t num_inodes = p->num_inodes ? p->num_inodes
+	                                    : p->fs_size / DEFAULT_INODE_RATIO;
+	uint32_t ipg = (num_inodes + st->num_groups - 1) / st->num_groups;
+	uint32_t max_ipg = 8 * bs > MAX_BLOCKS_PER_GROUP
+	                   ? MAX_BLOCKS_PER_GROUP : 8 * bs;
+	/* whole inode table blocks, whole bitmap bytes */
+	uint32_t unit = inodes_per_block > 8 ? inodes_per_block : 8;
+	ipg = (ipg + unit - 1) / unit * unit;
+	if (ipg < unit)
+		ipg = unit;
+	if (ipg > max_ipg)
+		ipg = max_ipg / unit * unit;
+	st->inodes_per_group = ipg;
+	st->itable_blocks = ipg / inodes_per_block;
+	st->gdt_blocks = (st->num_groups * sizeof(struct ext2_group_desc)
+	                  + bs - 1) / bs;
+
+	/* drop a last group too small for its own metadata */
+	uint32_t overhead = 1 + st->gdt_blocks + 2 + st->itable_blocks;
+	uint32_t last = st->num_blocks - group_start(st, st->num_groups - 1);
+	if (st->num_groups > 1 && last < overhead + 50)
+	{
+		st->num_groups--;
+		st->num_blocks = group_start(st, st->num_groups);
+		st->gdt_blocks = (st->num_groups * sizeof(struct ext2_group_desc)
+		                  + bs - 1) / bs;
+	}
+	if (st->num_blocks < overhead + 50 + st->first_data_block)
+	{
+		fprintf(stderr, "filesystem too small\n");
+		return -1;
+	}
+	st->num_inodes = ipg * st->num_groups;
+
+	st->block_bitmap = (unsigned char*)calloc(st->num_blocks / 8 + 1, 1);
+	st->inode_bitmap = (unsigned char*)calloc(st->num_inodes / 8 + 1, 1);
+	st->gdt = (struct ext2_group_desc*)calloc(st->gdt_blocks * bs, 1);
+	if (!st->block_bitmap || !st->inode_bitmap || !st->gdt)
+	{
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	st->free_blocks = st->num_blocks - st->first_data_block;
+	st->free_inodes = st->num_inodes;
+	for (g = 0; g < st->num_groups; g++)
+	{
+		uint32_t start = group_start(st, g);
+		uint32_t end = g + 1 < st->num_groups ? group_start(st, g + 1)
+		                                      : st->num_blocks;
+		uint32_t next = start;
+
+		st->gdt[g].bg_free_blocks_count = end - start;
+		st->gdt[g].bg_free_inodes_count = ipg;
+
+		if (group_has_super(st, g))
+		{
+			for (b = 0; b < 1 + st->gdt_blocks; b++)
+				use_block(st, next++);
+		}
+		st->gdt[g].bg_block_bitmap = next;
+		use_block(st, next++);
+		st->gdt[g].bg_inode_bitmap = next;
+		use_block(st, next++);
+		st->gdt[g].bg_inode_table = next;
+		for (b = 0; b < st->itable_blocks; b++)
+			use_block(st, next++);
+	}
+	/* block 0 is the boot block with 1 KiB blocks */
+	if (st->first_data_block)
+		st->block_bitmap[0] |= 1;
+
+	/* reserved inodes */
+	for (b = 1; b < EXT2_GOOD_OLD_FIRST_INO; b++)
+	{
+		uint32_t ino = alloc_inode(st, 0, 0);
+		if (ino != b)
+			return -1;
+	}
+	return 0;
+}
+
+
+/** @brief generate the directory tree of a filesystem
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @return void
+ */
+static void populate_fs(fs_state_t* st, image_params_t* p)
+{
+	struct ext2_inode inode;
+	dir_builder_t root = {NULL, 0, 0, st->block_size};
+	dir_builder_t lf = {NULL, 0, 0, st->block_size};
+	char name[32];
+	int i = 0, subdirs = 1;
+	uint64_t level = 1;
+
+	/* reserve the blocks of every directory of the tree, assuming short
+	 * entries and one partly used block per directory */
+	uint64_t entries = 2 + p->files_per_dir + p->fanout + 1;
+	uint64_t per_dir = (entries * EXT2_DIR_REC_LEN(8) + st->block_size - 1)
+	                   / st->block_size + 1;
+	for (i = 0; i <= p->depth && level < st->num_inodes; i++)
+	{
+		st->dir_reserve += level * per_dir;
+		level *= p->fanout;
+	}
+
+	/* root inode was reserved with the others */
+	st->gdt[0].bg_used_dirs_count++;
+
+	/* lost+found */
+	uint32_t lf_ino = alloc_inode(st, 0, 1);
+	dir_add(&lf, lf_ino, ".", EXT2_FT_DIR);
+	dir_add(&lf, EXT2_ROOT_INO, "..", EXT2_FT_DIR);
+	st->cursor = group_start(st, 0);
+	write_dir(st, p, lf_ino, &lf, 2,
+	          LOST_FOUND_SIZE > st->block_size
+	          ? LOST_FOUND_SIZE / st->block_size - 1 : 1);
+	free(lf.data);
+
+	dir_add(&root, EXT2_ROOT_INO, ".", EXT2_FT_DIR);
+	dir_add(&root, EXT2_ROOT_INO, "..", EXT2_FT_DIR);
+	dir_add(&root, lf_ino, "lost+found", EXT2_FT_DIR);
+
+	for (i = 0; i < p->files_per_dir; i++)
+	{
+		uint32_t child = make_file(st, p, 0);
+		if (child == 0)
+			break;
+		sprintf(name, "f%d", i);
+		dir_add(&root, child, name, EXT2_FT_REG_FILE);
+	}
+	for (i = 0; p->depth > 0 && i < p->fanout; i++)
+	{
+		uint32_t child = make_dir(st, p, EXT2_ROOT_INO, 1);
+		if (child == 0)
+			break;
+		sprintf(name, "d%d", i);
+		dir_add(&root, child, name, EXT2_FT_DIR);
+		subdirs++;
+	}
+
+	st->cursor = group_start(st, 0);
+	write_dir(st, p, EXT2_ROOT_INO, &root, 2 + subdirs, 0);
+	free(root.data);
+
+	/* the bad blocks inode exists but owns nothing */
+	init_inode(&inode, 0);
+	inode.i_links_count = 0;
+	write_inode(st, EXT2_BAD_INO, &inode);
+}
+
+
+/** @brief write superblocks, descriptor tables and bitmaps
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @return void
+ */
+static void write_metadata(fs_state_t* st, image_params_t* p)
+{
+	struct ext2_super_block sbk;
+	unsigned char* buf = (unsigned char*)malloc(st->block_size);
+	uint32_t g = 0, i = 0;
+
+	memset(&sbk, 0, sizeof(sbk));
+	sbk.s_inodes_count = st->num_inodes;
+	sbk.s_blocks_count = st->num_blocks;
+	sbk.s_r_blocks_count = st->num_blocks / 20;
+	sbk.s_free_blocks_count = st->free_blocks;
+	sbk.s_free_inodes_count = st->free_inodes;
+	sbk.s_first_data_block = st->first_data_block;
+	sbk.s_log_block_size = 0;
+	while ((1024u << sbk.s_log_block_size) < st->block_size)
+		sbk.s_log_block_size++;
+	sbk.s_log_frag_size = sbk.s_log_block_size;
+	sbk.s_blocks_per_group = st->blocks_per_group;
+	sbk.s_frags_per_group = st->blocks_per_group;
+	sbk.s_inodes_per_group = st->inodes_per_group;
+	sbk.s_wtime = IMAGE_TIME;
+	sbk.s_max_mnt_count = -1;
+	sbk.s_magic = EXT2_SUPER_MAGIC;
+	sbk.s_state = EXT2_VALID_FS;
+	sbk.s_errors = EXT2_ERRORS_DEFAULT;
+	sbk.s_lastcheck = IMAGE_TIME;
+	sbk.s_rev_level = EXT2_DYNAMIC_REV;
+	sbk.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	sbk.s_inode_size = p->inode_size;
+	sbk.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+	if (st->sparse_super)
+		sbk.s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+	for (i = 0; i < 16; i++)
+		sbk.s_uuid[i] = rng_next() & 0xff;
+	strncpy(sbk.s_volume_name, "mkimage", sizeof(sbk.s_volume_name));
+
+	for (g = 0; g < st->num_groups; g++)
+	{
+		uint32_t start = group_start(st, g);
+
+		if (group_has_super(st, g))
+		{
+			sbk.s_block_group_nr = g;
+			/* the primary superblock always sits at byte 1024 */
+			if (g == 0)
+				fs_write(st, 1024, &sbk, sizeof(sbk));
+			else
+				fs_write(st, (off_t)start * st->block_size, &sbk, sizeof(sbk));
+			/* descriptor table follows in the next block */
+			fs_write(st, (off_t)(start + 1) * st->block_size,
+			         st->gdt, st->gdt_blocks * st->block_size);
+		}
+
+		/* block bitmap, blocks past the end are marked used */
+		memset(buf, 0, st->block_size);
+		for (i = 0; i < 8 * st->block_size; i++)
+		{
+			uint64_t block = (uint64_t)start + i;
+			if (i >= st->blocks_per_group || block >= st->num_blocks
+			    || (st->block_bitmap[block >> 3] & (1 << (block & 7))))
+				buf[i >> 3] |= 1 << (i & 7);
+		}
+		fs_write(st, (off_t)st->gdt[g].bg_block_bitmap * st->block_size,
+		         buf, st->block_size);
+
+		/* inode bitmap */
+		memset(buf, 0, st->block_size);
+		for (i = 0; i < 8 * st->block_size; i++)
+		{
+			uint32_t index = g * st->inodes_per_group + i;
+			if (i >= st->inodes_per_group
+			    || (st->inode_bitmap[index >> 3] & (1 << (index & 7))))
+				buf[i >> 3] |= 1 << (i & 7);
+		}
+		fs_write(st, (off_t)st->gdt[g].bg_inode_bitmap * st->block_size,
+		         buf, st->block_size);
+	}
+	free(buf);
+}
+
+
+/** @brief pick a random generated directory other than the root
+ *
+ *  @param st filesystem state
+ *  @return inode number
+ */
+static uint32_t random_dir(fs_state_t* st)
+{
+	/* dirs[0] is lost+found and the last one is the root */
+	if (st->num_dirs <= 2)
+		return EXT2_ROOT_INO;
+	return st->dirs[1 + rng_below(st->num_dirs - 2)];
+}
+
+
+/** @brief first block of a directory
+ *
+ *  @param st filesystem state
+ *  @param ino directory inode number
+ *  @return block number
+ */
+static uint32_t dir_first_block(fs_state_t* st, uint32_t ino)
+{
+	struct ext2_inode inode;
+	fs_read(st, inode_offset(st, ino), &inode, sizeof(inode));
+	return inode.i_block[0];
+}
+
+
+/** @brief inject the requested corruptions
+ *
+ *  @param st filesystem state
+ *  @param p parameters
+ *  @return void
+ */
+static void corrupt_fs(fs_state_t* st, image_params_t* p)
+{
+	unsigned char* buf = (unsigned char*)malloc(st->block_size);
+	struct ext2_inode inode;
+	int n = 0, tries = 0;
+
+	/* wrong '.' entries */
+	for (n = 0; n < p->corrupt[CORRUPT_DOT]; n++)
+	{
+		uint32_t ino = random_dir(st);
+		off_t off = (off_t)dir_first_block(st, ino) * st->block_size;
+		uint32_t bad = ino + 1 + rng_below(100);
+		fs_write(st, off, &bad, 4);
+		printf("  corrupt: '.' of dir %u set to %u\n", ino, bad);
+	}
+
+	/* wrong '..' entries */
+	for (n = 0; n < p->corrupt[CORRUPT_DOTDOT]; n++)
+	{
+		uint32_t ino = random_dir(st);
+		off_t off = (off_t)dir_first_block(st, ino) * st->block_size;
+		uint32_t bad = random_dir(st);
+		fs_read(st, off, buf, st->block_size);
+		off += *(__u16*)(buf + 4);
+		fs_write(st, off, &bad, 4);
+		printf("  corrupt: '..' of dir %u set to %u\n", ino, bad);
+	}
+
+	/* orphans: merge a random entry into its predecessor */
+	for (n = 0, tries = 0; n < p->corrupt[CORRUPT_ORPHAN]
+	                       && tries < 100 * p->corrupt[CORRUPT_ORPHAN]; tries++)
+	{
+		uint32_t ino = random_dir(st);
+		off_t off = (off_t)dir_first_block(st, ino) * st->block_size;
+		uint32_t pos = 0, prev = 0, count = 0, pick = 0, k = 0;
+
+		fs_read(st, off, buf, st->block_size);
+		for (pos = 0; pos < st->block_size; pos += *(__u16*)(buf + pos + 4))
+			count++;
+		if (count <= 2)
+			continue;
+		pick = 2 + rng_below(count - 2);
+		for (pos = 0, k = 0; k < pick; k++)
+		{
+			prev = pos;
+			pos += *(__u16*)(buf + pos + 4);
+		}
+		if (*(__u32*)(buf + pos) == 0)
+			continue;
+		printf("  corrupt: entry of inode %u removed from dir %u\n",
+		       *(__u32*)(buf + pos), ino);
+		*(__u16*)(buf + prev + 4) += *(__u16*)(buf + pos + 4);
+		fs_write(st, off, buf, st->block_size);
+		n++;
+	}
+
+	/* wrong link counts */
+	for (n = 0, tries = 0; n < p->corrupt[CORRUPT_LINKS]
+	                       && tries < 100 * p->corrupt[CORRUPT_LINKS]; tries++)
+	{
+		uint32_t ino = EXT2_GOOD_OLD_FIRST_INO + 1
+		               + rng_below(st->last_inode - EXT2_GOOD_OLD_FIRST_INO);
+		uint32_t index = ino - 1;
+		if (ino > st->last_inode
+		    || !(st->inode_bitmap[index >> 3] & (1 << (index & 7))))
+			continue;
+		fs_read(st, inode_offset(st, ino), &inode, sizeof(inode));
+		__u16 old = inode.i_links_count;
+		inode.i_links_count = old + 1 + rng_below(3);
+		fs_write(st, inode_offset(st, ino), &inode, sizeof(inode));
+		printf("  corrupt: links of inode %u set from %u to %u\n",
+		       ino, old, inode.i_links_count);
+		n++;
+	}
+
+	/* flipped block bitmap bits */
+	for (n = 0; n < p->corrupt[CORRUPT_BITMAP]; n++)
+	{
+		uint32_t block = st->first_data_block
+		                 + rng_below(st->num_blocks - st->first_data_block);
+		uint32_t g = (block - st->first_data_block) / st->blocks_per_group;
+		uint32_t i = (block - st->first_data_block) % st->blocks_per_group;
+		off_t off = (off_t)st->gdt[g].bg_block_bitmap * st->block_size + i / 8;
+		unsigned char byte = 0;
+		fs_read(st, off, &byte, 1);
+		byte ^= 1 << (i % 8);
+		fs_write(st, off, &byte, 1);
+		printf("  corrupt: bitmap bit of block %u flipped\n", block);
+	}
+
+	free(buf);
+}
+
+
+/** @brief generate one filesystem at an offset of the image
+ *
+ *  @param fd image file descriptor
+ *  @param base byte offset of the partition
+ *  @param p parameters
+ *  @return 0 success or -1 fail
+ */
+static int make_fs(int fd, off_t base, image_params_t* p)
+{
+	fs_state_t st;
+
+	memset(&st, 0, sizeof(st));
+	st.fd = fd;
+	st.base = base;
+
+	if (layout_fs(&st, p) == -1)
+		return -1;
+	populate_fs(&st, p);
+	write_metadata(&st, p);
+	corrupt_fs(&st, p);
+
+	printf("  %u blocks of %u bytes, %u groups, %u inodes\n",
+	       st.num_blocks, st.block_size, st.num_groups, st.num_inodes);
+	printf("  %u dirs, %u files (%u truncated), %u blocks used\n",
+	       st.num_dirs, st.num_files, st.num_truncated,
+	       st.num_blocks - st.first_data_block - st.free_blocks);
+
+	free(st.block_bitmap);
+	free(st.inode_bitmap);
+	free(st.gdt);
+	free(st.dirs);
+	return 0;
+}
+
+
+/** @brief fill a partition table entry
+ *
+ *  @param entry entry to fill
+ *  @param type partition type
+ *  @param start start sector, relative as the table requires
+ *  @param length number of sectors
+ *  @return void
+ */
+static void set_partition(struct partition* entry, int type,
+                          uint32_t start, uint32_t length)
+{
+	memset(entry, 0, sizeof(struct partition));
+	entry->sys_ind = type;
+	entry->start_sect = start;
+	entry->nr_sects = length;
+}
+
+
+/** @brief print usage */
+static void usage()
+{
+	printf("usage: mkimage -o image [-s fs_size] [-b block_size] "
+	       "[-N inodes] [-I inode_size]\n"
+	       "               [-d depth] [-w fanout] [-f files_per_dir] "
+	       "[-z dist] [-r frag%%]\n"
+	       "               [-L logical_partitions] [-S seed] "
+	       "[-c corruptions] [-n]\n"
+	       "  dist: fixed:SIZE, uniform:MIN:MAX or exp:MEAN\n"
+	       "  corruptions: dot=N,dotdot=N,orphan=N,links=N,bitmap=N\n"
+	       "  -n: no sparse_super, superblock backup in every group\n");
+}
+
+
+/** @brief main function */
+int main(int argc, char** argv)
+{
+	image_params_t p;
+	int opt = 0, i = 0;
+
+	memset(&p, 0, sizeof(p));
+	p.fs_size = 64ULL << 20;
+	p.block_size = 1024;
+	p.inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+	p.depth = 3;
+	p.fanout = 4;
+	p.files_per_dir = 8;
+	p.dist = DIST_EXP;
+	p.size_a = 16 << 10;
+	p.num_logical = 1;
+	p.seed = 1;
+	p.sparse_super = 1;
+
+	while ((opt = getopt(argc, argv, "o:s:b:N:I:d:w:f:z:r:L:S:c:nh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o': p.output = optarg; break;
+			case 's': p.fs_size = parse_size(optarg); break;
+			case 'b': p.block_size = atoi(optarg); break;
+			case 'N': p.num_inodes = strtoul(optarg, NULL, 10); break;
+			case 'I': p.inode_size = atoi(optarg); break;
+			case 'd': p.depth = atoi(optarg); break;
+			case 'w': p.fanout = atoi(optarg); break;
+			case 'f': p.files_per_dir = atoi(optarg); break;
+			case 'r': p.frag = atoi(optarg); break;
+			case 'L': p.num_logical = atoi(optarg); break;
+			case 'S': p.seed = strtoull(optarg, NULL, 10); break;
+			case 'n': p.sparse_super = 0; break;
+			case 'z':
+				if (parse_dist(optarg, &p) == -1)
+				{
+					printf("invalid size distribution %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'c':
+				if (parse_corrupt(optarg, &p) == -1)
+				{
+					printf("invalid corruption list\n");
+					exit(-1);
+				}
+				break;
+			default:
+				usage();
+				exit(-1);
+		}
+	}
+
+	if (p.output == NULL || p.block_size < 1024 || p.block_size > 65536
+	    || (p.block_size & (p.block_size - 1)) || p.inode_size < 128
+	    || p.inode_size > p.block_size || (p.inode_size & (p.inode_size - 1))
+	    || p.num_logical < 0 || p.frag < 0 || p.frag > 100)
+	{
+		usage();
+		exit(-1);
+	}
+	rng_state = p.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	/* partitions are aligned and sized in whole sectors */
+	p.fs_size -= p.fs_size % p.block_size;
+	uint64_t fs_sectors = p.fs_size / SECTOR_SIZE;
+	uint64_t slot = (fs_sectors + PARTITION_ALIGN - 1)
+	                / PARTITION_ALIGN * PARTITION_ALIGN;
+	uint64_t ext_start = PARTITION_ALIGN + slot;
+	uint64_t total = ext_start + p.num_logical * (PARTITION_ALIGN + slot);
+	if (total > 0xffffffffULL)
+	{
+		printf("image too large for an MBR partition table\n");
+		exit(-1);
+	}
+
+	int fd = open(p.output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, total * SECTOR_SIZE) == -1)
+	{
+		perror("Could not create image");
+		exit(-1);
+	}
+
+	/* master boot record */
+	unsigned char mbr[SECTOR_SIZE];
+	memset(mbr, 0, sizeof(mbr));
+	set_partition((struct partition*)(mbr + 0x1be), LINUX_EXT2_PARTITION,
+	              PARTITION_ALIGN, fs_sectors);
+	if (p.num_logical > 0)
+		set_partition((struct partition*)(mbr + 0x1be + 16),
+		              DOS_EXTENDED_PARTITION, ext_start, total - ext_start);
+	mbr[510] = 0x55;
+	mbr[511] = 0xaa;
+	pwrite(fd, mbr, SECTOR_SIZE, 0);
+
+	printf("partition 1\n");
+	if (make_fs(fd, (off_t)PARTITION_ALIGN * SECTOR_SIZE, &p) == -1)
+		exit(-1);
+
+	/* chain of extended boot records */
+	for (i = 0; i < p.num_logical; i++)
+	{
+		uint64_t ebr_sec = ext_start + i * (PARTITION_ALIGN + slot);
+		unsigned char ebr[SECTOR_SIZE];
+
+		memset(ebr, 0, sizeof(ebr));
+		set_partition((struct partition*)(ebr + 0x1be), LINUX_EXT2_PARTITION,
+		              PARTITION_ALIGN, fs_sectors);
+		if (i + 1 < p.num_logical)
+			set_partition((struct partition*)(ebr + 0x1be + 16),
+			              DOS_EXTENDED_PARTITION,
+			              ebr_sec + PARTITION_ALIGN + slot - ext_start,
+			              PARTITION_ALIGN + slot);
+		ebr[510] = 0x55;
+		ebr[511] = 0xaa;
+		pwrite(fd, ebr, SECTOR_SIZE, (off_t)ebr_sec * SECTOR_SIZE);
+
+		printf("partition %d\n", 5 + i);
+		if (make_fs(fd, (off_t)(ebr_sec + PARTITION_ALIGN) * SECTOR_SIZE,
+		            &p) == -1)
+			exit(-1);
+	}
+
+	close(fd);
+	return 0;
+}
+
@@ -4,17 +4,29 @@
  *   This file contains main function for myfsck program
  */
 
+#define _GNU_SOURCE  /* O_DIRECT */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
 
 #include "genhd.h"
 #include "ext2_fs.h"
 #include "fsck.h"
+#include "stats.h"
+#include "trace.h"
+#include "latency.h"
+#include "problem.h"
+#include "checkpoint.h"
+#include "incremental.h"
+#include "readwrite.h"
+#include "batch.h"
+#include "mapstore.h"
 
 int disk;  /* file descriptor of disk image*/
 
@@ -22,19 +34,55 @@ int disk;  /* file descriptor of disk image*/
 int main (int argc, char **argv)
 {
 	char* disk_name = NULL;
+	char* record_path = NULL;
+	char* stats_format = NULL;
+	char* stats_path = NULL;
+	char* trace_path = NULL;
+	int want_stats = 0;
+	char* ckpt_path = NULL;
+	int resume = 0;
+	int direct = 0;
+	char* batch_path = NULL;
+	int single_only = 0;  /* options of a check of one image */
 	int prt_partition_num = -1;
 	int fix_partition_num = -1;
 	int i = 0;
 
+	problem_init();
 	if(argc == 1)
 	{
 		printf("invalid arguments\n");
 		exit(-1);
 	}
 
+	/* long options without a short form */
+	static struct option long_opts[] =
+	{
+		{"stats",         optional_argument, NULL, 'S'},
+		{"stats-file",    required_argument, NULL, 'O'},
+		{"trace",         required_argument, NULL, 'T'},
+		{"latency",       no_argument,       NULL, 'L'},
+		{"problems-file", required_argument, NULL, 'P'},
+		{"problem-limit", required_argument, NULL, 'M'},
+		{"checkpoint",    required_argument, NULL, 'C'},
+		{"checkpoint-interval", required_argument, NULL, 'I'},
+		{"resume",        no_argument,       NULL, 'R'},
+		{"incremental",   required_argument, NULL, 'N'},
+		{"direct",        no_argument,       NULL, 'D'},
+		{"paranoid",      no_argument,       NULL, 'A'},
+		{"batch",         required_argument, NULL, 'X'},
+		{"workers",       required_argument, NULL, 'W'},
+		{"mem-budget",    required_argument, NULL, 'G'},
+		{"batch-logs",    required_argument, NULL, 'E'},
+		{"mem-limit",     required_argument, NULL, 'Y'},
+		{NULL, 0, NULL, 0}
+	};
+
 	int opt;
-	while((opt = getopt(argc, argv, ":i:p:f:")) != -1)
+	while((opt = getopt_long(argc, argv, ":i:p:f:B:", long_opts, NULL)) != -1)
 	{
+		if (strchr("ipfBSOTLPCIRN", opt) != NULL)
+			single_only = 1;
 		switch(opt)
 		{
 			case 'i':
@@ -46,6 +94,79 @@ int main (int argc, char **argv)
 			case 'f':
 				fix_partition_num = atoi(optarg);
 				break;
+			case 'B':
+				/* append a benchmark record per checked partition */
+				record_path = optarg;
+				break;
+			case 'S':
+				/* --stats[=text|prom|json], report at exit */
+				want_stats = 1;
+				stats_format = optarg;
+				break;
+			case 'O':
+				stats_path = optarg;
+				break;
+			case 'T':
+				/* record every disk access for tracereplay */
+				trace_path = optarg;
+				break;
+			case 'L':
+				/* time every request, print percentiles at exit */
+				latency_enable();
+				break;
+			case 'P':
+				/* every problem found goes to this file */
+				if (problem_set_detail(optarg) == -1)
+					exit(-1);
+				break;
+			case 'M':
+				/* lines printed per problem category, -1 for all */
+				problem_set_limit(atoi(optarg));
+				break;
+			case 'C':
+				/* save the state of the check to this file */
+				ckpt_path = optarg;
+				break;
+			case 'I':
+				/* seconds between checkpoints */
+				ckpt_set_interval(atoi(optarg));
+				break;
+			case 'R':
+				/* continue from the state in the checkpoint file */
+				resume = 1;
+				break;
+			case 'N':
+				/* skip groups unchanged since the last check */
+				incr_set_db(optarg);
+				break;
+			case 'D':
+				/* bypass the page cache */
+				direct = 1;
+				break;
+			case 'A':
+				/* read every inode slot, trust no bitmap */
+				fsck_set_paranoid();
+				break;
+			case 'X':
+				/* check every image of a manifest */
+				batch_path = optarg;
+				break;
+			case 'W':
+				/* images checked at once in batch mode */
+				batch_set_workers(atoi(optarg));
+				break;
+			case 'G':
+				/* megabytes the checks of a batch may take together */
+				batch_set_budget(atol(optarg));
+				break;
+			case 'E':
+				/* directory keeping the output of each batch check */
+				batch_set_logs(optarg);
+				break;
+			case 'Y':
+				/* megabytes of maps kept in memory, the rest in files */
+				mstore_set_limit(atol(optarg));
+				break;
 			case ':':
 				printf("\nmissing arguments after -%c\n", optopt);
 				exit(-1);
@@ -57,13 +178,43 @@ int main (int argc, char **argv)
 		}
 	}
 
-	/* open the disk file */
-	if((disk = open(disk_name, O_RDWR, S_IRUSR|S_IWUSR)) == -1)
+	if (batch_path != NULL)
+	{
+		if (single_only)
+		{
+			printf("--batch takes the images from the manifest and only "
+			       "combines with -M, --direct, --paranoid and --mem-limit\n");
+			exit(-1);
+		}
+		int failed = batch_run(batch_path, direct);
+		exit(failed == 0 ? 0 : -1);
+	}
+
+	if (resume && ckpt_path == NULL)
 	{
-		perror("Could not open disk file!");
+		printf("--resume needs --checkpoint=PATH\n");
 		exit(-1);
 	}
+	if (ckpt_path != NULL)
+		ckpt_set_file(ckpt_path);
+	if (resume)
+		ckpt_set_resume();
+	if (fix_partition_num == 0)
+		ckpt_set_whole_disk();
+
+	/* open the disk file */
+	if (disk_open(disk_name, direct) == -1)
+		exit(-1);
 	
+	stats_set_record(record_path, disk_name);
+	if (want_stats && stats_set_report(stats_format, stats_path) == -1)
+	{
+		printf("unknown statistics format %s\n", stats_format);
+		exit(-1);
+	}
+	if (trace_path != NULL && trace_open(trace_path) == -1)
+		exit(-1);
+
 	partition_t pt_info;
 	/* print partition information */
 	if(prt_partition_num > 0)
@@ -74,14 +225,15 @@ int main (int argc, char **argv)
 			close(disk);
 			exit(-1);
 		}
-		printf("0x%02X %d %d\n", pt_info.type, pt_info.start_sec, 
+		printf("0x%02X %u %u\n", pt_info.type, pt_info.start_sec, 
 		                         pt_info.length);
 	}
 	if(fix_partition_num >= 0)
 	{
+		int failed = 0;
 		if (fix_partition_num > 0)
 		{
-			fix_fs(fix_partition_num);
+			failed = fix_fs(fix_partition_num) == -1;
 		}
 		else if (fix_partition_num == 0)
 		{
@@ -90,13 +242,21 @@ int main (int argc, char **argv)
 			{
 				if (read_partition_info(i, &pt_info) == -1)
 					break;
-				if (pt_info.type == 0x83)
-					fix_fs(i);
+				if (pt_info.type == 0x83 && fix_fs(i) == -1)
+					failed = 1;
 				i++;
 			}
 		}
+		/* every check finished, nothing to resume. A failed check
+		 * keeps the state file to resume from. */
+		if (!failed)
+			ckpt_finish();
 	}
 
+	stats_report();
+	latency_report(stdout);
+	trace_close();
+	problem_close();
 	close(disk);
 	return 0;
 }
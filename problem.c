@@ -0,0 +1,195 @@
+/** @file problem.c
+ *  @brief This module contains the log of problems found and fixed
+ *
+ *   Every problem is counted in its category. Only the first few of
+ *   each category are printed, the rest is summed up at the end of the
+ *   check, so a badly damaged image does not drown the terminal. With a
+ *   detail file set, every problem is written there as well. Both
+ *   outputs go through large buffers, and a lock keeps the counters and
+ *   lines consistent when several threads report.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "problem.h"
+
+static const char* problem_names[PR_NUM] =
+	{"dot", "dotdot", "unref", "lookup", "link_count", "block_bitmap",
+	 "dup_block", "dir_entry"};
+static const char* problem_descs[PR_NUM] =
+	{"wrong \".\" entries", "wrong \"..\" entries",
+	 "unreferenced inodes", "failed path lookups", "wrong link counts",
+	 "wrong block bitmap bits", "multiply-claimed blocks",
+	 "bad directory entries"};
+
+/** problems of the running check per category */
+static long counts[PR_NUM];
+/** problems of the checks finished since the totals were taken */
+static long totals[PR_NUM];
+/** lines printed per category, negative for no limit */
+static int limit = PROBLEM_DEFAULT_LIMIT;
+/** file receiving every problem or NULL */
+static FILE* detail_fp = NULL;
+/** partition being checked */
+static int cur_partition = 0;
+
+static pthread_mutex_t problem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** @brief buffer standard output. Must run before anything is printed.
+ *
+ *  @return void
+ */
+void problem_init()
+{
+	setvbuf(stdout, NULL, _IOFBF, PROBLEM_BUF_SIZE);
+}
+
+
+/** @brief write every problem to a file
+ *
+ *  @param path detail file
+ *  @return 0 success or -1 fail
+ */
+int problem_set_detail(const char* path)
+{
+	if ((detail_fp = fopen(path, "w")) == NULL)
+	{
+		perror("Could not open problem file");
+		return -1;
+	}
+	setvbuf(detail_fp, NULL, _IOFBF, PROBLEM_BUF_SIZE);
+	return 0;
+}
+
+
+/** @brief set how many problems of a category are printed
+ *
+ *  @param n number of lines, negative for all
+ *  @return void
+ */
+void problem_set_limit(int n)
+{
+	limit = n;
+}
+
+
+/** @brief clear the counters for the check of a partition
+ *
+ *  @param partition_num partition number
+ *  @return void
+ */
+void problem_begin_check(int partition_num)
+{
+	pthread_mutex_lock(&problem_lock);
+	memset(counts, 0, sizeof(counts));
+	cur_partition = partition_num;
+	pthread_mutex_unlock(&problem_lock);
+}
+
+
+/** @brief report a problem
+ *
+ *  @param category PR_* category
+ *  @param fmt printf format of the message
+ *  @return void
+ */
+void problem_report(int category, const char* fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&problem_lock);
+	long n = ++counts[category];
+	if (detail_fp != NULL)
+		fprintf(detail_fp, "%d %s: %s\n", cur_partition,
+		        problem_names[category], msg);
+	if (limit < 0 || n <= limit)
+		printf("%s\n", msg);
+	else if (n == limit + 1)
+		printf("further %s are only counted\n", problem_descs[category]);
+	pthread_mutex_unlock(&problem_lock);
+}
+
+
+/** @brief print the number of problems of each category found in the
+ *   check and flush the outputs
+ *
+ *  @return void
+ */
+void problem_end_check()
+{
+	long total = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&problem_lock);
+	for (i = 0; i < PR_NUM; i++)
+	{
+		total += counts[i];
+		totals[i] += counts[i];
+	}
+	if (total > 0)
+	{
+		printf("problems found in partition %d:\n", cur_partition);
+		for (i = 0; i < PR_NUM; i++)
+			if (counts[i] > 0)
+				printf("  %-26s %ld\n", problem_descs[i], counts[i]);
+	}
+	fflush(stdout);
+	if (detail_fp != NULL)
+		fflush(detail_fp);
+	pthread_mutex_unlock(&problem_lock);
+}
+
+
+/** @brief take the problems per category of the checks finished since
+ *   the last call
+ *
+ *  @param out array of PR_NUM counters
+ *  @return void
+ */
+void problem_totals(long* out)
+{
+	pthread_mutex_lock(&problem_lock);
+	memcpy(out, totals, sizeof(totals));
+	memset(totals, 0, sizeof(totals));
+	pthread_mutex_unlock(&problem_lock);
+}
+
+
+/** @brief description of a category for reports
+ *
+ *  @param category PR_* category
+ *  @return description
+ */
+const char* problem_desc(int category)
+{
+	return problem_descs[category];
+}
+
+
+/** @brief close the detail file
+ *
+ *  @return void
+ */
+void problem_close()
+{
+	if (detail_fp != NULL && fclose(detail_fp) != 0)
+		perror("Could not write problem file");
+	detail_fp = NULL;
+}
+
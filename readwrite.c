@@ -5,6 +5,7 @@
  *  @bug: No bugs found yet
  */
 
+#define _GNU_SOURCE  /* SEEK_DATA, SEEK_HOLE, O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,12 +15,325 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <errno.h>
 #include "genhd.h"
 #include "ext2_fs.h"
 #include "readwrite.h"
+#include "stats.h"
+#include "trace.h"
+#include "latency.h"
+#include "incremental.h"
+#include "icache.h"
 
 extern int disk;
 
+/** @brief an aligned chunk of the disk in the O_DIRECT cache */
+typedef struct dio_chunk
+{
+	long index;               /* chunk number, -1 when empty */
+	int valid;                /* bytes read, short at the end of the disk */
+	unsigned long last_use;
+	unsigned char* data;
+} dio_chunk_t;
+
+/** @brief a range of the disk file holding data */
+typedef struct data_extent
+{
+	long start;
+	long end;
+} data_extent_t;
+
+/** data ranges of the disk file, sorted, the rest are holes */
+static data_extent_t* extents = NULL;
+static int num_extents = 0;
+static int max_extents = 0;
+/** size of the disk file, 0 when holes are unknown */
+static long disk_end = 0;
+
+/** requests bypass the page cache */
+static int direct = 0;
+static dio_chunk_t dio_cache[DIO_CACHE_CHUNKS];
+static unsigned char* dio_mem = NULL;
+static unsigned long dio_clock = 0;
+
+
+/** @brief serve requests through aligned chunks, for a disk opened
+ *   with O_DIRECT. The chunks are allocated once and emptied for
+ *   every disk opened after.
+ *
+ *  @return 0 success or -1 fail
+ */
+int direct_io_enable()
+{
+	int i = 0;
+
+	if (dio_mem == NULL &&
+	    posix_memalign((void**)&dio_mem, DIO_ALIGN,
+	                   (long)DIO_CHUNK * DIO_CACHE_CHUNKS) != 0)
+	{
+		dio_mem = NULL;
+		return -1;
+	}
+	for (i = 0; i < DIO_CACHE_CHUNKS; i++)
+	{
+		dio_cache[i].index = -1;
+		dio_cache[i].valid = 0;
+		dio_cache[i].last_use = 0;
+		dio_cache[i].data = dio_mem + (long)i * DIO_CHUNK;
+	}
+	direct = 1;
+	return 0;
+}
+
+
+/** @brief open a disk image as the disk being checked and map its
+ *   holes
+ *
+ *  @param path disk image
+ *  @param use_direct bypass the page cache when the image allows it
+ *  @return 0 success or -1 fail
+ */
+int disk_open(const char* path, int use_direct)
+{
+	direct = 0;
+	if (use_direct && (disk = open(path, O_RDWR | O_DIRECT)) != -1)
+	{
+		if (direct_io_enable() == -1)
+		{
+			printf("allocating O_DIRECT buffers failed\n");
+			close(disk);
+			return -1;
+		}
+	}
+	else
+	{
+		if (use_direct)
+			perror("O_DIRECT not available, using buffered I/O");
+		if ((disk = open(path, O_RDWR, S_IRUSR|S_IWUSR)) == -1)
+		{
+			perror("Could not open disk file!");
+			return -1;
+		}
+	}
+	/* holes of a sparse image read as zeros without I/O */
+	hole_map_build();
+	return 0;
+}
+
+
+/** @brief get a chunk from the cache, reading it on a miss into the
+ *   least recently used slot
+ *
+ *  @param index chunk number
+ *  @return the chunk
+ */
+static dio_chunk_t* dio_get(long index)
+{
+	dio_chunk_t* victim = &dio_cache[0];
+	int i = 0;
+
+	for (i = 0; i < DIO_CACHE_CHUNKS; i++)
+	{
+		if (dio_cache[i].index == index)
+		{
+			dio_cache[i].last_use = ++dio_clock;
+			stats_count_dio(1);
+			return &dio_cache[i];
+		}
+		if (dio_cache[i].last_use < victim->last_use)
+			victim = &dio_cache[i];
+	}
+
+	stats_count_dio(0);
+	ssize_t n = pread(disk, victim->data, DIO_CHUNK, index * DIO_CHUNK);
+	if (n < 0)
+	{
+		printf("Read disk failed at chunk %ld\n", index);
+		exit(-1);
+	}
+	victim->index = index;
+	victim->valid = n;
+	victim->last_use = ++dio_clock;
+	return victim;
+}
+
+
+/** @brief read bytes through the chunk cache
+ *
+ *  @param base byte offset
+ *  @param buf destination
+ *  @param buf_len number of bytes
+ *  @return void
+ */
+static void dio_read(long base, unsigned char* buf, int buf_len)
+{
+	while (buf_len > 0)
+	{
+		dio_chunk_t* c = dio_get(base / DIO_CHUNK);
+		int off = base % DIO_CHUNK;
+		int len = DIO_CHUNK - off < buf_len ? DIO_CHUNK - off : buf_len;
+		if (off + len > c->valid)
+		{
+			printf("Read disk failed in read_bytes\n");
+			exit(-1);
+		}
+		memcpy(buf, c->data + off, len);
+		buf += len;
+		base += len;
+		buf_len -= len;
+	}
+}
+
+
+/** @brief write bytes through the chunk cache. The cached chunk is
+ *   updated and the aligned span around the bytes written out.
+ *
+ *  @param base byte offset
+ *  @param buf source
+ *  @param buf_len number of bytes
+ *  @return void
+ */
+static void dio_write(long base, const unsigned char* buf, int buf_len)
+{
+	while (buf_len > 0)
+	{
+		dio_chunk_t* c = dio_get(base / DIO_CHUNK);
+		int off = base % DIO_CHUNK;
+		int len = DIO_CHUNK - off < buf_len ? DIO_CHUNK - off : buf_len;
+		int start = off / DIO_ALIGN * DIO_ALIGN;
+		int end = (off + len + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+		if (end > c->valid)
+		{
+			printf("Write disk failed in write_bytes\n");
+			exit(-1);
+		}
+		memcpy(c->data + off, buf, len);
+		if (pwrite(disk, c->data + start, end - start,
+		           c->index * DIO_CHUNK + start) != end - start)
+		{
+			printf("Write disk failed in write_bytes\n");
+			exit(-1);
+		}
+		buf += len;
+		base += len;
+		buf_len -= len;
+	}
+}
+
+
+/** @brief add a data range to the hole map, merging it with the
+ *   ranges it touches
+ *
+ *  @param start first byte
+ *  @param end byte after the last one
+ *  @return 0 success or -1 fail
+ */
+static int add_extent(long start, long end)
+{
+	int lo = 0, hi = 0;
+
+	/* ranges before the new one, and up to the last touching it */
+	while (lo < num_extents && extents[lo].end < start)
+		lo++;
+	hi = lo;
+	while (hi < num_extents && extents[hi].start <= end)
+		hi++;
+
+	if (hi > lo)
+	{
+		/* merge extents lo..hi-1 into one */
+		if (extents[lo].start < start)
+			start = extents[lo].start;
+		if (extents[hi-1].end > end)
+			end = extents[hi-1].end;
+		memmove(extents + lo + 1, extents + hi,
+		        (num_extents - hi) * sizeof(data_extent_t));
+		num_extents -= hi - lo - 1;
+	}
+	else
+	{
+		if (num_extents == max_extents)
+		{
+			int n = max_extents > 0 ? max_extents * 2 : 64;
+			data_extent_t* p = (data_extent_t*)
+			   realloc(extents, n * sizeof(data_extent_t));
+			if (p == NULL)
+				return -1;
+			extents = p;
+			max_extents = n;
+		}
+		memmove(extents + lo + 1, extents + lo,
+		        (num_extents - lo) * sizeof(data_extent_t));
+		num_extents++;
+	}
+	extents[lo].start = start;
+	extents[lo].end = end;
+	return 0;
+}
+
+
+/** @brief find the holes of a sparse disk file with SEEK_DATA and
+ *   SEEK_HOLE. Reads falling in a hole are answered with zeros.
+ *
+ *  @return number of data ranges or -1 if holes are not supported
+ */
+int hole_map_build()
+{
+	long end = lseek64(disk, 0, SEEK_END);
+	long pos = 0, data = 0, hole = 0;
+
+	num_extents = 0;
+	disk_end = 0;
+	if (end <= 0)
+		return -1;
+	while (pos < end)
+	{
+		if ((data = lseek64(disk, pos, SEEK_DATA)) < 0)
+		{
+			/* ENXIO: only a hole is left */
+			if (errno == ENXIO)
+				break;
+			num_extents = 0;
+			return -1;
+		}
+		if ((hole = lseek64(disk, data, SEEK_HOLE)) < 0)
+			hole = end;
+		if (add_extent(data, hole) == -1)
+		{
+			num_extents = 0;
+			return -1;
+		}
+		pos = hole;
+	}
+	disk_end = end;
+	return num_extents;
+}
+
+
+/** @brief check if a range of the disk is all in a hole
+ *
+ *  @param offset byte offset
+ *  @param length length in bytes
+ *  @return 1 hole or 0 data or unknown
+ */
+int is_hole(long offset, long length)
+{
+	int lo = 0, hi = num_extents;
+
+	if (disk_end == 0 || offset + length > disk_end)
+		return 0;
+	/* first data range ending after the offset */
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (extents[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo == num_extents || extents[lo].start >= offset + length;
+}
+
 
 /** @brief read bytes from disk
  *  
@@ -31,18 +345,33 @@ void read_bytes(long base, void* buf, int buf_len)
 {
 	int ret;
 	long lret;
+	uint64_t start = latency_start();
 	
-	if((lret = lseek64(disk, base, SEEK_SET)) != base)
+	/* never written, zero without asking the disk */
+	if (is_hole(base, buf_len))
 	{
-		printf("Seek to position %ld failed:\n", base);
-		exit(-1);
+		memset(buf, 0, buf_len);
+		return;
 	}
-  
-	if((ret = read(disk, buf, buf_len)) != buf_len)
+	if (direct)
+		dio_read(base, (unsigned char*)buf, buf_len);
+	else
 	{
-		printf("Read disk failed in read_bytes\n");
-		exit(-1);
+		if((lret = lseek64(disk, base, SEEK_SET)) != base)
+		{
+			printf("Seek to position %ld failed:\n", base);
+			exit(-1);
+		}
+	  
+		if((ret = read(disk, buf, buf_len)) != buf_len)
+		{
+			printf("Read disk failed in read_bytes\n");
+			exit(-1);
+		}
 	}
+	latency_end(LAT_READ, base, start);
+	stats_count_read(base, buf_len);
+	trace_access(TRACE_READ, base, buf_len);
 }
 
 
@@ -56,17 +385,31 @@ void write_bytes(long base, void* buf, int buf_len)
 {
 	int ret;
 	long lret;
+	uint64_t start = latency_start();
 
-	if(base != (lret = lseek(disk, base, SEEK_SET)))
+	if (direct)
+		dio_write(base, (unsigned char*)buf, buf_len);
+	else
 	{
-		printf("Seek to position %ld failed:\n", base);
-		exit(-1);
-	}
-	if(buf_len != (ret = write(disk, buf, buf_len)))
-	{
-		printf("Write disk failed in write_bytes\n");
-		exit(-1);
+		if(base != (lret = lseek(disk, base, SEEK_SET)))
+		{
+			printf("Seek to position %ld failed:\n", base);
+			exit(-1);
+		}
+		if(buf_len != (ret = write(disk, buf, buf_len)))
+		{
+			printf("Write disk failed in write_bytes\n");
+			exit(-1);
+		}
 	}
+	latency_end(LAT_WRITE, base, start);
+	stats_count_write(base, buf_len);
+	trace_access(TRACE_WRITE, base, buf_len);
+	incr_note_write(base, buf_len);
+	icache_note_write(base, buf, buf_len);
+	/* the range holds data now */
+	if (disk_end != 0 && add_extent(base, base + buf_len) == -1)
+		disk_end = 0;
 }
 
 
@@ -80,7 +423,16 @@ void read_sector(long sector, void *into, int buf_len)
 {
   	int ret;
   	long lret;
+  	uint64_t start = latency_start();
   	
+  	if (direct)
+  	{
+  		dio_read(sector * SECTOR_SIZE, (unsigned char*)into, buf_len);
+  		latency_end(LAT_READ, sector * SECTOR_SIZE, start);
+  		stats_count_sector_read(sector * SECTOR_SIZE, buf_len);
+  		trace_access(TRACE_READ, sector * SECTOR_SIZE, buf_len);
+  		return;
+  	}
   	if ((lret = lseek64(disk, sector * SECTOR_SIZE, SEEK_SET)) 
       	!= sector * SECTOR_SIZE) 
   	{
@@ -92,6 +444,9 @@ void read_sector(long sector, void *into, int buf_len)
     	printf("read disk failed in read_sector\n");
     	exit(-1);
   	}
+  	latency_end(LAT_READ, sector * SECTOR_SIZE, start);
+  	stats_count_sector_read(sector * SECTOR_SIZE, buf_len);
+  	trace_access(TRACE_READ, sector * SECTOR_SIZE, buf_len);
 }
 
 
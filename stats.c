@@ -0,0 +1,650 @@
+/** @file stats.c
+ *  @brief This module contains timers and I/O counters for each phase
+ *   of a check
+ *
+ *   readwrite.c reports every request here and fix_fs brackets each of
+ *   its passes with phase_begin/phase_end. Requests are counted per
+ *   call type, and the blocks of the checked filesystem they cover are
+ *   tracked in a bitmap, so re-reads of a block show up as the hits a
+ *   cache holding the whole filesystem would serve. The caches in
+ *   front of the disk report their own hits and misses.
+ *
+ *   When a check ends its counters are kept. With a record file set,
+ *   one flat JSON object per check is appended to it, which is what the
+ *   benchmark harness collects. With a report format set, all checks
+ *   are written as text, a Prometheus textfile or JSON at exit.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "stats.h"
+
+static const char* phase_names[NUM_PHASES] =
+	{"init", "traverse", "unref", "retraverse", "links", "blockmap"};
+
+/** counters of the running check */
+static check_stats_t cur;
+/** phase being timed or -1 */
+static int cur_phase = -1;
+static double phase_wall_start = 0;
+static double phase_cpu_start = 0;
+static double check_wall_start = 0;
+static double check_cpu_start = 0;
+
+/** blocks of the checked filesystem touched so far */
+static unsigned char* touched = NULL;
+static long fs_base = 0;
+static int fs_block_size = 0;
+static unsigned int fs_num_blocks = 0;
+
+/** finished checks */
+static check_stats_t* checks = NULL;
+static int num_checks = 0;
+
+/** where to append records and the image they describe */
+static const char* record_path = NULL;
+static const char* record_image = NULL;
+
+/** report printed at exit */
+static int report_format = STATS_NONE;
+static const char* report_path = NULL;
+
+
+/** @brief read a clock in seconds
+ *
+ *  @param clock_id clock to read
+ *  @return double
+ */
+static double clock_seconds(clockid_t clock_id)
+{
+	struct timespec ts;
+	clock_gettime(clock_id, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** @brief set the file records are appended to
+ *
+ *  @param path record file or NULL for none
+ *  @param image image name stored in each record
+ *  @return void
+ */
+void stats_set_record(const char* path, const char* image)
+{
+	record_path = path;
+	record_image = image;
+}
+
+
+/** @brief set the report written at exit
+ *
+ *  @param format "text", "prom" or "json"
+ *  @param path report file or NULL for stdout
+ *  @return 0 success or -1 unknown format
+ */
+int stats_set_report(const char* format, const char* path)
+{
+	if (format == NULL || strcmp(format, "text") == 0)
+		report_format = STATS_TEXT;
+	else if (strcmp(format, "prom") == 0)
+		report_format = STATS_PROM;
+	else if (strcmp(format, "json") == 0)
+		report_format = STATS_JSON;
+	else
+		return -1;
+
+	report_path = path;
+	return 0;
+}
+
+
+/** @brief clear all counters and start timing a new check in the
+ *   init phase
+ *
+ *  @return void
+ */
+void stats_reset()
+{
+	memset(&cur, 0, sizeof(cur));
+	cur_phase = -1;
+	free(touched);
+	touched = NULL;
+	fs_num_blocks = 0;
+
+	check_wall_start = clock_seconds(CLOCK_MONOTONIC);
+	check_cpu_start = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	phase_begin(PHASE_INIT);
+}
+
+
+/** @brief start tracking the blocks touched in a filesystem
+ *
+ *  @param base byte offset of the filesystem on disk
+ *  @param block_size block size
+ *  @param num_blocks number of blocks
+ *  @return void
+ */
+void stats_track_blocks(long base, int block_size, unsigned int num_blocks)
+{
+	free(touched);
+	touched = (unsigned char*)calloc((num_blocks + 7) / 8, 1);
+	fs_base = base;
+	fs_block_size = block_size;
+	fs_num_blocks = touched != NULL ? num_blocks : 0;
+}
+
+
+/** @brief start timing a phase, ending the running one
+ *
+ *  @param phase PHASE_* number
+ *  @return void
+ */
+void phase_begin(int phase)
+{
+	if (cur_phase >= 0)
+		phase_end(cur_phase);
+
+	cur_phase = phase;
+	phase_wall_start = clock_seconds(CLOCK_MONOTONIC);
+	phase_cpu_start = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+/** @brief stop timing a phase
+ *
+ *  @param phase PHASE_* number
+ *  @return void
+ */
+void phase_end(int phase)
+{
+	if (cur_phase != phase)
+		return;
+
+	cur.phases[phase].wall += clock_seconds(CLOCK_MONOTONIC)
+	                          - phase_wall_start;
+	cur.phases[phase].cpu += clock_seconds(CLOCK_PROCESS_CPUTIME_ID)
+	                         - phase_cpu_start;
+	cur_phase = -1;
+}
+
+
+/** @brief get the phase being timed
+ *
+ *  @return PHASE_* number or -1 between phases
+ */
+int stats_phase()
+{
+	return cur_phase;
+}
+
+
+/** @brief add to a counter of the check and of the running phase
+ *
+ *  @param field offset of the counter in io_counters_t
+ *  @param n amount to add
+ *  @return void
+ */
+static void count(size_t field, long n)
+{
+	*(long*)((char*)&cur.total + field) += n;
+	if (cur_phase >= 0)
+		*(long*)((char*)&cur.phases[cur_phase].io + field) += n;
+}
+
+
+/** @brief mark the filesystem blocks covered by a request as touched
+ *
+ *  @param offset byte offset on disk
+ *  @param bytes request length
+ *  @param is_read 1 if the request is a read
+ *  @return void
+ */
+static void touch_blocks(long offset, long bytes, int is_read)
+{
+	long first = 0, last = 0, b = 0;
+
+	if (fs_num_blocks == 0 || bytes <= 0 || offset < fs_base)
+		return;
+
+	first = (offset - fs_base) / fs_block_size;
+	last = (offset - fs_base + bytes - 1) / fs_block_size;
+	if (last >= fs_num_blocks)
+		last = fs_num_blocks - 1;
+
+	for (b = first; b <= last; b++)
+	{
+		if (touched[b >> 3] & (1 << (b & 7)))
+		{
+			if (is_read)
+				count(offsetof(io_counters_t, rereads), 1);
+			continue;
+		}
+		touched[b >> 3] |= 1 << (b & 7);
+		count(offsetof(io_counters_t, blocks), 1);
+	}
+}
+
+
+/** @brief count a read_bytes request
+ *
+ *  @param offset byte offset on disk
+ *  @param bytes bytes read
+ *  @return void
+ */
+void stats_count_read(long offset, long bytes)
+{
+	count(offsetof(io_counters_t, reads), 1);
+	count(offsetof(io_counters_t, read_bytes), bytes);
+	touch_blocks(offset, bytes, 1);
+}
+
+
+/** @brief count a read_sector request
+ *
+ *  @param offset byte offset on disk
+ *  @param bytes bytes read
+ *  @return void
+ */
+void stats_count_sector_read(long offset, long bytes)
+{
+	count(offsetof(io_counters_t, sector_reads), 1);
+	count(offsetof(io_counters_t, sector_bytes), bytes);
+	touch_blocks(offset, bytes, 1);
+}
+
+
+/** @brief count a write_bytes request
+ *
+ *  @param offset byte offset on disk
+ *  @param bytes bytes written
+ *  @return void
+ */
+void stats_count_write(long offset, long bytes)
+{
+	count(offsetof(io_counters_t, writes), 1);
+	count(offsetof(io_counters_t, write_bytes), bytes);
+	touch_blocks(offset, bytes, 0);
+}
+
+
+/** @brief count a lookup in the O_DIRECT chunk cache
+ *
+ *  @param hit 1 if the chunk was cached, 0 if it was read
+ *  @return void
+ */
+void stats_count_dio(int hit)
+{
+	if (hit)
+		count(offsetof(io_counters_t, dio_hits), 1);
+	else
+		count(offsetof(io_counters_t, dio_misses), 1);
+}
+
+
+/** @brief count an inode read through the inode cache
+ *
+ *  @param hit 1 if its table block was cached, 0 if it was read
+ *  @return void
+ */
+void stats_count_icache(int hit)
+{
+	if (hit)
+		count(offsetof(io_counters_t, icache_hits), 1);
+	else
+		count(offsetof(io_counters_t, icache_misses), 1);
+}
+
+
+/** @brief peak resident set size of the process
+ *
+ *  @return size in KB
+ */
+static long max_rss_kb()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+
+/** @brief print a string as a JSON string, escaping quotes,
+ *   backslashes and control characters
+ *
+ *  @param fp output file
+ *  @param str string, NULL prints an empty string
+ *  @return void
+ */
+static void print_json_string(FILE* fp, const char* str)
+{
+	fputc('"', fp);
+	for (; str != NULL && *str != '\0'; str++)
+	{
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+
+/** @brief print counters as JSON members
+ *
+ *  @param fp output file
+ *  @param prefix prefix of each member name
+ *  @param io counters
+ *  @return void
+ */
+static void print_json_counters(FILE* fp, const char* prefix,
+                                io_counters_t* io)
+{
+	fprintf(fp, "\"%sreads\":%ld,\"%sread_bytes\":%ld,"
+	            "\"%ssector_reads\":%ld,\"%ssector_bytes\":%ld,"
+	            "\"%swrites\":%ld,\"%swrite_bytes\":%ld,"
+	            "\"%sblocks\":%ld,\"%srereads\":%ld,"
+	            "\"%sdio_hits\":%ld,\"%sdio_misses\":%ld,"
+	            "\"%sicache_hits\":%ld,\"%sicache_misses\":%ld",
+	        prefix, io->reads, prefix, io->read_bytes,
+	        prefix, io->sector_reads, prefix, io->sector_bytes,
+	        prefix, io->writes, prefix, io->write_bytes,
+	        prefix, io->blocks, prefix, io->rereads,
+	        prefix, io->dio_hits, prefix, io->dio_misses,
+	        prefix, io->icache_hits, prefix, io->icache_misses);
+}
+
+
+/** @brief append the record of a finished check to the record file
+ *
+ *  @param c check statistics
+ *  @return 0 success, -1 fail
+ */
+static int write_record(check_stats_t* c)
+{
+	char prefix[32];
+	int i = 0;
+
+	FILE* fp = fopen(record_path, "a");
+	if (fp == NULL)
+	{
+		perror("Could not open record file");
+		return -1;
+	}
+
+	fprintf(fp, "{\"image\":");
+	print_json_string(fp, record_image);
+	fprintf(fp, ",\"partition\":%d,"
+	            "\"wall_s\":%.6f,\"cpu_s\":%.6f,\"max_rss_kb\":%ld,",
+	        c->partition_num, c->wall, c->cpu, max_rss_kb());
+	print_json_counters(fp, "", &c->total);
+	for (i = 0; i < NUM_PHASES; i++)
+	{
+		const char* name = phase_names[i];
+		fprintf(fp, ",\"%s_wall_s\":%.6f,\"%s_cpu_s\":%.6f,",
+		        name, c->phases[i].wall, name, c->phases[i].cpu);
+		snprintf(prefix, sizeof(prefix), "%s_", name);
+		print_json_counters(fp, prefix, &c->phases[i].io);
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+
+	return 0;
+}
+
+
+/** @brief finish the running check, keep its counters for the report
+ *   and append its record to the record file
+ *
+ *  @param partition_num partition checked
+ *  @return 0 success, -1 fail
+ */
+int stats_end_check(int partition_num)
+{
+	if (cur_phase >= 0)
+		phase_end(cur_phase);
+	free(touched);
+	touched = NULL;
+	fs_num_blocks = 0;
+
+	cur.partition_num = partition_num;
+	cur.wall = clock_seconds(CLOCK_MONOTONIC) - check_wall_start;
+	cur.cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - check_cpu_start;
+
+	check_stats_t* grown = (check_stats_t*)realloc(checks,
+	                       (num_checks + 1) * sizeof(check_stats_t));
+	if (grown == NULL)
+		return -1;
+	checks = grown;
+	checks[num_checks++] = cur;
+
+	if (record_path == NULL)
+		return 0;
+	return write_record(&cur);
+}
+
+
+/** @brief print one row of the text report
+ *
+ *  @param fp output file
+ *  @param name row name
+ *  @param wall wall time
+ *  @param cpu cpu time
+ *  @param io counters
+ *  @return void
+ */
+static void print_text_row(FILE* fp, const char* name, double wall,
+                           double cpu, io_counters_t* io)
+{
+	fprintf(fp, "%-10s %9.3f %9.3f %9ld %10ld %7ld %9ld %10ld %9ld %9ld"
+	            " %9ld %9ld %9ld %9ld\n",
+	        name, wall, cpu, io->reads, io->read_bytes >> 10,
+	        io->sector_reads, io->writes, io->write_bytes >> 10,
+	        io->blocks, io->rereads, io->dio_hits, io->dio_misses,
+	        io->icache_hits, io->icache_misses);
+}
+
+
+/** @brief write the report as text tables
+ *
+ *  @param fp output file
+ *  @return void
+ */
+static void report_text(FILE* fp)
+{
+	int i = 0, j = 0;
+
+	for (i = 0; i < num_checks; i++)
+	{
+		check_stats_t* c = &checks[i];
+		fprintf(fp, "*** statistics of partition %d ***\n", c->partition_num);
+		fprintf(fp, "%-10s %9s %9s %9s %10s %7s %9s %10s %9s %9s %9s %9s"
+		            " %9s %9s\n",
+		        "phase", "wall(s)", "cpu(s)", "reads", "read(KB)",
+		        "sectors", "writes", "write(KB)", "blocks", "rereads",
+		        "dio_hit", "dio_miss", "ic_hit", "ic_miss");
+		for (j = 0; j < NUM_PHASES; j++)
+			print_text_row(fp, phase_names[j], c->phases[j].wall,
+			               c->phases[j].cpu, &c->phases[j].io);
+		print_text_row(fp, "total", c->wall, c->cpu, &c->total);
+		fprintf(fp, "\n");
+	}
+	fprintf(fp, "peak RSS %ld KB\n", max_rss_kb());
+}
+
+
+/** @brief write one counter of every phase of every check as a
+ *   Prometheus metric
+ *
+ *  @param fp output file
+ *  @param name metric name
+ *  @param help metric description
+ *  @param field offset of the counter in io_counters_t
+ *  @return void
+ */
+static void report_prom_counter(FILE* fp, const char* name, const char* help,
+                                size_t field)
+{
+	int i = 0, j = 0;
+
+	fprintf(fp, "# HELP myfsck_%s %s\n# TYPE myfsck_%s gauge\n",
+	        name, help, name);
+	for (i = 0; i < num_checks; i++)
+		for (j = 0; j < NUM_PHASES; j++)
+			fprintf(fp, "myfsck_%s{partition=\"%d\",phase=\"%s\"} %ld\n",
+			        name, checks[i].partition_num, phase_names[j],
+			        *(long*)((char*)&checks[i].phases[j].io + field));
+}
+
+
+/** @brief write the report as a Prometheus textfile
+ *
+ *  @param fp output file
+ *  @return void
+ */
+static void report_prom(FILE* fp)
+{
+	int i = 0, j = 0;
+
+	fprintf(fp, "# HELP myfsck_phase_wall_seconds Wall time of a phase.\n"
+	            "# TYPE myfsck_phase_wall_seconds gauge\n");
+	for (i = 0; i < num_checks; i++)
+		for (j = 0; j < NUM_PHASES; j++)
+			fprintf(fp, "myfsck_phase_wall_seconds"
+			            "{partition=\"%d\",phase=\"%s\"} %.6f\n",
+			        checks[i].partition_num, phase_names[j],
+			        checks[i].phases[j].wall);
+	fprintf(fp, "# HELP myfsck_phase_cpu_seconds CPU time of a phase.\n"
+	            "# TYPE myfsck_phase_cpu_seconds gauge\n");
+	for (i = 0; i < num_checks; i++)
+		for (j = 0; j < NUM_PHASES; j++)
+			fprintf(fp, "myfsck_phase_cpu_seconds"
+			            "{partition=\"%d\",phase=\"%s\"} %.6f\n",
+			        checks[i].partition_num, phase_names[j],
+			        checks[i].phases[j].cpu);
+
+	report_prom_counter(fp, "read_calls", "read_bytes calls.",
+	                    offsetof(io_counters_t, reads));
+	report_prom_counter(fp, "read_bytes", "Bytes read by read_bytes.",
+	                    offsetof(io_counters_t, read_bytes));
+	report_prom_counter(fp, "sector_read_calls", "read_sector calls.",
+	                    offsetof(io_counters_t, sector_reads));
+	report_prom_counter(fp, "sector_read_bytes", "Bytes read by read_sector.",
+	                    offsetof(io_counters_t, sector_bytes));
+	report_prom_counter(fp, "write_calls", "write_bytes calls.",
+	                    offsetof(io_counters_t, writes));
+	report_prom_counter(fp, "write_bytes", "Bytes written by write_bytes.",
+	                    offsetof(io_counters_t, write_bytes));
+	report_prom_counter(fp, "blocks_touched",
+	                    "Filesystem blocks first touched in a phase.",
+	                    offsetof(io_counters_t, blocks));
+	report_prom_counter(fp, "block_rereads",
+	                    "Block reads of blocks touched before.",
+	                    offsetof(io_counters_t, rereads));
+	report_prom_counter(fp, "dio_cache_hits",
+	                    "O_DIRECT chunk cache lookups served from memory.",
+	                    offsetof(io_counters_t, dio_hits));
+	report_prom_counter(fp, "dio_cache_misses",
+	                    "Chunks read into the O_DIRECT cache.",
+	                    offsetof(io_counters_t, dio_misses));
+	report_prom_counter(fp, "icache_hits",
+	                    "Inodes read from a cached inode table block.",
+	                    offsetof(io_counters_t, icache_hits));
+	report_prom_counter(fp, "icache_misses",
+	                    "Inode table blocks read into the inode cache.",
+	                    offsetof(io_counters_t, icache_misses));
+
+	fprintf(fp, "# HELP myfsck_max_rss_bytes Peak resident set size.\n"
+	            "# TYPE myfsck_max_rss_bytes gauge\n"
+	            "myfsck_max_rss_bytes %ld\n", max_rss_kb() * 1024);
+}
+
+
+/** @brief write the report as a JSON document
+ *
+ *  @param fp output file
+ *  @return void
+ */
+static void report_json(FILE* fp)
+{
+	int i = 0, j = 0;
+
+	fprintf(fp, "{\"image\":");
+	print_json_string(fp, record_image);
+	fprintf(fp, ",\"max_rss_kb\":%ld,\"checks\":[", max_rss_kb());
+	for (i = 0; i < num_checks; i++)
+	{
+		check_stats_t* c = &checks[i];
+		fprintf(fp, "%s\n{\"partition\":%d,\"wall_s\":%.6f,\"cpu_s\":%.6f,",
+		        i > 0 ? "," : "", c->partition_num, c->wall, c->cpu);
+		print_json_counters(fp, "", &c->total);
+		fprintf(fp, ",\"phases\":{");
+		for (j = 0; j < NUM_PHASES; j++)
+		{
+			fprintf(fp, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f,",
+			        j > 0 ? "," : "", phase_names[j],
+			        c->phases[j].wall, c->phases[j].cpu);
+			print_json_counters(fp, "", &c->phases[j].io);
+			fprintf(fp, "}");
+		}
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "\n]}\n");
+}
+
+
+/** @brief write the report of all finished checks
+ *
+ *  @return 0 success, -1 fail
+ */
+int stats_report()
+{
+	FILE* fp = stdout;
+	char tmp_path[4096];
+
+	if (report_format == STATS_NONE)
+		return 0;
+	/* write to a temporary file and rename it, so a textfile collector
+	 * never sees a partial file */
+	if (report_path != NULL)
+	{
+		snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", report_path);
+		if ((fp = fopen(tmp_path, "w")) == NULL)
+		{
+			perror("Could not open statistics file");
+			return -1;
+		}
+	}
+
+	if (report_format == STATS_TEXT)
+		report_text(fp);
+	else if (report_format == STATS_PROM)
+		report_prom(fp);
+	else
+		report_json(fp);
+
+	if (fp != stdout)
+	{
+		fclose(fp);
+		if (rename(tmp_path, report_path) == -1)
+		{
+			perror("Could not rename statistics file");
+			return -1;
+		}
+	}
+	return 0;
+}
+
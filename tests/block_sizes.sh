@@ -0,0 +1,68 @@
+#!/bin/sh
+# block_sizes.sh - repair corrupted images of every block size
+#
+#   For 1K, 2K and 4K blocks, with and without sparse superblocks, an
+#   image with every corruption type is built with mkimage and repaired
+#   with "myfsck -f 0". The first check must find problems, a second
+#   check must find none, and when e2fsck is installed every partition
+#   must pass "e2fsck -fn". This covers the first data block, the
+#   descriptor table and the bitmap padding of each layout.
+#
+#   Environment:
+#     MYFSCK     myfsck binary (./myfsck)
+#     MKIMAGE    mkimage binary (./mkimage)
+#     TEST_DIR   work directory (a new temporary directory)
+
+MYFSCK=${MYFSCK:-./myfsck}
+MKIMAGE=${MKIMAGE:-./mkimage}
+
+if [ -z "$TEST_DIR" ]
+then
+	TEST_DIR=$(mktemp -d) || exit 1
+	cleanup=1
+fi
+img="$TEST_DIR/blocks.img"
+fs="$TEST_DIR/blocks.fs"
+
+fail()
+{
+	echo "FAIL: $*"
+	exit 1
+}
+
+for bs in 1024 2048 4096
+do
+	for sparse in "" -n
+	do
+		name="${bs}${sparse}"
+		"$MKIMAGE" -o "$img" -s 32M -b $bs -d 2 -w 4 -f 8 -L 2 $sparse \
+		           -c dot=2,dotdot=2,orphan=3,links=3,bitmap=8 >/dev/null \
+			|| fail "$name: mkimage failed"
+
+		"$MYFSCK" -f 0 -i "$img" > "$TEST_DIR/first.out" \
+			|| fail "$name: first check failed"
+		grep -q "problems found" "$TEST_DIR/first.out" \
+			|| fail "$name: corruptions not found"
+		"$MYFSCK" -f 0 -i "$img" > "$TEST_DIR/second.out" \
+			|| fail "$name: second check failed"
+		grep -q "problems found" "$TEST_DIR/second.out" \
+			&& fail "$name: problems left after the repair"
+
+		command -v e2fsck >/dev/null 2>&1 || continue
+		p=1
+		while set -- $("$MYFSCK" -i "$img" -p $p) && [ "$1" != "-1" ]
+		do
+			if [ "$1" = "0x83" ]
+			then
+				dd if="$img" of="$fs" bs=512 skip=$2 count=$3 status=none
+				e2fsck -fn "$fs" > "$TEST_DIR/e2fsck.out" 2>&1 \
+					|| fail "$name: e2fsck finds errors in partition $p"
+			fi
+			p=$((p + 1))
+		done
+	done
+done
+
+echo "PASS: block_sizes"
+[ -n "$cleanup" ] && rm -rf "$TEST_DIR"
+exit 0
@@ -0,0 +1,116 @@
+#!/bin/sh
+# incremental_lostfound.sh - an orphan put into lost+found by an
+#   incremental check keeps its link
+#
+#   A partition is checked with --incremental, then a file is unlinked
+#   with debugfs, leaving its inode linked but unreferenced. Its
+#   directory and lost+found lie in different groups, and lost+found
+#   has its data blocks in another group than its inode, so the entry
+#   myfsck appends lands outside the group of the directory. The second
+#   incremental check must read lost+found again rather than replay its
+#   saved entries, or the orphan counts no reference and loses its last
+#   link.
+#
+#   Needs debugfs from e2fsprogs, the test is skipped without it.
+#
+#   Environment:
+#     MYFSCK     myfsck binary (./myfsck)
+#     MKIMAGE    mkimage binary (./mkimage)
+#     TEST_DIR   work directory (a new temporary directory)
+
+MYFSCK=${MYFSCK:-./myfsck}
+MKIMAGE=${MKIMAGE:-./mkimage}
+
+if ! command -v debugfs >/dev/null 2>&1
+then
+	echo "SKIP: debugfs not found"
+	exit 0
+fi
+
+if [ -z "$TEST_DIR" ]
+then
+	TEST_DIR=$(mktemp -d) || exit 1
+	cleanup=1
+fi
+img="$TEST_DIR/lostfound.img"
+fs="$TEST_DIR/lostfound.fs"
+db="$TEST_DIR/lostfound.db"
+
+fail()
+{
+	echo "FAIL: $*"
+	exit 1
+}
+
+# debugfs on the extracted partition
+dfs()
+{
+	debugfs -R "$1" "$fs" 2>/dev/null
+}
+
+# check if no block of a file is in group 0
+outside_group0()
+{
+	for b in $(dfs "blocks $1")
+	do
+		[ $(( (b - first_block) / per_group )) -eq 0 ] && return 1
+	done
+	return 0
+}
+
+# a fragmented image where the first block of lost+found is not in
+# group 0, the group of its inode, with a file whose directory has its
+# inode and blocks outside group 0
+found=0
+for seed in 1 2 3 4 5 6 7 8 9 10
+do
+	"$MKIMAGE" -o "$img" -s 16M -b 1024 -r 100 -S $seed >/dev/null || exit 1
+	set -- $("$MYFSCK" -i "$img" -p 1)
+	start=$2
+	count=$3
+	dd if="$img" of="$fs" bs=512 skip=$start count=$count status=none
+	first_block=$(dfs stats | sed -n 's/^First block: *//p')
+	per_group=$(dfs stats | sed -n 's/^Blocks per group: *//p')
+	per_igroup=$(dfs stats | sed -n 's/^Inodes per group: *//p')
+	first=$(dfs "blocks /lost+found" | awk '{ print $1 }')
+	[ $(( (first - first_block) / per_group )) -ne 0 ] || continue
+
+	for dir in $(dfs "ls -p /" | awk -F/ '$3 ~ /^040/ && $6 ~ /^d/ { print $6 }')
+	do
+		ino=$(dfs "ls -p /$dir" | awk -F/ '$6 == "." { print $2 }')
+		[ $(( (ino - 1) / per_igroup )) -ne 0 ] || continue
+		outside_group0 "/$dir" || continue
+		file=$(dfs "ls -p /$dir" | awk -F/ '$3 ~ /^100/ { print $6; exit }')
+		[ -n "$file" ] || continue
+		found=1
+		break 2
+	done
+done
+[ $found -eq 1 ] || fail "no image with lost+found and a directory outside group 0"
+
+"$MYFSCK" -f 1 -i "$img" --incremental="$db" >/dev/null \
+	|| fail "first check failed"
+[ -f "$db.1" ] || fail "no fingerprint database written"
+
+# orphan the file the way an interrupted unlink would: the entry is
+# gone, the inode is still linked and its directory has a new mtime
+dd if="$img" of="$fs" bs=512 skip=$start count=$count status=none
+orphan=$(dfs "ls -p /$dir" | awk -F/ -v f="$file" '$6 == f { print $2 }')
+debugfs -w -R "unlink /$dir/$file" "$fs" >/dev/null 2>&1
+debugfs -w -R "sif /$dir mtime 20300101" "$fs" >/dev/null 2>&1
+dd if="$fs" of="$img" bs=512 seek=$start conv=notrunc status=none
+
+"$MYFSCK" -f 1 -i "$img" --incremental="$db" > "$TEST_DIR/second.out" \
+	|| fail "second check failed"
+grep -q "putting $orphan into lost+found" "$TEST_DIR/second.out" \
+	|| fail "inode $orphan not put into lost+found"
+
+dd if="$img" of="$fs" bs=512 skip=$start count=$count status=none
+links=$(dfs "stat <$orphan>" | sed -n 's/.*Links: *\([0-9]*\).*/\1/p')
+[ "$links" = "1" ] || fail "inode $orphan has $links links, expected 1"
+dfs "ls -p /lost+found" | awk -F/ '{ print $2 }' | grep -qx "$orphan" \
+	|| fail "inode $orphan not in lost+found"
+
+echo "PASS: incremental_lostfound"
+[ -n "$cleanup" ] && rm -rf "$TEST_DIR"
+exit 0
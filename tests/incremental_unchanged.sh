@@ -0,0 +1,103 @@
+#!/bin/sh
+# incremental_unchanged.sh - corruption that leaves the bitmaps alone
+#   is found by an incremental check
+#
+#   A partition is checked with --incremental, then corrupted in ways
+#   that change no bitmap and no descriptor: the link count of a file
+#   is raised, and the "." entry of the root directory is overwritten
+#   without touching its inode. After each, an incremental check must
+#   report the problem like a full check would, and a full check after
+#   the repairs must find nothing left.
+#
+#   Needs debugfs from e2fsprogs, the test is skipped without it.
+#
+#   Environment:
+#     MYFSCK     myfsck binary (./myfsck)
+#     MKIMAGE    mkimage binary (./mkimage)
+#     TEST_DIR   work directory (a new temporary directory)
+
+MYFSCK=${MYFSCK:-./myfsck}
+MKIMAGE=${MKIMAGE:-./mkimage}
+
+if ! command -v debugfs >/dev/null 2>&1
+then
+	echo "SKIP: debugfs not found"
+	exit 0
+fi
+
+if [ -z "$TEST_DIR" ]
+then
+	TEST_DIR=$(mktemp -d) || exit 1
+	cleanup=1
+fi
+img="$TEST_DIR/unchanged.img"
+fs="$TEST_DIR/unchanged.fs"
+db="$TEST_DIR/unchanged.db"
+out="$TEST_DIR/unchanged.out"
+
+fail()
+{
+	echo "FAIL: $*"
+	exit 1
+}
+
+# debugfs on the extracted partition
+dfs()
+{
+	debugfs -R "$1" "$fs" 2>/dev/null
+}
+
+# copy the partition out of the image and back
+extract()
+{
+	dd if="$img" of="$fs" bs=512 skip=$start count=$count status=none
+}
+store()
+{
+	dd if="$fs" of="$img" bs=512 seek=$start conv=notrunc status=none
+}
+
+# an incremental check that trusts the saved fingerprints
+check_incremental()
+{
+	"$MYFSCK" -f 1 -i "$img" --incremental="$db" > "$out" \
+		|| fail "incremental check failed"
+	grep -q "groups unchanged since the last check" "$out" \
+		|| fail "fingerprint database not used"
+}
+
+"$MKIMAGE" -o "$img" -s 16M -b 1024 -S 1 >/dev/null || exit 1
+set -- $("$MYFSCK" -i "$img" -p 1)
+start=$2
+count=$3
+"$MYFSCK" -f 1 -i "$img" --incremental="$db" >/dev/null \
+	|| fail "first check failed"
+[ -f "$db.1" ] || fail "no fingerprint database written"
+
+# a link count raised in place, only the inode table changes
+extract
+inode=$(dfs "ls -p /" | awk -F/ '$3 ~ /^100/ { print $2; exit }')
+[ -n "$inode" ] || fail "no file in the root directory"
+debugfs -w -R "sif <$inode> links_count 6" "$fs" >/dev/null 2>&1
+store
+check_incremental
+grep -q "inode $inode link count error actual: 1  stored: 6" "$out" \
+	|| fail "raised link count of inode $inode not found"
+
+# the "." entry of the root directory pointing elsewhere, only the
+# directory block changes
+extract
+block_size=$(dfs stats | sed -n 's/^Block size: *//p')
+block=$(dfs "blocks /" | awk '{ print $1 }')
+printf '\115\000\000\000' | dd of="$fs" bs=1 seek=$((block * block_size)) \
+	conv=notrunc status=none
+store
+check_incremental
+grep -q 'error in "\."' "$out" || fail "wrong \".\" of the root not found"
+
+"$MYFSCK" -f 1 -i "$img" > "$out" || fail "full check failed"
+grep -q "problems found" "$out" && fail "problems left after the repairs"
+
+echo "PASS: incremental_unchanged"
+[ -n "$cleanup" ] && rm -rf "$TEST_DIR"
+exit 0
@@ -0,0 +1,133 @@
+/** @file trace.c
+ *  @brief This module records every disk access of myfsck to a trace
+ *   file
+ *
+ *   Each request through readwrite.c becomes a 16 byte record holding
+ *   its offset, length, direction, the phase of the check and the
+ *   inode being worked on. tracereplay simulates caches and readahead
+ *   over such traces offline.
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/** trace file, NULL when not tracing */
+static FILE* trace_fp = NULL;
+/** inode the current accesses are made for */
+static unsigned int trace_inode = 0;
+
+
+/** @brief start writing a trace file
+ *
+ *  @param path trace file
+ *  @return 0 success or -1 fail
+ */
+int trace_open(const char* path)
+{
+	trace_header_t hdr;
+
+	if ((trace_fp = fopen(path, "wb")) == NULL)
+	{
+		perror("Could not open trace file");
+		return -1;
+	}
+	/* records are small, buffer them in large chunks */
+	setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(trace_record_t);
+	fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+	return 0;
+}
+
+
+/** @brief flush and close the trace file
+ *
+ *  @return void
+ */
+void trace_close()
+{
+	if (trace_fp == NULL)
+		return;
+	if (fclose(trace_fp) != 0)
+		perror("Could not write trace file");
+	trace_fp = NULL;
+}
+
+
+/** @brief set the inode later accesses are recorded for
+ *
+ *  @param inode_num inode number, 0 for none
+ *  @return the previous inode, to restore when done
+ */
+unsigned int trace_set_inode(unsigned int inode_num)
+{
+	unsigned int prev = trace_inode;
+	trace_inode = inode_num;
+	return prev;
+}
+
+
+/** @brief write a record
+ *
+ *  @param op TRACE_READ, TRACE_WRITE or TRACE_CHECK
+ *  @param offset byte offset on disk
+ *  @param inode_num inode context
+ *  @param length length in bytes
+ *  @return void
+ */
+static void put_record(int op, long offset, unsigned int inode_num,
+                       long length)
+{
+	trace_record_t rec;
+	int phase = stats_phase();
+
+	rec.offset = offset;
+	rec.inode = inode_num;
+	rec.info = (length & TRACE_LEN_MASK)
+	           | ((uint32_t)(phase < 0 ? TRACE_PHASE_MASK : phase)
+	              << TRACE_PHASE_SHIFT)
+	           | ((uint32_t)op << TRACE_OP_SHIFT);
+	fwrite(&rec, sizeof(rec), 1, trace_fp);
+}
+
+
+/** @brief record the start of the check of a partition
+ *
+ *  @param partition_num partition number
+ *  @param base byte offset of the filesystem on disk
+ *  @param block_size block size of the filesystem
+ *  @return void
+ */
+void trace_begin_check(int partition_num, long base, int block_size)
+{
+	if (trace_fp != NULL)
+		put_record(TRACE_CHECK, base, partition_num, block_size);
+}
+
+
+/** @brief record an access
+ *
+ *  @param op TRACE_READ or TRACE_WRITE
+ *  @param offset byte offset on disk
+ *  @param length length in bytes
+ *  @return void
+ */
+void trace_access(int op, long offset, long length)
+{
+	if (trace_fp != NULL)
+		put_record(op, offset, trace_inode, length);
+}
+
@@ -0,0 +1,565 @@
+/** @file tracereplay.c
+ *  @brief Offline replay of myfsck access traces
+ *
+ *   Replays a trace written by myfsck --trace through a simulated LRU
+ *   block cache with readahead in front of a disk, for every
+ *   combination of the given cache sizes and readahead depths. For
+ *   each it reports the cache hit rate, how much of the readahead was
+ *   used, and the requests, bytes and seek distance the disk would
+ *   see. Writes go through to the disk and update cached blocks.
+ *
+ *   usage: tracereplay [-c sizes] [-r depths] [-g granule] [-a] [-p] trace
+ *
+ *  @bug: No bugs found yet
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define MAX_CONFIGS 32
+#define PHASE_NONE NUM_PHASES   /* accesses outside any phase */
+
+static const char* phase_names[NUM_PHASES + 1] =
+	{"init", "traverse", "unref", "retraverse", "links", "blockmap", "-"};
+
+
+/** @brief LRU cache of fixed size granules */
+typedef struct lru
+{
+	int cap;
+	int used;
+	int head;          /* most recently used */
+	int tail;          /* least recently used */
+	uint64_t* key;
+	int* prev;
+	int* next;
+	int* hnext;        /* hash chain */
+	unsigned char* prefetched;  /* read ahead and not used yet */
+	int* buckets;
+	uint64_t mask;
+} lru_t;
+
+
+/** @brief counters of one simulated configuration */
+typedef struct sim_stats
+{
+	long reads;
+	long read_granules;
+	long hits;
+	long prefetched;
+	long prefetch_used;
+	long writes;
+	long disk_reqs;
+	long disk_bytes;
+	long seeks;
+	uint64_t seek_bytes;
+} sim_stats_t;
+
+
+/** @brief state of one simulated configuration */
+typedef struct sim
+{
+	lru_t cache;
+	int readahead;
+	int adaptive;
+	uint64_t granule;
+	uint64_t head_pos;     /* disk position after the last request */
+	uint64_t next_seq;     /* granule following the last read */
+	sim_stats_t total;
+	sim_stats_t phase[NUM_PHASES + 1];
+} sim_t;
+
+
+/** @brief set up an empty cache
+ *
+ *  @param c cache
+ *  @param cap capacity in granules
+ *  @return void
+ */
+static void lru_init(lru_t* c, int cap)
+{
+	uint64_t nb = 1;
+
+	memset(c, 0, sizeof(*c));
+	c->cap = cap;
+	c->head = c->tail = -1;
+	if (cap == 0)
+		return;
+
+	while (nb < (uint64_t)cap * 2)
+		nb <<= 1;
+	c->mask = nb - 1;
+	c->key = (uint64_t*)malloc(cap * sizeof(uint64_t));
+	c->prev = (int*)malloc(cap * sizeof(int));
+	c->next = (int*)malloc(cap * sizeof(int));
+	c->hnext = (int*)malloc(cap * sizeof(int));
+	c->prefetched = (unsigned char*)malloc(cap);
+	c->buckets = (int*)malloc(nb * sizeof(int));
+	if (!c->key || !c->prev || !c->next || !c->hnext || !c->prefetched
+	    || !c->buckets)
+	{
+		printf("out of memory\n");
+		exit(-1);
+	}
+	memset(c->buckets, 0xff, nb * sizeof(int));
+}
+
+
+/** @brief free a cache
+ *
+ *  @param c cache
+ *  @return void
+ */
+static void lru_free(lru_t* c)
+{
+	free(c->key);
+	free(c->prev);
+	free(c->next);
+	free(c->hnext);
+	free(c->prefetched);
+	free(c->buckets);
+}
+
+
+/** @brief hash bucket of a granule
+ *
+ *  @param c cache
+ *  @param key granule number
+ *  @return bucket index
+ */
+static uint64_t lru_bucket(lru_t* c, uint64_t key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL >> 20) & c->mask;
+}
+
+
+/** @brief look up a granule
+ *
+ *  @param c cache
+ *  @param key granule number
+ *  @return entry index or -1
+ */
+static int lru_find(lru_t* c, uint64_t key)
+{
+	int i = 0;
+
+	if (c->cap == 0)
+		return -1;
+	for (i = c->buckets[lru_bucket(c, key)]; i >= 0; i = c->hnext[i])
+		if (c->key[i] == key)
+			return i;
+	return -1;
+}
+
+
+/** @brief unlink an entry from the recency list
+ *
+ *  @param c cache
+ *  @param i entry index
+ *  @return void
+ */
+static void lru_unlink(lru_t* c, int i)
+{
+	if (c->prev[i] >= 0)
+		c->next[c->prev[i]] = c->next[i];
+	else
+		c->head = c->next[i];
+	if (c->next[i] >= 0)
+		c->prev[c->next[i]] = c->prev[i];
+	else
+		c->tail = c->prev[i];
+}
+
+
+/** @brief make an entry the most recently used
+ *
+ *  @param c cache
+ *  @param i entry index
+ *  @return void
+ */
+static void lru_push_front(lru_t* c, int i)
+{
+	c->prev[i] = -1;
+	c->next[i] = c->head;
+	if (c->head >= 0)
+		c->prev[c->head] = i;
+	c->head = i;
+	if (c->tail < 0)
+		c->tail = i;
+}
+
+
+/** @brief insert a granule, evicting the least recently used one when
+ *   the cache is full
+ *
+ *  @param c cache
+ *  @param key granule number
+ *  @param prefetched 1 if inserted by readahead
+ *  @return void
+ */
+static void lru_insert(lru_t* c, uint64_t key, int prefetched)
+{
+	int i = 0, *pp = NULL;
+
+	if (c->cap == 0)
+		return;
+	if (c->used < c->cap)
+		i = c->used++;
+	else
+	{
+		/* evict the tail and remove it from its hash chain */
+		i = c->tail;
+		lru_unlink(c, i);
+		for (pp = &c->buckets[lru_bucket(c, c->key[i])]; *pp != i;
+		     pp = &c->hnext[*pp])
+			;
+		*pp = c->hnext[i];
+	}
+
+	uint64_t b = lru_bucket(c, key);
+	c->key[i] = key;
+	c->prefetched[i] = prefetched;
+	c->hnext[i] = c->buckets[b];
+	c->buckets[b] = i;
+	lru_push_front(c, i);
+}
+
+
+/** @brief add to a counter of the total and of a phase
+ *
+ *  @param s simulation
+ *  @param phase phase of the access
+ *  @param field offset of the counter in sim_stats_t
+ *  @param n amount to add
+ *  @return void
+ */
+static void add(sim_t* s, int phase, size_t field, long n)
+{
+	*(long*)((char*)&s->total + field) += n;
+	*(long*)((char*)&s->phase[phase] + field) += n;
+}
+
+
+/** @brief issue a request to the simulated disk
+ *
+ *  @param s simulation
+ *  @param phase phase of the access
+ *  @param offset byte offset
+ *  @param len length in bytes
+ *  @return void
+ */
+static void disk_request(sim_t* s, int phase, uint64_t offset, uint64_t len)
+{
+	uint64_t dist = offset > s->head_pos ? offset - s->head_pos
+	                                     : s->head_pos - offset;
+
+	add(s, phase, offsetof(sim_stats_t, disk_reqs), 1);
+	add(s, phase, offsetof(sim_stats_t, disk_bytes), len);
+	if (dist != 0)
+	{
+		add(s, phase, offsetof(sim_stats_t, seeks), 1);
+		s->total.seek_bytes += dist;
+		s->phase[phase].seek_bytes += dist;
+	}
+	s->head_pos = offset + len;
+}
+
+
+/** @brief replay a read
+ *
+ *  @param s simulation
+ *  @param phase phase of the access
+ *  @param offset byte offset
+ *  @param len length in bytes
+ *  @return void
+ */
+static void sim_read(sim_t* s, int phase, uint64_t offset, uint64_t len)
+{
+	uint64_t first = offset / s->granule;
+	uint64_t last = (offset + len - 1) / s->granule;
+	uint64_t g = 0, run_start = 0;
+	int in_run = 0, i = 0;
+
+	add(s, phase, offsetof(sim_stats_t, reads), 1);
+	add(s, phase, offsetof(sim_stats_t, read_granules), last - first + 1);
+
+	/* without a cache every read goes to the disk unchanged */
+	if (s->cache.cap == 0)
+	{
+		disk_request(s, phase, offset, len);
+		return;
+	}
+
+	/* fetch each run of missing granules with one request */
+	for (g = first; g <= last + 1; g++)
+	{
+		i = g <= last ? lru_find(&s->cache, g) : 0;
+		if (g <= last && i < 0)
+		{
+			if (!in_run)
+				run_start = g;
+			in_run = 1;
+			continue;
+		}
+		if (g <= last)
+		{
+			add(s, phase, offsetof(sim_stats_t, hits), 1);
+			if (s->cache.prefetched[i])
+			{
+				add(s, phase, offsetof(sim_stats_t, prefetch_used), 1);
+				s->cache.prefetched[i] = 0;
+			}
+			lru_unlink(&s->cache, i);
+			lru_push_front(&s->cache, i);
+		}
+		if (!in_run)
+			continue;
+		in_run = 0;
+
+		/* read ahead behind a miss at the end of the request */
+		uint64_t end = g;
+		uint64_t ahead = 0;
+		if (g > last && s->readahead > 0
+		    && (!s->adaptive || first == s->next_seq))
+			while (ahead < (uint64_t)s->readahead
+			       && lru_find(&s->cache, end + ahead) < 0)
+				ahead++;
+
+		disk_request(s, phase, run_start * s->granule,
+		             (end + ahead - run_start) * s->granule);
+		uint64_t k = 0;
+		for (k = run_start; k < end; k++)
+			lru_insert(&s->cache, k, 0);
+		for (k = end; k < end + ahead; k++)
+			lru_insert(&s->cache, k, 1);
+		add(s, phase, offsetof(sim_stats_t, prefetched), ahead);
+	}
+	s->next_seq = last + 1;
+}
+
+
+/** @brief replay a write, passed through to the disk
+ *
+ *  @param s simulation
+ *  @param phase phase of the access
+ *  @param offset byte offset
+ *  @param len length in bytes
+ *  @return void
+ */
+static void sim_write(sim_t* s, int phase, uint64_t offset, uint64_t len)
+{
+	uint64_t g = 0;
+	int i = 0;
+
+	add(s, phase, offsetof(sim_stats_t, writes), 1);
+	disk_request(s, phase, offset, len);
+	for (g = offset / s->granule; g <= (offset + len - 1) / s->granule; g++)
+		if ((i = lru_find(&s->cache, g)) >= 0)
+		{
+			lru_unlink(&s->cache, i);
+			lru_push_front(&s->cache, i);
+		}
+}
+
+
+/** @brief print one result row
+ *
+ *  @param label row label
+ *  @param st counters
+ *  @return void
+ */
+static void print_row(const char* label, sim_stats_t* st)
+{
+	double hit = st->read_granules
+	             ? 100.0 * st->hits / st->read_granules : 0;
+	double used = st->prefetched
+	              ? 100.0 * st->prefetch_used / st->prefetched : 0;
+	double mean_seek = st->seeks
+	                   ? (double)st->seek_bytes / st->seeks / 1024 : 0;
+
+	printf("%-20s %9ld %6.1f %6.1f %9ld %9.1f %8ld %10.1f %10.1f\n",
+	       label, st->reads, hit, used, st->disk_reqs,
+	       st->disk_bytes / 1048576.0, st->seeks, mean_seek,
+	       st->seek_bytes / 1048576.0);
+}
+
+
+/** @brief parse a comma separated list of numbers
+ *
+ *  @param s list
+ *  @param out numbers
+ *  @return count or -1 if invalid
+ */
+static int parse_list(char* s, int* out)
+{
+	int n = 0;
+	char* tok = NULL;
+
+	for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		if (n == MAX_CONFIGS || atoi(tok) < 0)
+			return -1;
+		out[n++] = atoi(tok);
+	}
+	return n;
+}
+
+
+/** @brief load a trace file
+ *
+ *  @param path trace file
+ *  @param num number of records read
+ *  @return records or NULL on error
+ */
+static trace_record_t* load_trace(const char* path, long* num)
+{
+	trace_header_t hdr;
+	FILE* fp = fopen(path, "rb");
+	trace_record_t* recs = NULL;
+	long size = 0;
+
+	if (fp == NULL)
+	{
+		perror("Could not open trace file");
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC
+	    || hdr.version != TRACE_VERSION
+	    || hdr.record_size != sizeof(trace_record_t))
+	{
+		printf("%s is not a trace file\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp) - sizeof(hdr);
+	fseek(fp, sizeof(hdr), SEEK_SET);
+	*num = size / sizeof(trace_record_t);
+	recs = (trace_record_t*)malloc((*num + 1) * sizeof(trace_record_t));
+	if (recs == NULL || (long)fread(recs, sizeof(trace_record_t), *num, fp)
+	                    != *num)
+	{
+		printf("reading %s failed\n", path);
+		free(recs);
+		recs = NULL;
+	}
+	fclose(fp);
+	return recs;
+}
+
+
+/** @brief print usage */
+static void usage()
+{
+	printf("usage: tracereplay [-c cache_sizes] [-r readahead_depths] "
+	       "[-g granule] [-a] [-p] trace\n"
+	       "  cache_sizes, readahead_depths: comma separated, in granules\n"
+	       "  -g: granule size in bytes, default the filesystem block size\n"
+	       "  -a: read ahead only for sequential reads\n"
+	       "  -p: show every phase\n");
+}
+
+
+/** @brief main function */
+int main(int argc, char** argv)
+{
+	int sizes[MAX_CONFIGS] = {0, 64, 256, 1024, 4096};
+	int depths[MAX_CONFIGS] = {0, 8};
+	int num_sizes = 5, num_depths = 2;
+	uint64_t granule = 0;
+	int adaptive = 0, per_phase = 0;
+	int opt = 0, i = 0, j = 0, k = 0;
+	long n = 0, r = 0;
+	char label[64];
+
+	while ((opt = getopt(argc, argv, "c:r:g:aph")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': num_sizes = parse_list(optarg, sizes); break;
+			case 'r': num_depths = parse_list(optarg, depths); break;
+			case 'g': granule = strtoull(optarg, NULL, 10); break;
+			case 'a': adaptive = 1; break;
+			case 'p': per_phase = 1; break;
+			default:
+				usage();
+				exit(-1);
+		}
+	}
+	if (optind != argc - 1 || num_sizes <= 0 || num_depths <= 0)
+	{
+		usage();
+		exit(-1);
+	}
+
+	trace_record_t* recs = load_trace(argv[optind], &n);
+	if (recs == NULL)
+		exit(-1);
+
+	/* default granule is the block size of the first checked filesystem */
+	for (r = 0; granule == 0 && r < n; r++)
+		if (TRACE_OP(&recs[r]) == TRACE_CHECK)
+			granule = TRACE_LEN(&recs[r]);
+	if (granule == 0)
+		granule = 1024;
+
+	printf("%ld records, granule %" PRIu64 " bytes%s\n\n", n, granule,
+	       adaptive ? ", sequential readahead only" : "");
+	printf("%-20s %9s %6s %6s %9s %9s %8s %10s %10s\n",
+	       "cache/readahead", "reads", "hit%", "ra%", "disk_reqs",
+	       "disk_MB", "seeks", "seek_KB", "seek_MB");
+
+	for (i = 0; i < num_sizes; i++)
+		for (j = 0; j < num_depths; j++)
+		{
+			/* readahead needs somewhere to put the blocks */
+			if (sizes[i] == 0 && depths[j] > 0)
+				continue;
+
+			sim_t s;
+			memset(&s, 0, sizeof(s));
+			lru_init(&s.cache, sizes[i]);
+			s.readahead = depths[j];
+			s.adaptive = adaptive;
+			s.granule = granule;
+			s.next_seq = (uint64_t)-1;
+
+			for (r = 0; r < n; r++)
+			{
+				trace_record_t* rec = &recs[r];
+				int phase = TRACE_PHASE(rec) < NUM_PHASES
+				            ? TRACE_PHASE(rec) : PHASE_NONE;
+				if (TRACE_LEN(rec) == 0)
+					continue;
+				if (TRACE_OP(rec) == TRACE_READ)
+					sim_read(&s, phase, rec->offset, TRACE_LEN(rec));
+				else if (TRACE_OP(rec) == TRACE_WRITE)
+					sim_write(&s, phase, rec->offset, TRACE_LEN(rec));
+			}
+
+			snprintf(label, sizeof(label), "%d/%d", sizes[i], depths[j]);
+			print_row(label, &s.total);
+			for (k = 0; per_phase && k <= NUM_PHASES; k++)
+			{
+				if (s.phase[k].reads + s.phase[k].writes == 0)
+					continue;
+				snprintf(label, sizeof(label), "  %s", phase_names[k]);
+				print_row(label, &s.phase[k]);
+			}
+			lru_free(&s.cache);
+		}
+
+	free(recs);
+	return 0;
+}
+
@@ -18,8 +18,17 @@
 #include "ext2_fs.h"
 #include "utility.h"
 #include "readwrite.h"
+#include "icache.h"
+#include "isummary.h"
 #include "fsck.h"
 #include "traverse.h"
+#include "directory.h"
+#include "blockiter.h"
+#include "blockmap.h"
+#include "inodemap.h"
+#include "trace.h"
+#include "problem.h"
+#include "incremental.h"
 
 /*** global variables ***/
 /** partition information */
@@ -28,14 +37,74 @@ extern partition_t pt_info;
 extern superblock_t sb;
 /** block group discriptor table */
 extern struct ext2_group_desc* bg_desc_table;
-/** local inode map */
-extern int* my_inode_map;
+/** local inode map, a saturating count per inode */
+extern unsigned char* my_inode_map;
 /** local local map */
-extern int* my_block_map;
+extern block_map_group_t* my_block_map;
 /** disk bitmap */
 extern unsigned char* bitmap;
 
 
+/** @brief directory being traversed */
+typedef struct traverse_ctx
+{
+	unsigned int current_dir;
+	unsigned int parent_dir;
+	incr_rec_t* rec;    /* entries and blocks for the fingerprints */
+} traverse_ctx_t;
+
+
+/** @brief block visitor traversing the data blocks of a directory
+ *
+ *  @param block physical block number
+ *  @param logical logical block number
+ *  @param kind block kind
+ *  @param buf block content
+ *  @param priv traverse_ctx_t of the directory
+ *  @return ITER_CONTINUE
+ */
+static int traverse_visitor(unsigned int block, long logical, int kind,
+                            unsigned char* buf, void* priv)
+{
+	traverse_ctx_t* ctx = (traverse_ctx_t*)priv;
+
+	if (ctx->rec != NULL)
+		incr_rec_block(ctx->rec, block);
+	if (kind != BLOCK_DATA)
+		return ITER_CONTINUE;
+
+	long disk_offset = pt_info.base + (long)block * sb.block_size;
+	traverse_direct_block(disk_offset, logical, buf,
+	                      ctx->current_dir, ctx->parent_dir, ctx->rec);
+	return ITER_CONTINUE;
+}
+
+
+/** @brief count the saved entries of a directory and descend into its
+ *   subdirectories, as traverse_direct_block would for its blocks
+ *
+ *  @param inode_num inode number of the directory
+ *  @param entries saved entries
+ *  @param num_entries number of entries
+ *  @return void
+ */
+static void replay_dir(unsigned int inode_num, uint32_t* entries,
+                       int num_entries)
+{
+	int i = 0;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		unsigned int child = entries[i] & INCR_INODE_MASK;
+		if (child > sb.num_inodes)
+			continue;
+		int links = inode_map_inc(child);
+		if ((entries[i] & INCR_SUBDIR) && links <= 1)
+			traverse_dir(child, inode_num);
+	}
+}
+
+
 /** @brief traverse directory and collect file and dir information 
  *
  *  @param inode_num inode number of current directory
@@ -45,210 +114,127 @@ extern unsigned char* bitmap;
 void traverse_dir(unsigned int inode_num, unsigned int parent)
 {
 	struct ext2_inode inode;
-	int inode_addr = 0;
-	
-	/* get inode addr (in byte) from inode number */
-	inode_addr = get_inode_addr(inode_num);
+	unsigned int outer = trace_set_inode(inode_num);
 	
-	/* read inode information from inode table entry */
-	read_bytes(inode_addr, &inode, sizeof(struct ext2_inode));
+	/* mode and block pointers, from the summary if it has them. The
+	 * fingerprints also keep the times of the directory. */
+	if (incr_enabled())
+		read_inode(inode_num, &inode);
+	else
+		isum_get_inode(inode_num, &inode);
 
 	/* if it's not a directory, return */
 	if(!EXT2_S_ISDIR(inode.i_mode))
+	{
+		trace_set_inode(outer);
 		return;
+	}
 
-	unsigned char buf[sb.block_size]; /* 1024 bytes */
-	/* search in direct blocks */
-	int i = 0;
-	for(i = 0; i < EXT2_NDIR_BLOCKS; i++)
+	/* a directory unchanged since the last check is not read again */
+	uint32_t* cached = NULL;
+	int num_cached = incr_cached_dir(inode_num, parent, &inode, &cached);
+	if (num_cached >= 0)
 	{
-		if (inode.i_block[i] <= 0)
-			continue;
-		if (inode_num == 11)
-			printf("traversing direct block[%d] of indoe 11\n", i);
-			
-		int disk_offset = pt_info.base + inode.i_block[i] * sb.block_size;
-		read_bytes(disk_offset, buf, sb.block_size);
-
-		/* traverse direct block[i] */
-		traverse_direct_block(disk_offset, i, buf, inode_num, parent);
+		incr_keep_dir(inode_num);
+		replay_dir(inode_num, cached, num_cached);
+		trace_set_inode(outer);
+		return;
 	}
-	
-	/* traverse singly indirect block */
-	read_bytes(pt_info.base + inode.i_block[EXT2_IND_BLOCK] * sb.block_size, 
-			    buf, sb.block_size);
-	traverse_singly((unsigned int*)buf, inode_num, parent);
-	
-	/* traverse doubly indirect block */
-	read_bytes(pt_info.base + inode.i_block[EXT2_DIND_BLOCK] * sb.block_size, 
-			    buf, sb.block_size);
-	traverse_doubly((unsigned int*)buf, inode_num, parent);
-	
-	/* traverse triply indirect block */
-	read_bytes(pt_info.base + inode.i_block[EXT2_TIND_BLOCK] * sb.block_size, 
-			    buf, sb.block_size);
-	traverse_triply((unsigned int*)buf, inode_num, parent);
 
+	incr_rec_t rec;
+	memset(&rec, 0, sizeof(rec));
+
+	traverse_ctx_t ctx;
+	ctx.current_dir = inode_num;
+	ctx.parent_dir = parent;
+	ctx.rec = incr_enabled() ? &rec : NULL;
+
+	/* traverse all data blocks of the directory */
+	iterate_blocks(&inode, ITER_READ_DATA, traverse_visitor, &ctx);
+	if (ctx.rec != NULL)
+		incr_end_dir(inode_num, &inode, &rec);
+
+	trace_set_inode(outer);
 	return;
 }
 
 
 /** @brief traverse in direct block of a directory 
  *  
+ *  @param block_offset disk offset of the block
+ *  @param block_num logical block number in the directory
  *  @param buf block content
  *  @param current_dir inode number of current dir
  *  @param parent_dir inode nmber of parent dir
+ *  @param rec record of the entries for the fingerprints or NULL
  */
-void traverse_direct_block(int block_offset,
+void traverse_direct_block(long block_offset,
 						   int block_num,
 						   unsigned char* buf, 
                            unsigned int current_dir, 
-                           unsigned int parent_dir)
+                           unsigned int parent_dir,
+                           incr_rec_t* rec)
 {
-	struct ext2_dir_entry_2 dir_entry;
-
-	int dir_entry_base = 0;
+	dirent_iter_t it;
+	dirent_view_t dir_entry;
 
 	int cnt = 1;
-	while(dir_entry_base < sb.block_size)
+	dirent_iter_init(&it, buf, sb.block_size);
+	for (; dirent_next(&it, &dir_entry); cnt++)
 	{
-		dir_entry.file_type = *(__u8*)(buf + dir_entry_base + 7);
-		/* no more directory entries in this block */
-
-		dir_entry.inode = *(__u32*)(buf + dir_entry_base + 0);
-		dir_entry.rec_len = *(__u16*)(buf + dir_entry_base + 4);
-		dir_entry.name_len = *(__u8*)(buf + dir_entry_base + 6);
-		memcpy(dir_entry.name, buf + dir_entry_base + 8, dir_entry.name_len);
-		dir_entry.name[dir_entry.name_len+1] = '\0';
-		
 		/* check '.' entry */
 		if (cnt == 1 && block_num == 0)
 		{
-			if(strcmp(dir_entry.name, ".") != 0 || 
-			          dir_entry.inode != current_dir)
+			if (!dirent_name_is(&dir_entry, ".", 1) || 
+			    dir_entry.inode != current_dir)
 			{
-				printf("error in \".\" of dir %d should be %d\n", 
-				        dir_entry.inode, current_dir);
+				problem_report(PR_DOT,
+				               "error in \".\" of dir %d should be %d",
+				               dir_entry.inode, current_dir);
 				/* write back to disk */
 				set_inode_num(current_dir, parent_dir, 
-				              block_offset + dir_entry_base, FIX_SELF);
+				              block_offset + dir_entry.offset, FIX_SELF);
 				/* update block buf */
-				*(__u32*)(buf + dir_entry_base + 0) = current_dir;
+				*(__u32*)dir_entry.ptr = dir_entry.inode = current_dir;
 			}
 		}
 		/* check '..' entry */
 		if (cnt == 2 && block_num == 0)
 		{
-			if(strcmp(dir_entry.name, "..") != 0 || 
-			          dir_entry.inode != parent_dir)
+			if (!dirent_name_is(&dir_entry, "..", 2) || 
+			    dir_entry.inode != parent_dir)
 			{
-				printf("error \"..\" in dir %d, should be %d\n", 
-				        current_dir, parent_dir);
+				problem_report(PR_DOTDOT,
+				               "error \"..\" in dir %d, should be %d",
+				               current_dir, parent_dir);
 				/* write back to disk */
 				set_inode_num(current_dir, parent_dir, 
-				              block_offset + dir_entry_base, FIX_PARENT);
+				              block_offset + dir_entry.offset, FIX_PARENT);
 				/* update block buf */
-				*(__u32*)(buf + dir_entry_base + 0) = parent_dir;
+				*(__u32*)dir_entry.ptr = dir_entry.inode = parent_dir;
 			}
 		}
-		/* get inode again after possible fix */
-		dir_entry.inode = *(__u32*)(buf + dir_entry_base + 0);
-		
+
+		/* an unused entry refers to nothing */
+		if (dir_entry.inode == 0 || dir_entry.inode > sb.num_inodes)
+			continue;
+
 		/* update local inode map */
-		if (dir_entry.inode <= sb.num_inodes)
-		{
-			my_inode_map[dir_entry.inode] += 1;
-			if (dir_entry.inode == 4099 || dir_entry.inode == 4100)
-			{
-				printf("adding my_inode_map[%d] in parent %d\n", current_dir, parent_dir);
-			}
-		}
+		int links = inode_map_inc(dir_entry.inode);
 		
 		/* recursively traverse sub-directory in this folder */
-		if (dir_entry.file_type == EXT2_FT_DIR 
-		  && my_inode_map[dir_entry.inode] <= 1
-		  && (cnt>2 || block_num > 0) )
+		int subdir = dir_entry.file_type == EXT2_FT_DIR 
+		             && (cnt>2 || block_num > 0);
+		if (rec != NULL)
+			incr_rec_entry(rec, dir_entry.inode, subdir);
+		if (subdir && links <= 1)
 			traverse_dir(dir_entry.inode, current_dir);
-		
-		dir_entry_base += dir_entry.rec_len;
-		cnt++;
-	}
-	return;
-}
-
-
-/** @brief traverse in singly indirect block of a directory 
- *  
- *  @param buf block content
- *  @param current_dir inode number of current dir
- *  @param parent_dir inode nmber of parent dir
- */
-void traverse_singly(unsigned int* singly_buf, 
-                     unsigned int current_dir, 
-                     unsigned int parent_dir)
-{
-	unsigned char direct_buf[sb.block_size];
-	int i = 0;
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (singly_buf[i] == 0)
-			break;
-
-		int disk_offset = pt_info.base + singly_buf[i] * sb.block_size;
-		read_bytes(disk_offset, direct_buf, sb.block_size);
-		traverse_direct_block(disk_offset, 1, direct_buf, 
-		                      current_dir, parent_dir);
-	}
-	return;
-}
-
-
-/** @brief traverse in doubly indirect block of a directory 
- *  
- *  @param buf block content
- *  @param current_dir inode number of current dir
- *  @param parent_dir inode nmber of parent dir
- */
-void traverse_doubly(unsigned int* doubly_buf, 
-                     unsigned int current_dir, 
-                     unsigned int parent_dir)
-{
-	unsigned int singly_buf[sb.block_size];
-	int i = 0;
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (doubly_buf[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + doubly_buf[i] * sb.block_size,
-		            singly_buf, sb.block_size);
-		traverse_singly(singly_buf, current_dir, parent_dir);
 	}
-	return;
-}
-
 
-/** @brief traverse in triply indirect block of a directory 
- *  
- *  @param buf block content
- *  @param current_dir inode number of current dir
- *  @param parent_dir inode nmber of parent dir
- */
-void traverse_triply(unsigned int* triply_buf, 
-                     unsigned int current_dir, 
-                     unsigned int parent_dir)
-{
-	unsigned int doubly_buf[sb.block_size];
-	int i = 0;
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (triply_buf[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + triply_buf[i] * sb.block_size,
-		            doubly_buf, sb.block_size);
-		traverse_singly(doubly_buf, current_dir, parent_dir);
-	}
+	/* entries behind a bad one cannot be located */
+	if (it.error != DIRENT_OK)
+		problem_report(PR_DIR_ENTRY, "bad entry at offset %d of block %d "
+		               "in dir %d, rest of the block skipped",
+		               it.offset, block_num, current_dir);
 	return;
 }
-
@@ -19,6 +19,10 @@
 #include "utility.h"
 #include "readwrite.h"
 #include "fsck.h"
+#include "bufpool.h"
+#include "blockiter.h"
+#include "directory.h"
+#include "htree.h"
 
 
 /** partition information */
@@ -35,18 +39,17 @@ extern struct ext2_group_desc* bg_desc_table;
  *  @param inode_num inode number
  *  @param base address of indoe entry (in byte)
  */
-int get_inode_addr(int inode_num)
+long get_inode_addr(int inode_num)
 {
 	/* remember: inode number starts from 1 */
 	int group_index = (inode_num - 1) / sb.inodes_per_group;
 	int inode_index = (inode_num - 1) % sb.inodes_per_group;
 
-	int pt_base = pt_info.start_sec * SECTOR_SIZE;
-	int table_offset = bg_desc_table[group_index].bg_inode_table 
-	                 * sb.block_size;
-	int inode_offset = inode_index * sb.inode_size;
+	long table_offset = (long)bg_desc_table[group_index].bg_inode_table
+	                    * sb.block_size;
+	long inode_offset = (long)inode_index * sb.inode_size;
 
-	return pt_base + table_offset + inode_offset;
+	return pt_info.base + table_offset + inode_offset;
 }
 
 
@@ -56,15 +59,17 @@ int get_inode_addr(int inode_num)
  *  @index bit index in the bitmap
  *  @return >0 allocated or 0 not allocated
  */
-int check_bitmap(int bitmap_base, int index)
+int check_bitmap(long bitmap_base, int index)
 {
-	unsigned char buf[sb.block_size];
+	unsigned char* buf = acquire_block_buf();
 	read_bytes(bitmap_base, buf, sb.block_size);
 	
 	int byte_index = index / 8;
 	int offset = index % 8;
+	int ret = (buf[byte_index] & (1 << offset));
 
-	return (buf[byte_index] & (1 << offset));
+	release_block_buf(buf);
+	return ret;
 }
 
 
@@ -104,117 +109,75 @@ int imode_to_filetype(__u16 i_mode)
  */
 int search_filename_in_dir_block(unsigned char* block, char* filename)
 {
-	__u32 inode_num = 0;
-	__u16 entry_size = 0;
-	__u8 name_len = 0;
-	__u8 type = 0;
-	char name[EXT2_NAME_LEN + 1];
-
-	int dir_entry_base = 0;
-	while(dir_entry_base < sb.block_size)
+	dirent_iter_t it;
+	dirent_view_t dir_entry;
+	int len = strlen(filename);
+
+	dirent_iter_init(&it, block, sb.block_size);
+	while (dirent_next(&it, &dir_entry))
 	{
-		type = *(__u8*)(block + dir_entry_base + 7);
-		/* no more directory entries in this block */
-		if(type == EXT2_FT_UNKNOWN)
-		{
-			return -1;
-		}
-		entry_size = *(__u16*)(block + dir_entry_base + 4);
-		name_len = *(__u8*)(block + dir_entry_base + 6);
-		memcpy(name, block + dir_entry_base + 8, name_len);
-		name[name_len] = '\0';
-		
-		
-		/* if find the filename, return inode number */
-		if(strcmp(filename, name) == 0)
-		{
-			inode_num = *(__u32*)(block + dir_entry_base + 0);
-			return inode_num;
-		}
-		
-		dir_entry_base += entry_size;
+		/* if find the filename in a used entry, return inode number */
+		if (dir_entry.inode != 0 && dirent_name_is(&dir_entry, filename, len))
+			return dir_entry.inode;
 	}
 	return -1;
 }
 
 
-/** @brief search a filename in a singly indirect block of a directory
- *  
- *  @param block block buffer
- *  @param filename filename to search
- *  @return inode_num success or -1 fail
- */
-int search_filename_in_singly(unsigned int* block, char* filename)
+/** @brief name being looked up */
+typedef struct search_ctx
 {
- 	unsigned char buf[sb.block_size];
-	int inode_num = -1;
-	int i = 0;
+	char* filename;
+	int inode_num;
+} search_ctx_t;
 
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (block[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + block[i] * sb.block_size,
-		            buf, sb.block_size);
-		inode_num = search_filename_in_dir_block(buf, filename);
-		if (inode_num > 0)
-			return inode_num;
-	}
-	return -1;
-}
 
-
-/** @brief search a filename in a doubly indirect block of a directory
- *  
- *  @param block block buffer
- *  @param filename filename to search
- *  @return inode_num success or -1 fail
+/** @brief block visitor searching a filename in a directory block
+ *
+ *  @param block physical block number
+ *  @param logical logical block number
+ *  @param kind block kind
+ *  @param buf block content
+ *  @param priv search_ctx_t of the lookup
+ *  @return ITER_STOP once the name is found, else ITER_CONTINUE
  */
-int search_filename_in_doubly(unsigned int* block, char* filename)
+static int search_visitor(unsigned int block, long logical, int kind,
+                          unsigned char* buf, void* priv)
 {
-	unsigned int buf[sb.block_size];
-	int inode_num = -1;
-	int i = 0;
-	
-	for(i = 0; i < (sb.block_size / 4); i++)
-	{
-		if (block[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + block[i] * sb.block_size,
-		            buf, sb.block_size);
-		inode_num = search_filename_in_singly(buf, filename);
-		if (inode_num > 0)
-			return inode_num;
-	}
-	return -1;
+	search_ctx_t* ctx = (search_ctx_t*)priv;
+
+	if (kind != BLOCK_DATA)
+		return ITER_CONTINUE;
+
+	ctx->inode_num = search_filename_in_dir_block(buf, ctx->filename);
+	return ctx->inode_num > 0 ? ITER_STOP : ITER_CONTINUE;
 }
 
 
-/** @brief search a filename in a triply indirect block of a directory
+/** @brief search a filename in all blocks of a directory
  *  
- *  @param block block buffer
+ *  @param inode inode struct of the directory
  *  @param filename filename to search
  *  @return inode_num success or -1 fail
  */
-int search_filename_in_triply(unsigned int* block, char* filename)
+int search_filename_in_dir(struct ext2_inode* inode, char* filename)
 {
-	unsigned int buf[sb.block_size];
-	int inode_num = -1;
-	int i = 0;
-	
-	for(i = 0; i < (sb.block_size / 4); i++)
+	search_ctx_t ctx;
+	ctx.filename = filename;
+	ctx.inode_num = -1;
+
+	/* an indexed directory finds the name in one leaf. A name the
+	 * index misses may still be in a block it does not cover. */
+	if (inode->i_flags & EXT2_INDEX_FL)
 	{
-		if (block[i] == 0)
-			break;
-
-		read_bytes(pt_info.base + block[i] * sb.block_size,
-		            buf, sb.block_size);
-		inode_num = search_filename_in_doubly(buf, filename);
-		if (inode_num > 0)
-			return inode_num;
+		ctx.inode_num = htree_lookup(inode, filename);
+		if (ctx.inode_num > 0)
+			return ctx.inode_num;
 	}
+
+	if (iterate_blocks(inode, ITER_READ_DATA, search_visitor, &ctx)
+	    == ITER_STOP)
+		return ctx.inode_num;
 	return -1;
 }
 
@@ -223,20 +186,13 @@ int search_filename_in_triply(unsigned int* block, char* filename)
  *  
  *  @param s
  *  @param a
- *  @return int
+ *  @return 1 if s is a^k for some k >= 0, else 0
  */
 int ispowerof(int s, int a)
 {
-	if (s <= 0 || a <= 0)
+	if (s <= 0 || a <= 1)
 		return 0;
-	while (1)
-	{
-		if (s <= a)
-			break;
+	while (s % a == 0)
 		s = s / a;
-	}
-	if (s % a == 0)
-		return 1;
-	else
-		return 0;
+	return s == 1;
 }